@@ -80,6 +80,7 @@ enum {
 	TRACECMD_OPTION_HOOK,
 	TRACECMD_OPTION_OFFSET,
 	TRACECMD_OPTION_CPUCOUNT,
+	TRACECMD_OPTION_COMPRESSION,
 };
 
 enum {
@@ -95,6 +96,19 @@ struct tracecmd_ftrace {
 	int long_size;
 };
 
+/*
+ * The records of a page, read with tracecmd_read_page_records().
+ * The records point into the page, which is held until the next read or
+ * until tracecmd_free_page_records(). They must not be freed with
+ * free_record(). Zero the structure before the first read.
+ */
+struct tracecmd_page_records {
+	struct tep_record		*records;
+	int				nr_records;
+	int				size;
+	void				*page;
+};
+
 typedef void (*tracecmd_show_data_func)(struct tracecmd_input *handle,
 					struct tep_record *record);
 typedef void (*tracecmd_handle_init_func)(struct tracecmd_input *handle,
@@ -154,6 +168,10 @@ tracecmd_peek_data_ref(struct tracecmd_input *handle, int cpu)
 struct tep_record *
 tracecmd_read_data(struct tracecmd_input *handle, int cpu);
 
+int tracecmd_read_page_records(struct tracecmd_input *handle, int cpu,
+			       struct tracecmd_page_records *recs);
+void tracecmd_free_page_records(struct tracecmd_page_records *recs);
+
 struct tep_record *
 tracecmd_read_prev(struct tracecmd_input *handle, struct tep_record *record);
 
@@ -163,6 +181,8 @@ tracecmd_read_next_data(struct tracecmd_input *handle, int *rec_cpu);
 struct tep_record *
 tracecmd_peek_next_data(struct tracecmd_input *handle, int *rec_cpu);
 
+void tracecmd_filter_next_cpus(struct tracecmd_input *handle, int *cpus);
+
 struct tep_record *
 tracecmd_read_at(struct tracecmd_input *handle, unsigned long long offset,
 		 int *cpu);
@@ -181,6 +201,9 @@ int tracecmd_set_cpu_to_timestamp(struct tracecmd_input *handle,
 void
 tracecmd_set_all_cpus_to_timestamp(struct tracecmd_input *handle,
 				   unsigned long long time);
+int tracecmd_cpu_pages_in_range(struct tracecmd_input *handle, int cpu,
+				unsigned long long start,
+				unsigned long long end);
 
 int tracecmd_set_cursor(struct tracecmd_input *handle,
 			int cpu, unsigned long long offset);
@@ -257,8 +280,30 @@ int tracecmd_append_cpu_data(struct tracecmd_output *handle,
 int tracecmd_append_buffer_cpu_data(struct tracecmd_output *handle,
 				    struct tracecmd_option *option,
 				    int cpus, char * const *cpu_data_files);
+int tracecmd_wait_cpu_data(struct tracecmd_output *handle);
 int tracecmd_attach_cpu_data(char *file, int cpus, char * const *cpu_data_files);
 int tracecmd_attach_cpu_data_fd(int fd, int cpus, char * const *cpu_data_files);
+int tracecmd_output_set_compression(struct tracecmd_output *handle,
+				    const char *spec);
+
+/* --- Compression of the trace data --- */
+
+/* The number of pages compressed together (in the "flycompr" section) */
+#define TRACECMD_COMPRESS_CHUNK_PAGES	64
+
+struct tracecmd_compression;
+
+struct tracecmd_compression *tracecmd_compress_alloc(const char *spec);
+void tracecmd_compress_free(struct tracecmd_compression *compress);
+const char *tracecmd_compress_name(struct tracecmd_compression *compress);
+size_t tracecmd_compress_bound(struct tracecmd_compression *compress,
+			       size_t size);
+long tracecmd_compress(struct tracecmd_compression *compress,
+		       void *out, size_t out_size,
+		       const void *in, size_t in_size);
+long tracecmd_uncompress(struct tracecmd_compression *compress,
+			 void *out, size_t out_size,
+			 const void *in, size_t in_size);
 
 /* --- Reading the Fly Recorder Trace --- */
 
@@ -266,6 +311,8 @@ enum {
 	TRACECMD_RECORD_NOSPLICE	= (1 << 0),	/* Use read instead of splice */
 	TRACECMD_RECORD_SNAPSHOT	= (1 << 1),	/* extract from snapshot */
 	TRACECMD_RECORD_BLOCK		= (1 << 2),	/* Block on splice write */
+	TRACECMD_RECORD_POLL		= (1 << 3),	/* Wait for data in poll */
+	TRACECMD_RECORD_URING		= (1 << 4),	/* Use io_uring if possible */
 };
 
 void tracecmd_free_recorder(struct tracecmd_recorder *recorder);
@@ -275,8 +322,14 @@ struct tracecmd_recorder *tracecmd_create_recorder_maxkb(const char *file, int c
 struct tracecmd_recorder *tracecmd_create_buffer_recorder_fd(int fd, int cpu, unsigned flags, const char *buffer);
 struct tracecmd_recorder *tracecmd_create_buffer_recorder(const char *file, int cpu, unsigned flags, const char *buffer);
 struct tracecmd_recorder *tracecmd_create_buffer_recorder_maxkb(const char *file, int cpu, unsigned flags, const char *buffer, int maxkb);
+struct tracecmd_recorder *tracecmd_create_recorder_segments(const char *file, int cpu, unsigned flags, int maxkb, int segments);
+struct tracecmd_recorder *tracecmd_create_buffer_recorder_segments(const char *file, int cpu, unsigned flags, const char *buffer, int maxkb, int segments);
 
 int tracecmd_start_recording(struct tracecmd_recorder *recorder, unsigned long sleep);
+int tracecmd_start_recording_poll(struct tracecmd_recorder **recorders,
+				  int nr_recorders, unsigned long sleep);
+int tracecmd_start_recording_uring(struct tracecmd_recorder **recorders,
+				   int nr_recorders, unsigned long sleep);
 void tracecmd_stop_recording(struct tracecmd_recorder *recorder);
 void tracecmd_stat_cpu(struct trace_seq *s, int cpu);
 long tracecmd_flush_recording(struct tracecmd_recorder *recorder);
@@ -320,12 +373,16 @@ int tracecmd_msg_metadata_send(struct tracecmd_msg_handle *msg_handle,
 			       const char *buf, int size);
 int tracecmd_msg_finish_sending_metadata(struct tracecmd_msg_handle *msg_handle);
 void tracecmd_msg_send_close_msg(struct tracecmd_msg_handle *msg_handle);
+int tracecmd_msg_data_send(struct tracecmd_msg_handle *msg_handle,
+			   int cpu, const char *buf, int size);
 
 /* for server */
 int tracecmd_msg_initial_setting(struct tracecmd_msg_handle *msg_handle);
 int tracecmd_msg_send_port_array(struct tracecmd_msg_handle *msg_handle,
 				 int *ports);
 int tracecmd_msg_collect_metadata(struct tracecmd_msg_handle *msg_handle, int ofd);
+long long tracecmd_msg_collect_data(struct tracecmd_msg_handle *msg_handle,
+				    int *ofds);
 bool tracecmd_msg_done(struct tracecmd_msg_handle *msg_handle);
 void tracecmd_msg_set_done(struct tracecmd_msg_handle *msg_handle);
 
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: LGPL-2.1 */
+#ifndef _TRACE_HEAP_H
+#define _TRACE_HEAP_H
+
+/*
+ * An indexed binary min-heap, used to merge the time-ordered streams of
+ * records of multiple CPUs. Each item is identified by a small integer
+ * (the CPU) and has a key (the timestamp of the CPU's next record).
+ * Items with equal keys are ordered by their ids, so that the lowest CPU
+ * wins a tie.
+ */
+struct tracecmd_heap_item {
+	unsigned long long	key;
+	int			id;
+};
+
+struct tracecmd_heap {
+	/* The items, ordered as a heap */
+	struct tracecmd_heap_item	*heap;
+	/* The position of each id in the heap, -1 if not in the heap */
+	int				*pos;
+	/* The number of items in the heap */
+	int				nr_items;
+	/* The maximum id + 1 */
+	int				size;
+};
+
+int tracecmd_heap_init(struct tracecmd_heap *heap, int size);
+void tracecmd_heap_free(struct tracecmd_heap *heap);
+void tracecmd_heap_update(struct tracecmd_heap *heap, int id,
+			  unsigned long long key);
+void tracecmd_heap_remove(struct tracecmd_heap *heap, int id);
+
+static inline int tracecmd_heap_empty(struct tracecmd_heap *heap)
+{
+	return !heap->nr_items;
+}
+
+/* Returns the id of the item with the smallest key, or -1 if empty */
+static inline int tracecmd_heap_top(struct tracecmd_heap *heap)
+{
+	return heap->nr_items ? heap->heap[0].id : -1;
+}
+
+static inline unsigned long long
+tracecmd_heap_top_key(struct tracecmd_heap *heap)
+{
+	return heap->heap[0].key;
+}
+
+#endif /* _TRACE_HEAP_H */
@@ -258,9 +258,12 @@ struct tep_print_arg {
 	};
 };
 
+struct tep_print_prog;
+
 struct tep_print_fmt {
 	char			*format;
 	struct tep_print_arg	*args;
+	struct tep_print_prog	*prog;
 };
 
 struct tep_event_format {
@@ -352,7 +355,8 @@ enum tep_flag {
 	_PE(FILTER_NOT_FOUND,	"no filter found"),			      \
 	_PE(NOT_A_NUMBER,	"must have number field"),		      \
 	_PE(NO_FILTER,		"no filters exists"),			      \
-	_PE(FILTER_MISS,	"record does not match to filter")
+	_PE(FILTER_MISS,	"record does not match to filter"),	      \
+	_PE(HANDLE_FROZEN,	"cannot modify a frozen handle")
 
 #undef _PE
 #define _PE(__code, __str) TEP_ERRNO__ ## __code
@@ -577,6 +581,9 @@ struct tep_handle *tep_alloc(void);
 void tep_free(struct tep_handle *pevent);
 void tep_ref(struct tep_handle *pevent);
 void tep_unref(struct tep_handle *pevent);
+int tep_freeze(struct tep_handle *pevent);
+void tep_thaw(struct tep_handle *pevent);
+int tep_is_frozen(struct tep_handle *pevent);
 
 /* access to the internal parser */
 void tep_buffer_init(const char *buf, unsigned long long size);
@@ -706,10 +713,14 @@ struct tep_filter_arg {
 	};
 };
 
+struct tep_filter_prog;
+
 struct tep_filter_type {
 	int			event_id;
 	struct tep_event_format	*event;
 	struct tep_filter_arg	*filter;
+	/* @filter compiled for tep_filter_match(), if it could be */
+	struct tep_filter_prog	*prog;
 };
 
 #define TEP_FILTER_ERROR_BUFSZ  1024
@@ -718,6 +729,9 @@ struct tep_event_filter {
 	struct tep_handle	*pevent;
 	int			filters;
 	struct tep_filter_type	*event_filters;
+	/* event id to index + 1 in event_filters, 0 for no filter */
+	int			*id_map;
+	int			id_map_size;
 	char			error_buffer[TEP_FILTER_ERROR_BUFSZ];
 };
 
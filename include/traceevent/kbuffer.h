@@ -28,6 +28,22 @@ enum {
 
 struct kbuffer;
 
+/**
+ * struct kbuffer_event - a decoded event of a subbuffer
+ * @ts:			The timestamp of the event
+ * @offset:		Offset of the record from the start of the subbuffer
+ * @index:		Offset of the event data from the start of the subbuffer
+ * @size:		The size of the event data
+ * @record_size:	The size of the entire record (meta data and payload)
+ */
+struct kbuffer_event {
+	unsigned long long	ts;
+	unsigned int		offset;
+	unsigned int		index;
+	unsigned int		size;
+	unsigned int		record_size;
+};
+
 struct kbuffer *kbuffer_alloc(enum kbuffer_long_size size, enum kbuffer_endian endian);
 void kbuffer_free(struct kbuffer *kbuf);
 int kbuffer_load_subbuffer(struct kbuffer *kbuf, void *subbuffer);
@@ -41,6 +57,9 @@ void *kbuffer_translate_data(int swap, void *data, unsigned int *size);
 
 void *kbuffer_read_at_offset(struct kbuffer *kbuf, int offset, unsigned long long *ts);
 
+int kbuffer_decode_events(struct kbuffer *kbuf, struct kbuffer_event *events, int max);
+int kbuffer_max_events(struct kbuffer *kbuf);
+
 int kbuffer_curr_index(struct kbuffer *kbuf);
 
 int kbuffer_curr_offset(struct kbuffer *kbuf);
@@ -46,6 +46,8 @@ extern int trace_seq_vprintf(struct trace_seq *s, const char *fmt, va_list args)
 
 extern int trace_seq_puts(struct trace_seq *s, const char *str);
 extern int trace_seq_putc(struct trace_seq *s, unsigned char c);
+extern int trace_seq_putmem(struct trace_seq *s, const void *mem,
+			    unsigned int len);
 
 extern void trace_seq_terminate(struct trace_seq *s);
 
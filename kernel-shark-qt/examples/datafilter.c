@@ -124,8 +124,7 @@ int main(int argc, char **argv)
 				  "sched/sched_wakeup:target_cpu==1");
 
 	/* The Advanced filter requires reloading the data. */
-	for (i = 0; i < n_rows; ++i)
-		free(data[i]);
+	kshark_free_data_entries(kshark_ctx, sd);
 
 	n_rows = kshark_load_data_entries(kshark_ctx, sd, &data);
 
@@ -142,9 +141,7 @@ int main(int argc, char **argv)
 	}
 
 	/* Free the memory. */
-	for (i = 0; i < n_rows; ++i)
-		free(data[i]);
-
+	kshark_free_data_entries(kshark_ctx, sd);
 	free(data);
 
 	/* Close the file. */
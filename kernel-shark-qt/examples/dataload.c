@@ -71,9 +71,7 @@ int main(int argc, char **argv)
 	}
 
 	/* Free the memory. */
-	for (r = 0; r < n_rows; ++r)
-		free(data[r]);
-
+	kshark_free_data_entries(kshark_ctx, sd);
 	free(data);
 
 	/* Close the file. */
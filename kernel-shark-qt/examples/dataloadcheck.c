@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Checks that loading a trace data file with several threads gives the
+ * same entries as loading it with a single thread: the same order, the
+ * same values (ts, cpu, pid, event_id, offset, visible), and the same
+ * per-CPU links between the entries.
+ *
+ * Usage: dlcheck [trace.dat] [number of loading threads (default 8)]
+ */
+
+// C
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+// KernelShark
+#include "libkshark.h"
+
+const char *default_file = "trace.dat";
+
+/* The entries of a CPU are identified by their offset in the file. */
+static bool same_next(struct kshark_entry *s, struct kshark_entry *p)
+{
+	if (!s->next || !p->next)
+		return s->next == p->next;
+
+	return s->next->cpu == p->next->cpu &&
+	       s->next->offset == p->next->offset;
+}
+
+static ssize_t load(struct kshark_context *kshark_ctx, const char *file,
+		    int n_threads, int *sd, struct kshark_entry ***data)
+{
+	*sd = kshark_open(kshark_ctx, file);
+	if (*sd < 0)
+		return -1;
+
+	kshark_ctx->n_load_threads = n_threads;
+
+	return kshark_load_data_entries(kshark_ctx, *sd, data);
+}
+
+int main(int argc, char **argv)
+{
+	struct kshark_entry **serial = NULL, **parallel = NULL;
+	struct kshark_context *kshark_ctx;
+	const char *file = default_file;
+	ssize_t n_serial, n_parallel, i;
+	int sd_serial, sd_parallel;
+	int n_threads = 8;
+	int bad = 0;
+
+	if (argc > 1)
+		file = argv[1];
+
+	if (argc > 2)
+		n_threads = atoi(argv[2]);
+
+	/* Create a new kshark session. */
+	kshark_ctx = NULL;
+	if (!kshark_instance(&kshark_ctx))
+		return 1;
+
+	/* Load the file twice, as two data streams. */
+	n_serial = load(kshark_ctx, file, 1, &sd_serial, &serial);
+	n_parallel = load(kshark_ctx, file, n_threads, &sd_parallel, &parallel);
+	if (n_serial < 0 || n_parallel < 0) {
+		fprintf(stderr, "Failed to load %s\n", file);
+		kshark_free(kshark_ctx);
+		return 1;
+	}
+
+	printf("1 thread: %zd entries, %d threads: %zd entries\n",
+	       n_serial, n_threads, n_parallel);
+
+	if (n_serial != n_parallel)
+		bad = 1;
+
+	for (i = 0; !bad && i < n_serial; ++i) {
+		struct kshark_entry *s = serial[i], *p = parallel[i];
+
+		if (s->ts != p->ts || s->cpu != p->cpu || s->pid != p->pid ||
+		    s->event_id != p->event_id || s->offset != p->offset ||
+		    s->visible != p->visible) {
+			printf("entry %zd differs:\n", i);
+			printf("  1 thread:  ts %lu cpu %d pid %d event %d offset 0x%lx\n",
+			       s->ts, s->cpu, s->pid, s->event_id, s->offset);
+			printf("  %d threads: ts %lu cpu %d pid %d event %d offset 0x%lx\n",
+			       n_threads, p->ts, p->cpu, p->pid, p->event_id,
+			       p->offset);
+			bad = 1;
+			break;
+		}
+
+		if (!same_next(s, p)) {
+			printf("entry %zd is linked differently\n", i);
+			bad = 1;
+		}
+	}
+
+	puts(bad ? "FAIL" : "PASS");
+
+	/* Free the memory. */
+	kshark_free_data_entries(kshark_ctx, sd_serial);
+	kshark_free_data_entries(kshark_ctx, sd_parallel);
+	free(serial);
+	free(parallel);
+
+	/* Close the session. */
+	kshark_free(kshark_ctx);
+
+	return bad;
+}
@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Times the two ways of reading a trace data file in time order: the
+ * merge of all CPUs done by trace-cmd (tracecmd_read_next_data()) and the
+ * parallel load of KernelShark (kshark_load_data_entries()).
+ *
+ * Usage: dltime [trace.dat] [number of loading threads]
+ */
+
+// C
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// KernelShark
+#include "libkshark.h"
+
+const char *default_file = "trace.dat";
+
+static double time_diff(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) +
+	       (end->tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+	struct kshark_context *kshark_ctx;
+	struct kshark_entry **data = NULL;
+	struct timespec start, end;
+	struct tracecmd_input *handle;
+	struct tep_record *rec;
+	ssize_t n_rows;
+	size_t n_recs;
+	int ret = 0;
+	int sd;
+
+	/* Create a new kshark session. */
+	kshark_ctx = NULL;
+	if (!kshark_instance(&kshark_ctx))
+		return 1;
+
+	if (argc > 2)
+		kshark_ctx->n_load_threads = atoi(argv[2]);
+
+	/* Open a trace data file produced by trace-cmd. */
+	if (argc > 1)
+		sd = kshark_open(kshark_ctx, argv[1]);
+	else
+		sd = kshark_open(kshark_ctx, default_file);
+
+	if (sd < 0) {
+		kshark_free(kshark_ctx);
+		return 1;
+	}
+
+	handle = kshark_ctx->stream[sd]->handle;
+
+	/* Read all records, merging the CPUs one record at a time. */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	n_recs = 0;
+	while ((rec = tracecmd_read_next_data(handle, NULL))) {
+		free_record(rec);
+		n_recs++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("tracecmd_read_next_data:  %8zu records  %.3f s\n",
+	       n_recs, time_diff(&start, &end));
+
+	tracecmd_set_all_cpus_to_timestamp(handle, 0);
+
+	/* Load the content of the file into an array of entries. */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	n_rows = kshark_load_data_entries(kshark_ctx, sd, &data);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (n_rows < 0) {
+		fprintf(stderr, "kshark_load_data_entries: %s\n",
+			strerror(-n_rows));
+		ret = 1;
+	} else
+		printf("kshark_load_data_entries: %8zd entries  %.3f s\n",
+		       n_rows, time_diff(&start, &end));
+
+	/* Free the memory. */
+	kshark_free_data_entries(kshark_ctx, sd);
+	free(data);
+
+	/* Close the file. */
+	kshark_close(kshark_ctx, sd);
+
+	/* Close the session. */
+	kshark_free(kshark_ctx);
+
+	return ret;
+}
@@ -0,0 +1,155 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Times the two ways of merging the time ordered records of all CPUs:
+ * the linear scan of the next record of every CPU (as done by
+ * pick_next_cpu() before) and the min-heap of the CPUs used by
+ * tracecmd_peek_next_data() and by the KernelShark loading. The streams
+ * are synthetic, with the same total number of records for each number
+ * of CPUs.
+ *
+ * Usage: dmtime [total number of records (default 16M)]
+ */
+
+// C
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+// trace-cmd
+#include "trace-heap.h"
+
+static double time_diff(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) +
+	       (end->tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+/* The order of the records must be the same, hash the CPUs in order. */
+static uint64_t hash_cpu(uint64_t hash, int cpu)
+{
+	return (hash ^ cpu) * 1099511628211ULL;
+}
+
+static uint64_t merge_linear(uint64_t **ts, size_t *pos, size_t n_recs,
+			     int n_cpus)
+{
+	uint64_t hash = 0, next_ts;
+	int cpu, next_cpu;
+
+	for (;;) {
+		next_cpu = -1;
+		next_ts = 0;
+		for (cpu = 0; cpu < n_cpus; ++cpu) {
+			if (pos[cpu] == n_recs)
+				continue;
+
+			if (next_cpu < 0 || ts[cpu][pos[cpu]] < next_ts) {
+				next_ts = ts[cpu][pos[cpu]];
+				next_cpu = cpu;
+			}
+		}
+
+		if (next_cpu < 0)
+			return hash;
+
+		hash = hash_cpu(hash, next_cpu);
+		pos[next_cpu]++;
+	}
+}
+
+static uint64_t merge_heap(struct tracecmd_heap *heap, uint64_t **ts,
+			   size_t *pos, size_t n_recs, int n_cpus)
+{
+	uint64_t hash = 0;
+	int cpu;
+
+	for (cpu = 0; cpu < n_cpus; ++cpu)
+		tracecmd_heap_update(heap, cpu, ts[cpu][0]);
+
+	while ((cpu = tracecmd_heap_top(heap)) >= 0) {
+		hash = hash_cpu(hash, cpu);
+		if (++pos[cpu] < n_recs)
+			tracecmd_heap_update(heap, cpu, ts[cpu][pos[cpu]]);
+		else
+			tracecmd_heap_remove(heap, cpu);
+	}
+
+	return hash;
+}
+
+int main(int argc, char **argv)
+{
+	int cpu_counts[] = {1, 2, 4, 8, 16, 32, 64, 128, 256};
+	int n_counts = sizeof(cpu_counts) / sizeof(cpu_counts[0]);
+	struct timespec start, end;
+	struct tracecmd_heap heap;
+	size_t total = 1 << 24;
+	double t_linear, t_heap;
+	uint64_t h_linear, h_heap;
+	uint64_t **ts, t;
+	size_t n_recs, i;
+	int n_cpus, cpu, k;
+	size_t *pos;
+	int ret = 0;
+
+	if (argc > 1)
+		total = strtoul(argv[1], NULL, 0);
+
+	printf("%zu records\n", total);
+	printf("  cpus    linear      heap\n");
+
+	srand(1);
+	for (k = 0; k < n_counts; ++k) {
+		n_cpus = cpu_counts[k];
+		n_recs = total / n_cpus;
+		if (!n_recs)
+			break;
+
+		ts = calloc(n_cpus, sizeof(*ts));
+		pos = calloc(n_cpus, sizeof(*pos));
+		if (!ts || !pos || tracecmd_heap_init(&heap, n_cpus) < 0)
+			return 1;
+
+		/* Interleave the records of the CPUs, with some ties. */
+		for (cpu = 0; cpu < n_cpus; ++cpu) {
+			ts[cpu] = malloc(n_recs * sizeof(**ts));
+			if (!ts[cpu])
+				return 1;
+
+			t = rand() % 100;
+			for (i = 0; i < n_recs; ++i) {
+				t += 1 + rand() % (2 * n_cpus);
+				ts[cpu][i] = t;
+			}
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		h_linear = merge_linear(ts, pos, n_recs, n_cpus);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		t_linear = time_diff(&start, &end);
+
+		for (cpu = 0; cpu < n_cpus; ++cpu)
+			pos[cpu] = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		h_heap = merge_heap(&heap, ts, pos, n_recs, n_cpus);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		t_heap = time_diff(&start, &end);
+
+		printf("  %4d  %7.3f s %7.3f s%s\n", n_cpus, t_linear, t_heap,
+		       h_linear == h_heap ? "" : "  (different order)");
+		if (h_linear != h_heap)
+			ret = 1;
+
+		for (cpu = 0; cpu < n_cpus; ++cpu)
+			free(ts[cpu]);
+
+		free(ts);
+		free(pos);
+		tracecmd_heap_free(&heap);
+	}
+
+	return ret;
+}
@@ -215,8 +215,7 @@ int main(int argc, char **argv)
 	for (auto &g: graphs)
 		delete g;
 
-	for (r = 0; r < nRows; ++r)
-		free(data[r]);
+	kshark_free_data_entries(kshark_ctx, stream_id);
 	free(data);
 
 	/* Reset (clear) the model. */
@@ -86,14 +86,10 @@ int main(int argc, char **argv)
 	free(pids_f1);
 	free(pids_f2);
 
-	for (r = 0; r < n_rows_f1; ++r)
-		free(data_f1[r]);
-
+	kshark_free_data_entries(kshark_ctx, sd1);
 	free(data_f1);
 
-	for (r = 0; r < n_rows_f2; ++r)
-		free(data_f2[r]);
-
+	kshark_free_data_entries(kshark_ctx, sd2);
 	free(data_f2);
 
 	/* Close the session. */
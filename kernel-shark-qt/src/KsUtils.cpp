@@ -114,32 +114,44 @@ KsDataStore::~KsDataStore()
 void KsDataStore::loadDataFile(const QString &file)
 {
 	kshark_context *kshark_ctx(nullptr);
+	int sd;
 
 	if (!kshark_instance(&kshark_ctx))
 		return;
 
 	clear();
 
-	if (!kshark_open(kshark_ctx, file.toStdString().c_str())) {
+	sd = kshark_open(kshark_ctx, file.toStdString().c_str());
+	if (sd < 0) {
 		qCritical() << "ERROR Loading file " << file;
 		return;
 	}
 
-	_tep = kshark_ctx->pevent;
+	_tep = kshark_get_data_stream(kshark_ctx, sd)->pevent;
 
 	if (kshark_ctx->event_handlers == nullptr)
 		kshark_handle_plugins(kshark_ctx, KSHARK_PLUGIN_INIT);
 	else
 		kshark_handle_plugins(kshark_ctx, KSHARK_PLUGIN_UPDATE);
 
-	_dataSize = kshark_load_data_entries(kshark_ctx, &_rows);
+	_dataSize = kshark_load_data_entries_cached(kshark_ctx, sd, &_rows);
 }
 
 void KsDataStore::_freeData()
 {
+	kshark_context *kshark_ctx(nullptr);
+	int *streamIds;
+
 	if (_dataSize) {
-		for (size_t r = 0; r < _dataSize; ++r)
-			free(_rows[r]);
+		/* The entries are owned by the data streams. */
+		if (kshark_instance(&kshark_ctx) &&
+		    (streamIds = kshark_all_streams(kshark_ctx))) {
+			for (int i = 0; i < kshark_ctx->n_streams; ++i)
+				kshark_free_data_entries(kshark_ctx,
+							 streamIds[i]);
+
+			free(streamIds);
+		}
 
 		free(_rows);
 		_rows = nullptr;
@@ -43,6 +43,26 @@ void ksmodel_init(struct kshark_trace_histo *histo)
 
 	histo->bin_count = NULL;
 	histo->map = NULL;
+	histo->columns = NULL;
+	histo->pyramid = NULL;
+
+	/* By default the data is provided by the user. */
+	histo->kshark_ctx = NULL;
+	histo->sd = -1;
+	histo->blocks = NULL;
+	histo->data_min = histo->data_max = 0;
+	histo->loaded_min = histo->loaded_max = 0;
+	histo->loaded_step = 0;
+	histo->lazy_max_pages = KS_LAZY_MAX_PAGES;
+}
+
+/* Free the entries loaded on demand. The other entries of the stream stay. */
+static void ksmodel_evict(struct kshark_trace_histo *histo)
+{
+	kshark_free_entry_blocks(histo->blocks);
+	histo->blocks = NULL;
+	histo->columns = NULL;
+	histo->data_size = 0;
 }
 
 /**
@@ -55,9 +75,108 @@ void ksmodel_clear(struct kshark_trace_histo *histo)
 	/* Reset the histo. It will have no bins and will contain no data. */
 	free(histo->map);
 	free(histo->bin_count);
+
+	/* The data loaded on demand is owned by the model. */
+	if (histo->kshark_ctx) {
+		ksmodel_evict(histo);
+		free(histo->data);
+		histo->data = NULL;
+	}
+
 	ksmodel_init(histo);
 }
 
+/* The timestamp of a given row of the data. */
+static inline uint64_t ksmodel_ts(struct kshark_trace_histo *histo,
+				  size_t row)
+{
+	if (histo->columns)
+		return histo->columns->ts[row];
+
+	return histo->data[row]->ts;
+}
+
+/* The timestamp of the first entry of the dataset. */
+static inline uint64_t ksmodel_first_ts(struct kshark_trace_histo *histo)
+{
+	if (histo->kshark_ctx)
+		return histo->data_min;
+
+	return ksmodel_ts(histo, 0);
+}
+
+/* The timestamp of the last entry of the dataset. */
+static inline uint64_t ksmodel_last_ts(struct kshark_trace_histo *histo)
+{
+	if (histo->kshark_ctx)
+		return histo->data_max;
+
+	return ksmodel_ts(histo, histo->data_size - 1);
+}
+
+/* Get the histogram pyramid of the model, if it describes the current data. */
+static inline struct kshark_histo_pyramid *
+ksmodel_pyramid(struct kshark_trace_histo *histo)
+{
+	struct kshark_histo_pyramid *pyramid = histo->pyramid;
+
+	if (pyramid && pyramid->data == histo->data &&
+	    pyramid->data_size == histo->data_size)
+		return pyramid;
+
+	return NULL;
+}
+
+static ssize_t ksmodel_bsearch_row(struct kshark_trace_histo *histo,
+				   uint64_t time, size_t l, size_t h)
+{
+	if (histo->columns)
+		return kshark_find_ts_by_time(time, histo->columns->ts, l, h);
+
+	return kshark_find_entry_by_time(time, histo->data, l, h);
+}
+
+static ssize_t ksmodel_find_row_by_time(struct kshark_trace_histo *histo,
+					uint64_t time, size_t l, size_t h)
+{
+	struct kshark_histo_pyramid *pyramid = ksmodel_pyramid(histo);
+	size_t cell, first, last;
+
+	if (!pyramid || time < pyramid->origin)
+		return ksmodel_bsearch_row(histo, time, l, h);
+
+	cell = (time - pyramid->origin) / pyramid->cell_size;
+	if (cell >= pyramid->n_cells[0])
+		return ksmodel_bsearch_row(histo, time, l, h);
+
+	if (ksmodel_ts(histo, l) > time)
+		return BSEARCH_ALL_GREATER;
+
+	if (ksmodel_ts(histo, h) < time)
+		return BSEARCH_ALL_SMALLER;
+
+	/*
+	 * The requested entry is inside the cell or it is the first entry of
+	 * the next cell. If the time is exactly at the lower edge of the cell,
+	 * the first entry of the cell is the answer.
+	 */
+	first = pyramid->row[0][cell];
+	if (first < l)
+		first = l;
+
+	if (time == pyramid->origin + cell * pyramid->cell_size)
+		return first;
+
+	last = pyramid->row[0][cell + 1];
+	if (last > h)
+		last = h;
+
+	if (ksmodel_ts(histo, first) >= time)
+		return first;
+
+	return ksmodel_bsearch_row(histo, time, first, last);
+}
+
 static void ksmodel_reset_bins(struct kshark_trace_histo *histo,
 			       size_t first, size_t last)
 {
@@ -99,7 +218,7 @@ static void ksmodel_set_in_range_bining(struct kshark_trace_histo *histo,
 					bool force_in_range)
 {
 	uint64_t corrected_range, delta_range, range = max - min;
-	struct kshark_entry *last;
+	uint64_t first_ts, last_ts;
 
 	/* The size of the bin must be >= 1, hence the range must be >= n. */
 	if (n == 0 || range < n)
@@ -145,12 +264,13 @@ static void ksmodel_set_in_range_bining(struct kshark_trace_histo *histo,
 		 * Make sure that the new range doesn't go outside of the time
 		 * interval of the dataset.
 		 */
-		last = histo->data[histo->data_size - 1];
-		if (histo->min < histo->data[0]->ts) {
-			histo->min = histo->data[0]->ts;
+		first_ts = ksmodel_first_ts(histo);
+		last_ts = ksmodel_last_ts(histo);
+		if (histo->min < first_ts) {
+			histo->min = first_ts;
 			histo->max = histo->min + corrected_range;
-		} else if (histo->max > last->ts) {
-			histo->max = last->ts;
+		} else if (histo->max > last_ts) {
+			histo->max = last_ts;
 			histo->min = histo->max - corrected_range;
 		}
 	}
@@ -177,10 +297,8 @@ static size_t ksmodel_set_lower_edge(struct kshark_trace_histo *histo)
 	 * (timestamp >= min). Note that the value of "min" is considered
 	 * inside the range.
 	 */
-	ssize_t row = kshark_find_entry_by_time(histo->min,
-						histo->data,
-						0,
-						histo->data_size - 1);
+	ssize_t row = ksmodel_find_row_by_time(histo, histo->min,
+					       0, histo->data_size - 1);
 
 	assert(row != BSEARCH_ALL_SMALLER);
 
@@ -210,7 +328,7 @@ static size_t ksmodel_set_lower_edge(struct kshark_trace_histo *histo)
 	 * Now check if the first entry inside the range falls into the first
 	 * bin.
 	 */
-	if (histo->data[row]->ts < histo->min + histo->bin_size) {
+	if (ksmodel_ts(histo, row) < histo->min + histo->bin_size) {
 		/*
 		 * It is inside the first bin. Set the beginning
 		 * of the first bin.
@@ -232,10 +350,8 @@ static size_t ksmodel_set_upper_edge(struct kshark_trace_histo *histo)
 	 * the range. Remember that kshark_find_entry_by_time returns the first
 	 * entry which is equal or greater than the reference time.
 	 */
-	ssize_t row = kshark_find_entry_by_time(histo->max + 1,
-						histo->data,
-						0,
-						histo->data_size - 1);
+	ssize_t row = ksmodel_find_row_by_time(histo, histo->max + 1,
+					       0, histo->data_size - 1);
 
 	assert(row != BSEARCH_ALL_GREATER);
 
@@ -277,10 +393,17 @@ static void ksmodel_set_next_bin_edge(struct kshark_trace_histo *histo,
 	 * Find the index of the first entry inside
 	 * the next bin (timestamp > time).
 	 */
-	row = kshark_find_entry_by_time(time, histo->data, last_row,
-					histo->data_size - 1);
+	row = ksmodel_find_row_by_time(histo, time, last_row,
+				       histo->data_size - 1);
 
-	if (row < 0 || histo->data[row]->ts >= time + histo->bin_size) {
+	/*
+	 * All entries after "last_row" are after the beginning of the next
+	 * bin. This can happen if the dataset starts inside the range.
+	 */
+	if (row == BSEARCH_ALL_GREATER)
+		row = last_row;
+
+	if (row < 0 || ksmodel_ts(histo, row) >= time + histo->bin_size) {
 		/* The bin is empty. */
 		histo->map[next_bin] = KS_EMPTY_BIN;
 		return;
@@ -352,16 +475,8 @@ static void ksmodel_set_bin_counts(struct kshark_trace_histo *histo)
 	}
 }
 
-/**
- * @brief Provide the Visualization model with data. Calculate the current
- *	  state of the model.
- *
- * @param histo: Input location for the model descriptor.
- * @param data: Input location for the trace data.
- * @param n: Number of bins.
- */
-void ksmodel_fill(struct kshark_trace_histo *histo,
-		  struct kshark_entry **data, size_t n)
+static void ksmodel_do_fill(struct kshark_trace_histo *histo,
+			    struct kshark_entry **data, size_t n)
 {
 	size_t last_row = 0;
 	int bin;
@@ -404,6 +519,468 @@ void ksmodel_fill(struct kshark_trace_histo *histo,
 	ksmodel_set_bin_counts(histo);
 }
 
+/**
+ * @brief Provide the Visualization model with data. Calculate the current
+ *	  state of the model.
+ *
+ * @param histo: Input location for the model descriptor.
+ * @param data: Input location for the trace data.
+ * @param n: Number of bins.
+ */
+void ksmodel_fill(struct kshark_trace_histo *histo,
+		  struct kshark_entry **data, size_t n)
+{
+	histo->columns = NULL;
+	ksmodel_do_fill(histo, data, n);
+}
+
+/**
+ * @brief Provide the Visualization model with data and with its columnar
+ *	  copy. Calculate the current state of the model. The binning of the
+ *	  model uses only the timestamps from the columnar copy, which is much
+ *	  more cache friendly. The visibility of the entries is still read
+ *	  from "data", so the copy does not need to be refreshed after
+ *	  filtering.
+ *
+ * @param histo: Input location for the model descriptor.
+ * @param data: Input location for the trace data.
+ * @param columns: Input location for the columnar copy of the data (see
+ *		   kshark_entry_columns_alloc()). It must stay valid as long
+ *		   as the model uses the data.
+ */
+void ksmodel_fill_columns(struct kshark_trace_histo *histo,
+			  struct kshark_entry **data,
+			  struct kshark_entry_columns *columns)
+{
+	histo->columns = columns;
+	ksmodel_do_fill(histo, data, columns->size);
+}
+
+static size_t ksmodel_pyramid_cell(struct kshark_histo_pyramid *pyramid,
+				   uint64_t ts)
+{
+	return (ts - pyramid->origin) / pyramid->cell_size;
+}
+
+static void ksmodel_pyramid_set_masks(struct kshark_histo_pyramid *pyramid)
+{
+	struct kshark_entry *e;
+	size_t i, c, n;
+	int l;
+
+	n = pyramid->n_cells[0];
+	memset(pyramid->cpu_mask[0], 0, n * sizeof(*pyramid->cpu_mask[0]));
+	memset(pyramid->pid_mask[0], 0, n * sizeof(*pyramid->pid_mask[0]));
+
+	for (i = 0; i < pyramid->data_size; ++i) {
+		e = pyramid->data[i];
+		if (!(e->visible & KS_EVENT_VIEW_FILTER_MASK))
+			continue;
+
+		c = ksmodel_pyramid_cell(pyramid, e->ts);
+		pyramid->cpu_mask[0][c] |= 1ULL << (e->cpu & 63);
+		pyramid->pid_mask[0][c] |= 1ULL << (e->pid & 63);
+	}
+
+	for (l = 1; l < pyramid->n_levels; ++l) {
+		for (c = 0; c < pyramid->n_cells[l]; ++c) {
+			pyramid->cpu_mask[l][c] = pyramid->cpu_mask[l - 1][2 * c] |
+						  pyramid->cpu_mask[l - 1][2 * c + 1];
+
+			pyramid->pid_mask[l][c] = pyramid->pid_mask[l - 1][2 * c] |
+						  pyramid->pid_mask[l - 1][2 * c + 1];
+		}
+	}
+}
+
+/**
+ * @brief Build the histogram pyramid of a dataset. The pyramid allows the
+ *	  Visualization model to find the edges of its bins and to check for
+ *	  visible events without searching through the entire dataset.
+ *
+ * @param data: Input location for the trace data.
+ * @param n: The size of the data array.
+ *
+ * @returns The pyramid on success, or NULL on failure. The user is
+ *	    responsible for freeing the pyramid, using ksmodel_pyramid_free().
+ */
+struct kshark_histo_pyramid *
+ksmodel_pyramid_alloc(struct kshark_entry **data, size_t n)
+{
+	struct kshark_histo_pyramid *pyramid;
+	size_t i, c, n_cells = 1;
+	uint64_t span;
+	int l;
+
+	if (!data || !n)
+		return NULL;
+
+	pyramid = calloc(1, sizeof(*pyramid));
+	if (!pyramid)
+		return NULL;
+
+	/* The number of cells in level 0 must be a power of two. */
+	while (n_cells * KS_PYRAMID_CELL_ENTRIES < n &&
+	       n_cells < KS_PYRAMID_MAX_CELLS)
+		n_cells <<= 1;
+
+	pyramid->data = data;
+	pyramid->data_size = n;
+	pyramid->origin = data[0]->ts;
+	span = data[n - 1]->ts - data[0]->ts + 1;
+	pyramid->cell_size = span / n_cells + (span % n_cells ? 1 : 0);
+
+	while ((n_cells >> pyramid->n_levels) > 0)
+		pyramid->n_levels++;
+
+	pyramid->n_cells = calloc(pyramid->n_levels,
+				  sizeof(*pyramid->n_cells));
+	pyramid->row = calloc(pyramid->n_levels, sizeof(*pyramid->row));
+	pyramid->cpu_mask = calloc(pyramid->n_levels,
+				   sizeof(*pyramid->cpu_mask));
+	pyramid->pid_mask = calloc(pyramid->n_levels,
+				   sizeof(*pyramid->pid_mask));
+	if (!pyramid->n_cells || !pyramid->row ||
+	    !pyramid->cpu_mask || !pyramid->pid_mask)
+		goto fail;
+
+	for (l = 0; l < pyramid->n_levels; ++l) {
+		pyramid->n_cells[l] = n_cells >> l;
+		pyramid->row[l] = malloc((pyramid->n_cells[l] + 1) *
+					 sizeof(*pyramid->row[l]));
+		pyramid->cpu_mask[l] = malloc(pyramid->n_cells[l] *
+					      sizeof(*pyramid->cpu_mask[l]));
+		pyramid->pid_mask[l] = malloc(pyramid->n_cells[l] *
+					      sizeof(*pyramid->pid_mask[l]));
+		if (!pyramid->row[l] ||
+		    !pyramid->cpu_mask[l] || !pyramid->pid_mask[l])
+			goto fail;
+	}
+
+	/* Find the first entry of each cell of level 0. */
+	for (c = 0, i = 0; i < n; ++i) {
+		while (c <= ksmodel_pyramid_cell(pyramid, data[i]->ts))
+			pyramid->row[0][c++] = i;
+	}
+
+	for (; c <= n_cells; ++c)
+		pyramid->row[0][c] = n;
+
+	/* The cells of the upper levels start where their first halves do. */
+	for (l = 1; l < pyramid->n_levels; ++l) {
+		for (c = 0; c < pyramid->n_cells[l]; ++c)
+			pyramid->row[l][c] = pyramid->row[l - 1][2 * c];
+
+		pyramid->row[l][c] = n;
+	}
+
+	ksmodel_pyramid_set_masks(pyramid);
+
+	return pyramid;
+
+ fail:
+	fprintf(stderr, "Failed to allocate the histogram pyramid.\n");
+	ksmodel_pyramid_free(pyramid);
+	return NULL;
+}
+
+/**
+ * @brief Update the visibility masks of the histogram pyramid. Call this
+ *	  function after the visibility of the entries has been changed by
+ *	  filtering.
+ *
+ * @param pyramid: Input location for the pyramid.
+ */
+void ksmodel_pyramid_update_visible(struct kshark_histo_pyramid *pyramid)
+{
+	if (pyramid)
+		ksmodel_pyramid_set_masks(pyramid);
+}
+
+/**
+ * @brief Free the histogram pyramid.
+ *
+ * @param pyramid: Input location for the pyramid.
+ */
+void ksmodel_pyramid_free(struct kshark_histo_pyramid *pyramid)
+{
+	int l;
+
+	if (!pyramid)
+		return;
+
+	for (l = 0; l < pyramid->n_levels; ++l) {
+		if (pyramid->row)
+			free(pyramid->row[l]);
+
+		if (pyramid->cpu_mask)
+			free(pyramid->cpu_mask[l]);
+
+		if (pyramid->pid_mask)
+			free(pyramid->pid_mask[l]);
+	}
+
+	free(pyramid->n_cells);
+	free(pyramid->row);
+	free(pyramid->cpu_mask);
+	free(pyramid->pid_mask);
+	free(pyramid);
+}
+
+/**
+ * @brief Use a histogram pyramid to speed up the Visualization model. The
+ *	  pyramid is used only while it describes the data of the model. It
+ *	  is not owned by the model and must outlive it.
+ *
+ * @param histo: Input location for the model descriptor.
+ * @param pyramid: Input location for the pyramid. Pass NULL to stop using
+ *		   the pyramid.
+ */
+void ksmodel_set_pyramid(struct kshark_trace_histo *histo,
+			 struct kshark_histo_pyramid *pyramid)
+{
+	histo->pyramid = pyramid;
+}
+
+/*
+ * Use the histogram pyramid to check if a visible event from the CPU (or the
+ * task) "val" can exist in a given bin. The masks of the cells overlapping
+ * with the bin are combined, using the coarsest levels possible.
+ */
+static bool ksmodel_pyramid_visible(struct kshark_trace_histo *histo,
+				    int bin, bool cpu, int val)
+{
+	struct kshark_histo_pyramid *pyramid = ksmodel_pyramid(histo);
+	uint64_t **masks, mask = 0;
+	size_t lo, hi, n;
+	ssize_t first;
+	int l;
+
+	if (!pyramid)
+		return true;
+
+	n = ksmodel_bin_count(histo, bin);
+	first = ksmodel_first_index_at_bin(histo, bin);
+	if (!n || first < 0)
+		return true;
+
+	/* The cells [lo, hi) of level 0 overlap with the bin. */
+	lo = ksmodel_pyramid_cell(pyramid, ksmodel_ts(histo, first));
+	hi = ksmodel_pyramid_cell(pyramid, ksmodel_ts(histo, first + n - 1)) + 1;
+	masks = cpu ? pyramid->cpu_mask : pyramid->pid_mask;
+
+	for (l = 0; lo < hi; ++l, lo /= 2, hi /= 2) {
+		if (lo & 1)
+			mask |= masks[l][lo++];
+
+		if (hi & 1)
+			mask |= masks[l][--hi];
+	}
+
+	return mask & (1ULL << (val & 63));
+}
+
+static bool ksmodel_lazy_load(struct kshark_trace_histo *histo)
+{
+	uint64_t range, min, max, step = 0;
+	struct kshark_data_stream *stream;
+	size_t pages = 0;
+	ssize_t n;
+	int cpu, ret;
+
+	/* Check if the loaded data covers the range of the model. */
+	if (histo->data && !histo->loaded_step &&
+	    histo->min >= histo->loaded_min &&
+	    histo->max <= histo->loaded_max)
+		return true;
+
+	if (histo->data && histo->loaded_step == histo->bin_size &&
+	    histo->min == histo->loaded_min &&
+	    histo->max == histo->loaded_max)
+		return true;
+
+	stream = kshark_get_data_stream(histo->kshark_ctx, histo->sd);
+	if (!stream)
+		return false;
+
+	/*
+	 * Load a margin of one range on each side, so that small shifts and
+	 * zooms can be done without loading again.
+	 */
+	range = histo->max - histo->min;
+	min = histo->min > histo->data_min + range ?
+	      histo->min - range : histo->data_min;
+
+	max = histo->max < histo->data_max &&
+	      histo->data_max - histo->max > range ?
+	      histo->max + range : histo->data_max;
+
+	/* Estimate the amount of data, using the timestamps of the pages. */
+	for (cpu = 0; cpu < tracecmd_cpus(stream->handle); ++cpu) {
+		ret = tracecmd_cpu_pages_in_range(stream->handle, cpu, min, max);
+		if (ret > 0)
+			pages += ret;
+	}
+
+	if (pages > histo->lazy_max_pages) {
+		/*
+		 * Too much data. Load only the first entry of each CPU in
+		 * each bin. This is enough to draw the model.
+		 */
+		min = histo->min;
+		max = histo->max;
+		step = histo->bin_size;
+	}
+
+	/*
+	 * Evict the data loaded for the previous range. The array of the
+	 * entries is freed by the load.
+	 */
+	ksmodel_evict(histo);
+
+	n = kshark_load_data_entries_range(histo->kshark_ctx, histo->sd,
+					   min, max, step, &histo->blocks,
+					   &histo->data);
+	if (n < 0)
+		return false;
+
+	histo->data_size = n;
+	histo->loaded_min = min;
+	histo->loaded_max = max;
+	histo->loaded_step = step;
+
+	return true;
+}
+
+/*
+ * Recalculate all bins of the model from scratch. If the data is loaded
+ * on demand, load the data of the current range first.
+ */
+static void ksmodel_refill(struct kshark_trace_histo *histo)
+{
+	int bin;
+
+	if (!histo->kshark_ctx) {
+		ksmodel_do_fill(histo, histo->data, histo->data_size);
+		return;
+	}
+
+	if (histo->n_bins == 0 || histo->bin_size == 0) {
+		fprintf(stderr,
+			"Unable to fill the model with data.\n");
+		fprintf(stderr,
+			"Try to set the bining of the model first.\n");
+		return;
+	}
+
+	if (!ksmodel_lazy_load(histo))
+		return;
+
+	if (histo->data_size &&
+	    ksmodel_ts(histo, histo->data_size - 1) >= histo->min &&
+	    ksmodel_ts(histo, 0) <= histo->max) {
+		ksmodel_do_fill(histo, histo->data, histo->data_size);
+		return;
+	}
+
+	/* There is no data inside the range. */
+	ksmodel_reset_bins(histo, 0, ALLB(histo));
+	if (histo->data_size) {
+		bin = ksmodel_ts(histo, 0) > histo->max ? UOB(histo) :
+							  LOB(histo);
+		histo->map[bin] = 0;
+		histo->bin_count[bin] = histo->data_size;
+	}
+}
+
+/**
+ * @brief Load the data of the Visualization model on demand. Only the data
+ *	  around the range of the model is kept in memory. It gets loaded
+ *	  again, when the range of the model is changed (shifted, zoomed,
+ *	  etc.). If the range contains too much data (see the field
+ *	  "lazy_max_pages" of the model descriptor), only a sample of the
+ *	  data, containing the first entry of each CPU in each bin, is loaded.
+ *	  The loaded entries are owned by the model. They are freed by
+ *	  ksmodel_clear() and must not be freed by the user. The data
+ *	  previously given to the model is not freed, unless the model was
+ *	  already loading its data on demand.
+ *	  This mode is only available to the users of the library. The Qt
+ *	  GUI does not use it, because its table view needs all entries of
+ *	  the stream.
+ *
+ * @param histo: Input location for the model descriptor.
+ * @param kshark_ctx: Input location for the session context pointer.
+ * @param sd: Data stream identifier.
+ *
+ * @returns True on success, otherwise false.
+ */
+bool ksmodel_set_lazy(struct kshark_trace_histo *histo,
+		      struct kshark_context *kshark_ctx, int sd)
+{
+	struct kshark_data_stream *stream;
+	uint64_t min = UINT64_MAX, max = 0;
+	struct tep_record *rec;
+	int cpu;
+
+	stream = kshark_get_data_stream(kshark_ctx, sd);
+	if (!stream || !stream->handle)
+		return false;
+
+	/* Find the time range of the entire data stream. */
+	for (cpu = 0; cpu < tracecmd_cpus(stream->handle); ++cpu) {
+		rec = tracecmd_read_cpu_first(stream->handle, cpu);
+		if (rec) {
+			if (rec->ts < min)
+				min = rec->ts;
+			free_record(rec);
+		}
+
+		rec = tracecmd_read_cpu_last(stream->handle, cpu);
+		if (rec) {
+			if (rec->ts > max)
+				max = rec->ts;
+			free_record(rec);
+		}
+	}
+
+	if (min > max)
+		return false;
+
+	/* Drop the data loaded on demand for the previous stream, if any. */
+	if (histo->kshark_ctx) {
+		ksmodel_evict(histo);
+		free(histo->data);
+	}
+
+	histo->kshark_ctx = kshark_ctx;
+	histo->sd = sd;
+	histo->data_min = min;
+	histo->data_max = max;
+	histo->data = NULL;
+	histo->data_size = 0;
+	histo->columns = NULL;
+
+	return true;
+}
+
+/**
+ * @brief Calculate the current state of a Visualization model, which loads
+ *	  its data on demand (see ksmodel_set_lazy()). The data inside the
+ *	  range of the model gets loaded, if needed.
+ *
+ * @param histo: Input location for the model descriptor.
+ */
+void ksmodel_fill_lazy(struct kshark_trace_histo *histo)
+{
+	if (!histo->kshark_ctx) {
+		fprintf(stderr,
+			"The model does not load its data on demand.\n");
+		return;
+	}
+
+	ksmodel_refill(histo);
+}
+
 /**
  * @brief Get the total number of entries in a given bin.
  *
@@ -438,30 +1015,37 @@ void ksmodel_shift_forward(struct kshark_trace_histo *histo, size_t n)
 	size_t last_row = 0;
 	int bin;
 
-	if (!histo->data_size)
-		return;
+	if (histo->kshark_ctx) {
+		/* The data is loaded on demand. Check the entire dataset. */
+		if (histo->max >= histo->data_max)
+			return;
+	} else {
+		if (!histo->data_size)
+			return;
 
-	if (histo->map[UOB(histo)] == KS_EMPTY_BIN) {
-		/*
-		 * The Upper Overflow bin is empty. This means that we are at
-		 * the upper edge of the dataset already. Do nothing in this
-		 * case.
-		 */
-		return;
+		if (histo->map[UOB(histo)] == KS_EMPTY_BIN) {
+			/*
+			 * The Upper Overflow bin is empty. This means that we
+			 * are at the upper edge of the dataset already. Do
+			 * nothing in this case.
+			 */
+			return;
+		}
 	}
 
 	histo->min += n * histo->bin_size;
 	histo->max += n * histo->bin_size;
 
-	if (n >= histo->n_bins) {
+	if (n >= histo->n_bins || histo->kshark_ctx) {
 		/*
-		 * No overlap between the new and the old ranges. Recalculate
-		 * all bins from scratch. First calculate the new range.
+		 * No overlap between the new and the old ranges (or the data
+		 * of the new range may need to be loaded). Recalculate all
+		 * bins from scratch. First calculate the new range.
 		 */
 		ksmodel_set_bining(histo, histo->n_bins, histo->min,
 							 histo->max);
 
-		ksmodel_fill(histo, histo->data, histo->data_size);
+		ksmodel_refill(histo);
 		return;
 	}
 
@@ -514,30 +1098,37 @@ void ksmodel_shift_backward(struct kshark_trace_histo *histo, size_t n)
 	size_t last_row = 0;
 	int bin;
 
-	if (!histo->data_size)
-		return;
+	if (histo->kshark_ctx) {
+		/* The data is loaded on demand. Check the entire dataset. */
+		if (histo->min <= histo->data_min)
+			return;
+	} else {
+		if (!histo->data_size)
+			return;
 
-	if (histo->map[LOB(histo)] == KS_EMPTY_BIN) {
-		/*
-		 * The Lower Overflow bin is empty. This means that we are at
-		 * the Lower edge of the dataset already. Do nothing in this
-		 * case.
-		 */
-		return;
+		if (histo->map[LOB(histo)] == KS_EMPTY_BIN) {
+			/*
+			 * The Lower Overflow bin is empty. This means that we
+			 * are at the Lower edge of the dataset already. Do
+			 * nothing in this case.
+			 */
+			return;
+		}
 	}
 
 	histo->min -= n * histo->bin_size;
 	histo->max -= n * histo->bin_size;
 
-	if (n >= histo->n_bins) {
+	if (n >= histo->n_bins || histo->kshark_ctx) {
 		/*
-		 * No overlap between the new and the old range. Recalculate
-		 * all bins from scratch. First calculate the new range.
+		 * No overlap between the new and the old range (or the data
+		 * of the new range may need to be loaded). Recalculate all
+		 * bins from scratch. First calculate the new range.
 		 */
 		ksmodel_set_bining(histo, histo->n_bins, histo->min,
 							 histo->max);
 
-		ksmodel_fill(histo, histo->data, histo->data_size);
+		ksmodel_refill(histo);
 		return;
 	}
 	/* Set the new Lower Overflow bin. */
@@ -592,10 +1183,10 @@ void ksmodel_jump_to(struct kshark_trace_histo *histo, size_t ts)
 	min = ts - histo->n_bins * histo->bin_size / 2;
 
 	/* Make sure that the range does not go outside of the dataset. */
-	if (min < histo->data[0]->ts) {
-		min = histo->data[0]->ts;
+	if (min < ksmodel_first_ts(histo)) {
+		min = ksmodel_first_ts(histo);
 	} else {
-		range_min = histo->data[histo->data_size - 1]->ts -
+		range_min = ksmodel_last_ts(histo) -
 			    histo->n_bins * histo->bin_size;
 
 		if (min > range_min)
@@ -606,7 +1197,7 @@ void ksmodel_jump_to(struct kshark_trace_histo *histo, size_t ts)
 
 	/* Use the new range to recalculate all bins from scratch. */
 	ksmodel_set_bining(histo, histo->n_bins, min, max);
-	ksmodel_fill(histo, histo->data, histo->data_size);
+	ksmodel_refill(histo);
 }
 
 static void ksmodel_zoom(struct kshark_trace_histo *histo,
@@ -615,7 +1206,7 @@ static void ksmodel_zoom(struct kshark_trace_histo *histo,
 	size_t range, min, max, delta_min;
 	double delta_tot;
 
-	if (!histo->data_size)
+	if (!histo->data_size && !histo->kshark_ctx)
 		return;
 
 	/*
@@ -660,11 +1251,11 @@ static void ksmodel_zoom(struct kshark_trace_histo *histo,
 
 
 	/* Make sure the new range doesn't go outside of the dataset. */
-	if (min < histo->data[0]->ts)
-		min = histo->data[0]->ts;
+	if (min < ksmodel_first_ts(histo))
+		min = ksmodel_first_ts(histo);
 
-	if (max > histo->data[histo->data_size - 1]->ts)
-		max = histo->data[histo->data_size - 1]->ts;
+	if (max > ksmodel_last_ts(histo))
+		max = ksmodel_last_ts(histo);
 
 	/*
 	 * Use the new range to recalculate all bins from scratch. Enforce
@@ -673,7 +1264,7 @@ static void ksmodel_zoom(struct kshark_trace_histo *histo,
 	 * first or the very last entry is used as a focal point.
 	 */
 	ksmodel_set_in_range_bining(histo, histo->n_bins, min, max, true);
-	ksmodel_fill(histo, histo->data, histo->data_size);
+	ksmodel_refill(histo);
 }
 
 /**
@@ -1153,6 +1744,9 @@ bool ksmodel_cpu_visible_event_exist(struct kshark_trace_histo *histo,
 	if (index)
 		*index = KS_EMPTY_BIN;
 
+	if (!ksmodel_pyramid_visible(histo, bin, true, cpu))
+		return false;
+
 	/* Set the position at the beginning of the bin and go forward. */
 	req = ksmodel_entry_front_request_alloc(histo,
 						bin, true,
@@ -1207,6 +1801,9 @@ bool ksmodel_task_visible_event_exist(struct kshark_trace_histo *histo,
 	if (index)
 		*index = KS_EMPTY_BIN;
 
+	if (!ksmodel_pyramid_visible(histo, bin, false, pid))
+		return false;
+
 	/* Set the position at the beginning of the bin and go forward. */
 	req = ksmodel_entry_front_request_alloc(histo,
 						bin, true,
@@ -37,6 +37,67 @@ enum OverflowBin {
 	LOWER_OVERFLOW_BIN = -2,
 };
 
+/**
+ * The average number of entries in a cell of the finest level of the
+ * histogram pyramid.
+ */
+#define KS_PYRAMID_CELL_ENTRIES	16
+
+/** The maximum number of cells in the finest level of the histogram pyramid. */
+#define KS_PYRAMID_MAX_CELLS	(1 << 22)
+
+/**
+ * Precomputed multi-resolution summary of a dataset, used to speed up the
+ * Visualization model. The finest level (level 0) divides the time span of
+ * the data into a power-of-two number of cells of equal size. Each next level
+ * merges the pairs of neighbouring cells of the previous one.
+ */
+struct kshark_histo_pyramid {
+	/** The trace data array summarized by the pyramid. */
+	struct kshark_entry	**data;
+
+	/** The size of the data array. */
+	size_t			data_size;
+
+	/** The lower edge (in time) of the first cell. */
+	uint64_t		origin;
+
+	/** The size in time of the cells of level 0. */
+	uint64_t		cell_size;
+
+	/** Number of levels. */
+	int			n_levels;
+
+	/** Number of cells in each level. */
+	size_t			*n_cells;
+
+	/**
+	 * For each level, the index of the first entry having timestamp
+	 * greater or equal to the lower edge of the cell. The array has one
+	 * additional element, equal to the size of the data array.
+	 */
+	size_t			**row;
+
+	/**
+	 * For each level, a mask of the CPUs having visible events inside the
+	 * cell. CPU "cpu" is represented by bit "cpu % 64".
+	 */
+	uint64_t		**cpu_mask;
+
+	/**
+	 * For each level, a mask of the tasks having visible events inside
+	 * the cell. Task "pid" is represented by bit "pid % 64".
+	 */
+	uint64_t		**pid_mask;
+};
+
+struct kshark_histo_pyramid *
+ksmodel_pyramid_alloc(struct kshark_entry **data, size_t n);
+
+void ksmodel_pyramid_update_visible(struct kshark_histo_pyramid *pyramid);
+
+void ksmodel_pyramid_free(struct kshark_histo_pyramid *pyramid);
+
 /** Structure describing the current state of the visualization model. */
 struct kshark_trace_histo {
 	/** Trace data array. */
@@ -45,6 +106,19 @@ struct kshark_trace_histo {
 	/** The size of the data array. */
 	size_t			data_size;
 
+	/**
+	 * Optional columnar copy of the trace data, owned by the caller. If
+	 * set, the timestamps used for the binning are taken from here. All
+	 * other fields are still read from the entries.
+	 */
+	struct kshark_entry_columns	*columns;
+
+	/**
+	 * Optional histogram pyramid of the trace data (see
+	 * ksmodel_set_pyramid()).
+	 */
+	struct kshark_histo_pyramid	*pyramid;
+
 	/** The first entry (index of data array) in each bin. */
 	ssize_t			*map;
 
@@ -68,8 +142,51 @@ struct kshark_trace_histo {
 
 	/** Number of bins. */
 	int			n_bins;
+
+	/**
+	 * Session context, used to load the data on demand (see
+	 * ksmodel_set_lazy()). If NULL, the data is provided by the user.
+	 */
+	struct kshark_context	*kshark_ctx;
+
+	/** Data stream identifier, used to load the data on demand. */
+	int			sd;
+
+	/** The memory holding the entries loaded on demand. */
+	struct kshark_entry_block	*blocks;
+
+	/** The timestamp of the first entry of the data stream. */
+	uint64_t		data_min;
+
+	/** The timestamp of the last entry of the data stream. */
+	uint64_t		data_max;
+
+	/** Lower edge of the time range of the loaded data. */
+	uint64_t		loaded_min;
+
+	/** Upper edge of the time range of the loaded data. */
+	uint64_t		loaded_max;
+
+	/**
+	 * If not zero, the loaded data is only a sample, containing the
+	 * first entry of each CPU in each interval of this size.
+	 */
+	uint64_t		loaded_step;
+
+	/**
+	 * The maximum number of pages of trace data, loaded in full when the
+	 * data is loaded on demand. If the range of the model contains more
+	 * pages, only a sample of the data is loaded.
+	 */
+	size_t			lazy_max_pages;
 };
 
+/**
+ * The default maximum number of pages of trace data, loaded in full when the
+ * data is loaded on demand.
+ */
+#define KS_LAZY_MAX_PAGES	(1 << 16)
+
 void ksmodel_init(struct kshark_trace_histo *histo);
 
 void ksmodel_clear(struct kshark_trace_histo *histo);
@@ -80,6 +197,18 @@ void ksmodel_set_bining(struct kshark_trace_histo *histo,
 void ksmodel_fill(struct kshark_trace_histo *histo,
 		  struct kshark_entry **data, size_t n);
 
+void ksmodel_fill_columns(struct kshark_trace_histo *histo,
+			  struct kshark_entry **data,
+			  struct kshark_entry_columns *columns);
+
+void ksmodel_set_pyramid(struct kshark_trace_histo *histo,
+			 struct kshark_histo_pyramid *pyramid);
+
+bool ksmodel_set_lazy(struct kshark_trace_histo *histo,
+		      struct kshark_context *kshark_ctx, int sd);
+
+void ksmodel_fill_lazy(struct kshark_trace_histo *histo);
+
 size_t ksmodel_bin_count(struct kshark_trace_histo *histo, int bin);
 
 void ksmodel_shift_forward(struct kshark_trace_histo *histo, size_t n);
@@ -17,6 +17,13 @@
 #include <stdio.h>
 #include <assert.h>
 #include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+// trace-cmd
+#include "trace-heap.h"
 
 // KernelShark
 #include "libkshark.h"
@@ -124,6 +131,76 @@ static void kshark_free_task_list(struct kshark_task_list **tasks)
 	}
 }
 
+/** The number of entries in the first memory block of a CPU. */
+#define KS_ENTRY_BLOCK_MIN_SIZE	(1 << 10)
+
+/** The maximum number of entries in a memory block. */
+#define KS_ENTRY_BLOCK_MAX_SIZE	(1 << 16)
+
+/**
+ * The loaded entries are allocated in large blocks of memory, owned by the
+ * data stream. This avoids the overhead of allocating (and later freeing)
+ * each entry separately.
+ */
+struct kshark_entry_block {
+	/** Pointer to the next block. */
+	struct kshark_entry_block	*next;
+
+	/** The number of entries in use. */
+	size_t				size;
+
+	/** The number of entries the block can hold. */
+	size_t				capacity;
+
+	/** The entries. */
+	struct kshark_entry		entries[];
+};
+
+static struct kshark_entry_block *entry_block_alloc(size_t capacity)
+{
+	struct kshark_entry_block *block;
+
+	block = calloc(1, sizeof(*block) +
+			  capacity * sizeof(block->entries[0]));
+	if (block)
+		block->capacity = capacity;
+
+	return block;
+}
+
+static struct kshark_entry *entry_alloc(struct kshark_entry_block **blocks)
+{
+	struct kshark_entry_block *block = *blocks;
+	size_t capacity;
+
+	if (!block || block->size == block->capacity) {
+		/* The blocks of a CPU grow, up to the maximum size. */
+		capacity = block ? block->capacity * 2 : KS_ENTRY_BLOCK_MIN_SIZE;
+		if (capacity > KS_ENTRY_BLOCK_MAX_SIZE)
+			capacity = KS_ENTRY_BLOCK_MAX_SIZE;
+
+		block = entry_block_alloc(capacity);
+		if (!block)
+			return NULL;
+
+		block->next = *blocks;
+		*blocks = block;
+	}
+
+	return &block->entries[block->size++];
+}
+
+static void free_entry_blocks(struct kshark_entry_block *blocks)
+{
+	struct kshark_entry_block *block;
+
+	while (blocks) {
+		block = blocks;
+		blocks = blocks->next;
+		free(block);
+	}
+}
+
 static void kshark_stream_free(struct kshark_data_stream *stream)
 {
 	if (!stream)
@@ -136,6 +213,7 @@ static void kshark_stream_free(struct kshark_data_stream *stream)
 	tracecmd_filter_id_hash_free(stream->hide_event_filter);
 
 	kshark_free_task_list(stream->tasks);
+	free_entry_blocks(stream->entry_blocks);
 
 	free(stream);
 }
@@ -149,6 +227,8 @@ static struct kshark_data_stream *kshark_stream_alloc()
 		goto fail;
 
 	stream->filter_mask = 0x0;
+	stream->entry_blocks = NULL;
+	stream->file = NULL;
 
 	stream->show_task_filter = tracecmd_filter_id_hash_alloc();
 	stream->hide_task_filter = tracecmd_filter_id_hash_alloc();
@@ -224,6 +304,7 @@ int kshark_stream_open(struct kshark_data_stream *stream, const char *file)
 		return -EAGAIN;
 	}
 
+	stream->file = strdup(file);
 	stream->handle = handle;
 	stream->pevent = tracecmd_get_pevent(handle);
 
@@ -308,6 +389,9 @@ static void kshark_stream_close(struct kshark_data_stream *stream)
 	stream->handle = NULL;
 	stream->pevent = NULL;
 
+	free(stream->file);
+	stream->file = NULL;
+
 	pthread_mutex_destroy(&stream->input_mutex);
 }
 
@@ -383,11 +467,11 @@ static inline uint8_t knuth_hash8(uint32_t val)
 }
 
 static struct kshark_task_list *
-kshark_find_task(struct kshark_data_stream *stream, uint8_t key, int pid)
+kshark_find_task(struct kshark_task_list **tasks, uint8_t key, int pid)
 {
 	struct kshark_task_list *list;
 
-	for (list = stream->tasks[key]; list; list = list->next) {
+	for (list = tasks[key]; list; list = list->next) {
 		if (list->pid == pid)
 			return list;
 	}
@@ -396,13 +480,13 @@ kshark_find_task(struct kshark_data_stream *stream, uint8_t key, int pid)
 }
 
 static struct kshark_task_list *
-kshark_add_task(struct kshark_data_stream *stream, int pid)
+kshark_add_task(struct kshark_task_list **tasks, int pid)
 {
 	struct kshark_task_list *list;
 	uint8_t key;
 
 	key = knuth_hash8(pid);
-	list = kshark_find_task(stream, key, pid);
+	list = kshark_find_task(tasks, key, pid);
 	if (list)
 		return list;
 
@@ -411,8 +495,8 @@ kshark_add_task(struct kshark_data_stream *stream, int pid)
 		return NULL;
 
 	list->pid = pid;
-	list->next = stream->tasks[key];
-	stream->tasks[key] = list;
+	list->next = tasks[key];
+	tasks[key] = list;
 
 	return list;
 }
@@ -742,393 +826,1485 @@ static void kshark_set_entry_values(struct kshark_data_stream *stream,
 }
 
 /**
- * rec_list is used to pass the data to the load functions.
- * The rec_list will contain the list of entries from the source,
- * and will be a link list of per CPU entries.
+ * rec_array is used to pass the data to the load functions.
+ * The rec_array will contain the time-ordered entries (or records) from
+ * the source, loaded from a single CPU.
  */
-struct rec_list {
+struct rec_array {
 	union {
-		/* Used by kshark_load_data_records */
-		struct {
-			/** next pointer, matches entry->next */
-			struct rec_list		*next;
-			/** pointer to the raw record data */
-			struct tep_record	*rec;
-		};
-		/** entry - Used for kshark_load_data_entries() */
-		struct kshark_entry		entry;
+		/** Records - Used by kshark_load_data_records() */
+		struct tep_record	**rec;
+		/** Entries - Used for kshark_load_data_entries() */
+		struct kshark_entry	**entry;
+		/** Generic access to the elements of the array. */
+		void			**data;
 	};
+
+	/** The number of elements in the array. */
+	size_t		size;
+
+	/** The number of elements the array can hold. */
+	size_t		capacity;
+
+	/** Memory blocks holding the entries (if the elements are entries). */
+	struct kshark_entry_block	*blocks;
 };
 
 /**
- * rec_type defines what type of rec_list is being used.
+ * rec_type defines what type of rec_array is being used.
  */
 enum rec_type {
 	REC_RECORD,
 	REC_ENTRY,
 };
 
-static void free_rec_list(struct rec_list **rec_list, int n_cpus,
-			  enum rec_type type)
-{
-	struct rec_list *temp_rec;
-	int cpu;
+/**
+ * load_context holds the state shared by all threads loading the data of
+ * one stream.
+ */
+struct load_context {
+	/** The session context. */
+	struct kshark_context		*kshark_ctx;
 
-	for (cpu = 0; cpu < n_cpus; ++cpu) {
-		while (rec_list[cpu]) {
-			temp_rec = rec_list[cpu];
-			rec_list[cpu] = temp_rec->next;
-			if (type == REC_RECORD)
-				free_record(temp_rec->rec);
-			free(temp_rec);
-		}
-	}
-	free(rec_list);
-}
+	/** The data stream being loaded. */
+	struct kshark_data_stream	*stream;
 
-static size_t get_records(struct kshark_context *kshark_ctx, int sd,
-			  struct rec_list ***rec_list, enum rec_type type)
-{
-	struct kshark_event_handler *evt_handler;
-	struct tep_event_filter *adv_filter;
-	struct kshark_data_stream *stream;
-	struct kshark_task_list *task;
-	struct tep_record *rec;
-	struct rec_list **temp_next;
-	struct rec_list **cpu_list;
-	struct rec_list *temp_rec;
-	size_t count, total = 0;
-	int n_cpus;
-	int pid;
-	int cpu;
+	/** Data stream identifier. */
+	int				sd;
 
-	stream = kshark_get_data_stream(kshark_ctx, sd);
+	/** The type of the data being loaded. */
+	enum rec_type			type;
 
-	n_cpus = tracecmd_cpus(stream->handle);
-	cpu_list = calloc(n_cpus, sizeof(*cpu_list));
-	if (!cpu_list)
-		return -ENOMEM;
+	/** Only the records having timestamps >= min are loaded. */
+	uint64_t			min;
 
-	/* Just to shorten the name */
-	if (type == REC_ENTRY)
-		adv_filter = stream->advanced_event_filter;
+	/** Only the records having timestamps <= max are loaded. */
+	uint64_t			max;
 
-	for (cpu = 0; cpu < n_cpus; ++cpu) {
-		count = 0;
-		cpu_list[cpu] = NULL;
-		temp_next = &cpu_list[cpu];
-
-		rec = tracecmd_read_cpu_first(stream->handle, cpu);
-		while (rec) {
-			*temp_next = temp_rec = calloc(1, sizeof(*temp_rec));
-			if (!temp_rec)
-				goto fail;
+	/**
+	 * If not zero, only the first record of each CPU inside each
+	 * interval of this size (starting from "min") is loaded.
+	 */
+	uint64_t			step;
 
-			temp_rec->next = NULL;
+	/** Per CPU arrays of loaded data. */
+	struct rec_array		*cpu_recs;
 
-			switch (type) {
-			case REC_RECORD:
-				temp_rec->rec = rec;
-				pid = tep_data_pid(stream->pevent, rec);
-				break;
-			case REC_ENTRY: {
-				struct kshark_entry *entry;
-				int ret;
-
-				entry = &temp_rec->entry;
-				kshark_set_entry_values(stream, rec, entry);
-				entry->stream_id = sd;
-
-				/* Execute all plugin-provided actions (if any). */
-				evt_handler = kshark_ctx->event_handlers;
-				while ((evt_handler = kshark_find_event_handler(evt_handler,
-										entry->event_id,
-										entry->stream_id))) {
-					evt_handler->event_func(kshark_ctx, rec, entry);
-
-					if ((evt_handler = evt_handler->next))
-						entry->visible &= ~KS_PLUGIN_UNTOUCHED_MASK;
-				}
+	/** The number of CPUs in the stream. */
+	int				n_cpus;
 
-				pid = entry->pid;
-				/* Apply event filtering. */
-				ret = FILTER_MATCH;
-				if (adv_filter->filters)
-					ret = tep_filter_match(adv_filter, rec);
+	/** The next CPU to be picked by a loading thread. */
+	int				next_cpu;
 
-				if (!kshark_show_event(stream, entry->event_id) ||
-				    ret != FILTER_MATCH) {
-					unset_event_filter_flag(stream, entry);
-				}
+	/**
+	 * Serializes the plugin-provided actions and the advanced filter,
+	 * because those are not safe to be executed concurrently.
+	 */
+	pthread_mutex_t			mutex;
 
-				/* Apply task filtering. */
-				if (!kshark_show_task(stream, entry->pid)) {
-					entry->visible &= ~stream->filter_mask;
-				}
-				free_record(rec);
-				break;
-			} /* REC_ENTRY */
-			}
+	/**
+	 * Set by a loading thread if loading of a CPU failed. Access it
+	 * with load_failed() and set_load_failed() while the threads run.
+	 */
+	bool				failed;
+};
 
-			task = kshark_add_task(stream, pid);
-			if (!task) {
-				free_record(rec);
-				goto fail;
-			}
+static inline bool load_failed(struct load_context *load)
+{
+	return __atomic_load_n(&load->failed, __ATOMIC_RELAXED);
+}
 
-			temp_next = &temp_rec->next;
+static inline void set_load_failed(struct load_context *load)
+{
+	__atomic_store_n(&load->failed, true, __ATOMIC_RELAXED);
+}
 
-			++count;
-			rec = tracecmd_read_data(stream->handle, cpu);
-		}
+/**
+ * merge_part describes a time interval of the data, merged (ordered in time)
+ * by a single thread.
+ */
+struct merge_part {
+	/** The context of the loading. */
+	struct load_context	*load;
 
-		total += count;
-	}
+	/** Output location for the merged data. */
+	void			**rows;
 
-	*rec_list = cpu_list;
-	return total;
+	/** Per CPU index of the next element to be merged. */
+	size_t			*pos;
 
- fail:
-	free_rec_list(cpu_list, n_cpus, type);
-	return -ENOMEM;
-}
+	/** Per CPU index of the element after the last one of this part. */
+	size_t			*last;
+};
+
+/** The minimum number of elements in a part, merged by a single thread. */
+#define KS_MERGE_PART_MIN_SIZE	(1 << 16)
 
-static int pick_next_cpu(struct rec_list **rec_list, int n_cpus,
-			 enum rec_type type)
+static void free_rec_arrays(struct rec_array *cpu_recs, int n_cpus,
+			    enum rec_type type, bool free_data)
 {
-	uint64_t ts = 0;
-	uint64_t rec_ts;
-	int next_cpu = -1;
+	size_t i;
 	int cpu;
 
 	for (cpu = 0; cpu < n_cpus; ++cpu) {
-		if (!rec_list[cpu])
-			continue;
+		if (free_data && type == REC_RECORD)
+			for (i = 0; i < cpu_recs[cpu].size; ++i)
+				free_record(cpu_recs[cpu].rec[i]);
 
-		switch (type) {
-		case REC_RECORD:
-			rec_ts = rec_list[cpu]->rec->ts;
-			break;
-		case REC_ENTRY:
-			rec_ts = rec_list[cpu]->entry.ts;
-			break;
-		}
-		if (!ts || rec_ts < ts) {
-			ts = rec_ts;
-			next_cpu = cpu;
-		}
+		if (free_data)
+			free_entry_blocks(cpu_recs[cpu].blocks);
+
+		free(cpu_recs[cpu].data);
 	}
 
-	return next_cpu;
+	free(cpu_recs);
 }
 
-/**
- * @brief Load the content of the trace data file into an array of
- *	  kshark_entries. This function provides an abstraction of the
- *	  entries from the raw data that is read, however the "latency"
- *	  and the "info" fields can be accessed only via the offset
- *	  into the file. This makes the access to these two fields much
- *	  slower.
- *	  If one or more filters are set, the "visible" fields of each entry
- *	  is updated according to the criteria provided by the filters. The
- *	  field "filter_mask" of the session's context is used to control the
- *	  level of visibility/invisibility of the filtered entries.
- *
- * @param kshark_ctx: Input location for context pointer.
- * @param sd: Data stream identifier.
- * @param data_rows: Output location for the trace data. The user is
- *		     responsible for freeing the elements of the outputted
- *		     array.
- *
- * @returns The size of the outputted data in the case of success, or a
- *	    negative error code on failure.
- */
-ssize_t kshark_load_data_entries(struct kshark_context *kshark_ctx, int sd,
-				struct kshark_entry ***data_rows)
+static bool rec_array_append(struct rec_array *recs, void *data)
 {
-	struct kshark_data_stream *stream;
-	struct kshark_entry **rows;
-	struct rec_list **rec_list;
-	enum rec_type type = REC_ENTRY;
-	size_t count, total = 0;
-	int n_cpus;
+	void **temp;
 
-	if (*data_rows)
-		free(*data_rows);
+	if (recs->size == recs->capacity) {
+		recs->capacity = recs->capacity ? recs->capacity * 2 : 1024;
+		temp = realloc(recs->data, recs->capacity * sizeof(*temp));
+		if (!temp)
+			return false;
 
-	stream = kshark_get_data_stream(kshark_ctx, sd);
-	if (!stream)
-		return -EBADF;
+		recs->data = temp;
+	}
 
-	total = get_records(kshark_ctx, sd, &rec_list, type);
-	if (total < 0)
-		goto fail;
+	recs->data[recs->size++] = data;
 
-	n_cpus = tracecmd_cpus(stream->handle);
+	return true;
+}
 
-	rows = calloc(total, sizeof(struct kshark_entry *));
-	if (!rows)
-		goto fail_free;
+static inline uint64_t rec_ts(void *data, enum rec_type type)
+{
+	if (type == REC_RECORD)
+		return ((struct tep_record *) data)->ts;
 
-	for (count = 0; count < total; count++) {
-		int next_cpu;
+	return ((struct kshark_entry *) data)->ts;
+}
 
-		next_cpu = pick_next_cpu(rec_list, n_cpus, type);
+/* Get the first record of the CPU, having timestamp >= ts (and <= max). */
+static struct tep_record *load_first_rec(struct load_context *load, int cpu,
+					 uint64_t ts)
+{
+	struct tracecmd_input *handle = load->stream->handle;
+	struct tep_record *rec;
 
-		if (next_cpu >= 0) {
-			rows[count] = &rec_list[next_cpu]->entry;
-			rec_list[next_cpu] = rec_list[next_cpu]->next;
-		}
-	}
+	if (!ts)
+		rec = tracecmd_read_cpu_first(handle, cpu);
+	else if (tracecmd_set_cpu_to_timestamp(handle, cpu, ts) < 0)
+		return NULL;
+	else
+		rec = tracecmd_read_data(handle, cpu);
 
-	free_rec_list(rec_list, n_cpus, type);
-	*data_rows = rows;
-	return total;
+	while (rec && rec->ts < ts) {
+		free_record(rec);
+		rec = tracecmd_read_data(handle, cpu);
+	}
 
- fail_free:
-	free_rec_list(rec_list, n_cpus, type);
-	for (count = 0; count < total; count++) {
-		if (!rows[count])
-			break;
-		free(rows[count]);
+	if (rec && rec->ts > load->max) {
+		free_record(rec);
+		return NULL;
 	}
-	free(rows);
- fail:
-	fprintf(stderr, "Failed to allocate memory during data loading.\n");
-	return -ENOMEM;
+
+	return rec;
 }
 
-/**
- * @brief Load the content of the trace data file into an array of
- *	  tep_records. Use this function only if you need fast access
- *	  to all fields of the record.
- *
- * @param kshark_ctx: Input location for the session context pointer.
- * @param sd: Data stream identifier.
- * @param data_rows: Output location for the trace data. Use free_record()
- *	 	     to free the elements of the outputted array.
- *
- * @returns The size of the outputted data in the case of success, or a
- *	    negative error code on failure.
- */
-ssize_t kshark_load_data_records(struct kshark_context *kshark_ctx, int sd,
-				struct tep_record ***data_rows)
+/* Get the record of the CPU to be loaded after the one at time "ts". */
+static struct tep_record *load_next_rec(struct load_context *load, int cpu,
+					uint64_t ts)
 {
-	struct kshark_data_stream *stream;
-	struct tep_record **rows;
 	struct tep_record *rec;
-	struct rec_list **rec_list;
-	struct rec_list *temp_rec;
-	enum rec_type type = REC_RECORD;
-	size_t count, total = 0;
-	int n_cpus;
+	uint64_t next;
 
-	if (*data_rows)
-		free(*data_rows);
+	if (load->step) {
+		/* Jump to the beginning of the next interval. */
+		next = load->min + ((ts - load->min) / load->step + 1) *
+				   load->step;
+		if (next <= ts || next > load->max)
+			return NULL;
 
-	stream = kshark_get_data_stream(kshark_ctx, sd);
-	if (!stream)
-		return -EBADF;
+		return load_first_rec(load, cpu, next);
+	}
 
-	total = get_records(kshark_ctx, sd, &rec_list, REC_RECORD);
-	if (total < 0)
-		goto fail;
+	rec = tracecmd_read_data(load->stream->handle, cpu);
+	if (rec && rec->ts > load->max) {
+		free_record(rec);
+		return NULL;
+	}
 
-	rows = calloc(total, sizeof(struct tep_record *));
-	if (!rows)
-		goto fail;
+	return rec;
+}
 
-	n_cpus = tracecmd_cpus(stream->handle);
+static struct kshark_entry *load_entry(struct load_context *load,
+				       struct tep_record *rec,
+				       struct rec_array *recs)
+{
+	struct kshark_context *kshark_ctx = load->kshark_ctx;
+	struct kshark_data_stream *stream = load->stream;
+	struct kshark_event_handler *evt_handler;
+	struct tep_event_filter *adv_filter;
+	struct kshark_entry *entry;
+	int ret;
+
+	/* Just to shorten the name */
+	adv_filter = stream->advanced_event_filter;
+
+	entry = entry_alloc(&recs->blocks);
+	if (!entry)
+		return NULL;
 
-	for (count = 0; count < total; count++) {
-		int next_cpu;
+	kshark_set_entry_values(stream, rec, entry);
+	entry->stream_id = load->sd;
 
-		next_cpu = pick_next_cpu(rec_list, n_cpus, type);
+	/* Execute all plugin-provided actions (if any). */
+	evt_handler = kshark_ctx->event_handlers;
+	if (evt_handler) {
+		pthread_mutex_lock(&load->mutex);
 
-		if (next_cpu >= 0) {
-			rec = rec_list[next_cpu]->rec;
-			rows[count] = rec;
+		while ((evt_handler = kshark_find_event_handler(evt_handler,
+								entry->event_id,
+								entry->stream_id))) {
+			evt_handler->event_func(kshark_ctx, rec, entry);
 
-			temp_rec = rec_list[next_cpu];
-			rec_list[next_cpu] = rec_list[next_cpu]->next;
-			free(temp_rec);
-			/* The record is still referenced in rows */
+			if ((evt_handler = evt_handler->next))
+				entry->visible &= ~KS_PLUGIN_UNTOUCHED_MASK;
 		}
+
+		pthread_mutex_unlock(&load->mutex);
 	}
 
-	/* There should be no records left in rec_list */
-	free_rec_list(rec_list, n_cpus, type);
-	*data_rows = rows;
-	return total;
+	/* Apply event filtering. */
+	ret = FILTER_MATCH;
+	if (adv_filter->filters) {
+		pthread_mutex_lock(&load->mutex);
+		ret = tep_filter_match(adv_filter, rec);
+		pthread_mutex_unlock(&load->mutex);
+	}
 
- fail:
-	fprintf(stderr, "Failed to allocate memory during data loading.\n");
-	return -ENOMEM;
+	if (!kshark_show_event(stream, entry->event_id) ||
+	    ret != FILTER_MATCH) {
+		unset_event_filter_flag(stream, entry);
+	}
+
+	/* Apply task filtering. */
+	if (!kshark_show_task(stream, entry->pid)) {
+		entry->visible &= ~stream->filter_mask;
+	}
+
+	return entry;
 }
 
-/**
- * @brief A thread-safe read of a record from a specific offset.
- *
- * @param kshark_ctx: Input location for the session context pointer.
- * @param sd: Data stream identifier.
- * @param offset: the offset into the file to find the record.
- *
- * @returns The returned pevent_record must be freed.
+/*
+ * Load the entries of the CPU a page at a time. No record gets allocated.
  */
-struct tep_record *kshark_read_at(struct kshark_context *kshark_ctx, int sd,
-				  uint64_t offset)
+static int load_cpu_pages(struct load_context *load, int cpu,
+			  struct kshark_task_list **tasks)
 {
-	struct kshark_data_stream *stream;
-	struct tep_record *data;
+	struct tracecmd_input *handle = load->stream->handle;
+	struct rec_array *recs = &load->cpu_recs[cpu];
+	struct tracecmd_page_records page = {};
+	struct kshark_entry *entry;
+	int i, n, ret = 0;
+
+	while ((n = tracecmd_read_page_records(handle, cpu, &page)) > 0) {
+		for (i = 0; i < n; ++i) {
+			if (page.records[i].ts > load->max)
+				goto out;
+
+			entry = load_entry(load, &page.records[i], recs);
+			if (!entry ||
+			    !kshark_add_task(tasks, entry->pid) ||
+			    !rec_array_append(recs, entry)) {
+				ret = -ENOMEM;
+				goto out;
+			}
+		}
+	}
 
-	stream = kshark_get_data_stream(kshark_ctx, sd);
-	if (!stream)
-		return NULL;
+ out:
+	tracecmd_free_page_records(&page);
 
-	/*
-	 * Calling tracecmd_read_at() is not thread-safe. Use a mutex to
-	 * protect the access.
-	 */
-	pthread_mutex_lock(&stream->input_mutex);
+	return ret;
+}
 
-	data = tracecmd_read_at(stream->handle, offset, NULL);
+static int load_cpu(struct load_context *load, int cpu,
+		    struct kshark_task_list **tasks)
+{
+	struct kshark_data_stream *stream = load->stream;
+	struct rec_array *recs = &load->cpu_recs[cpu];
+	struct kshark_task_list *task;
+	struct kshark_entry *entry;
+	struct tep_record *rec;
+	int pid, ret = 0;
+	void *data;
+	uint64_t ts;
+	size_t i;
+
+	rec = load_first_rec(load, cpu, load->min);
+	while (rec) {
+		ts = rec->ts;
+		switch (load->type) {
+		case REC_RECORD:
+			data = rec;
+			pid = tep_data_pid(stream->pevent, rec);
+			break;
+		case REC_ENTRY:
+			entry = load_entry(load, rec, recs);
+			free_record(rec);
+			if (!entry)
+				return -ENOMEM;
 
-	pthread_mutex_unlock(&stream->input_mutex);
+			data = entry;
+			pid = entry->pid;
+			break;
+		default:
+			free_record(rec);
+			return -EINVAL;
+		}
 
-	return data;
-}
+		task = kshark_add_task(tasks, pid);
+		if (!task || !rec_array_append(recs, data)) {
+			if (load->type == REC_RECORD)
+				free_record(rec);
 
-static const char *kshark_get_latency(struct tep_handle *pe,
-				      struct tep_record *record)
-{
-	if (!record)
-		return NULL;
+			return -ENOMEM;
+		}
 
-	trace_seq_reset(&seq);
-	tep_data_lat_fmt(pe, &seq, record);
-	return seq.buffer;
-}
+		if (load->type == REC_ENTRY && !load->step) {
+			/* Load the rest of the entries a page at a time. */
+			ret = load_cpu_pages(load, cpu, tasks);
+			break;
+		}
 
-static const char *kshark_get_info(struct tep_handle *pe,
-				   struct tep_record *record,
-				   struct tep_event_format *event)
-{
-	char *pos;
+		rec = load_next_rec(load, cpu, ts);
+	}
 
-	if (!record || !event)
-		return NULL;
+	/* Link the entries of this CPU. */
+	if (load->type == REC_ENTRY)
+		for (i = 1; i < recs->size; ++i)
+			recs->entry[i - 1]->next = recs->entry[i];
 
-	trace_seq_reset(&seq);
-	tep_event_info(&seq, event, record);
+	return ret;
+}
+
+static void *load_cpus_thread(void *arg)
+{
+	struct load_context *load = arg;
+	struct kshark_task_list **tasks, *task;
+	int cpu, i;
 
 	/*
-	 * The event info string contains a trailing newline.
-	 * Remove this newline.
+	 * Use a private hash of tasks. It will be merged into the hash of
+	 * the stream at the end.
 	 */
-	if ((pos = strchr(seq.buffer, '\n')) != NULL)
-		*pos = '\0';
+	tasks = calloc(KS_TASK_HASH_SIZE, sizeof(*tasks));
+	if (!tasks) {
+		set_load_failed(load);
+		return NULL;
+	}
 
-	return seq.buffer;
+	/* Take the next CPU which is not loaded yet. */
+	while (!load_failed(load)) {
+		cpu = __atomic_fetch_add(&load->next_cpu, 1, __ATOMIC_RELAXED);
+		if (cpu >= load->n_cpus)
+			break;
+
+		if (load_cpu(load, cpu, tasks) < 0)
+			set_load_failed(load);
+	}
+
+	pthread_mutex_lock(&load->mutex);
+
+	for (i = 0; i < KS_TASK_HASH_SIZE; ++i)
+		for (task = tasks[i]; task; task = task->next)
+			if (!kshark_add_task(load->stream->tasks, task->pid))
+				set_load_failed(load);
+
+	pthread_mutex_unlock(&load->mutex);
+
+	kshark_free_task_list(tasks);
+	free(tasks);
+
+	return NULL;
+}
+
+static size_t rec_lower_bound(struct rec_array *recs, uint64_t ts,
+			      enum rec_type type)
+{
+	size_t l = 0, h = recs->size, mid;
+
+	while (l < h) {
+		mid = l + (h - l) / 2;
+		if (rec_ts(recs->data[mid], type) < ts)
+			l = mid + 1;
+		else
+			h = mid;
+	}
+
+	return l;
+}
+
+static size_t count_before(struct load_context *load, uint64_t ts)
+{
+	size_t count = 0;
+	int cpu;
+
+	for (cpu = 0; cpu < load->n_cpus; ++cpu)
+		count += rec_lower_bound(&load->cpu_recs[cpu], ts, load->type);
+
+	return count;
+}
+
+/*
+ * Find the smallest timestamp, such that at least "rank" elements have
+ * timestamps smaller than it.
+ */
+static uint64_t find_split_ts(struct load_context *load, size_t rank)
+{
+	uint64_t l = UINT64_MAX, h = 0, mid;
+	struct rec_array *recs;
+	int cpu;
+
+	for (cpu = 0; cpu < load->n_cpus; ++cpu) {
+		recs = &load->cpu_recs[cpu];
+		if (!recs->size)
+			continue;
+
+		if (rec_ts(recs->data[0], load->type) < l)
+			l = rec_ts(recs->data[0], load->type);
+
+		if (rec_ts(recs->data[recs->size - 1], load->type) >= h)
+			h = rec_ts(recs->data[recs->size - 1], load->type) + 1;
+	}
+
+	while (l < h) {
+		mid = l + (h - l) / 2;
+		if (count_before(load, mid) < rank)
+			l = mid + 1;
+		else
+			h = mid;
+	}
+
+	return l;
+}
+
+static void *merge_part_thread(void *arg)
+{
+	struct merge_part *part = arg;
+	struct load_context *load = part->load;
+	struct rec_array *recs = load->cpu_recs;
+	struct tracecmd_heap heap;
+	size_t count = 0;
+	int cpu;
+
+	/* Order the CPUs by the timestamp of their next element. */
+	if (tracecmd_heap_init(&heap, load->n_cpus) < 0) {
+		set_load_failed(load);
+		return NULL;
+	}
+
+	for (cpu = 0; cpu < load->n_cpus; ++cpu)
+		if (part->pos[cpu] < part->last[cpu])
+			tracecmd_heap_update(&heap, cpu,
+					     rec_ts(recs[cpu].data[part->pos[cpu]],
+						    load->type));
+
+	while ((cpu = tracecmd_heap_top(&heap)) >= 0) {
+		part->rows[count++] = recs[cpu].data[part->pos[cpu]++];
+
+		if (part->pos[cpu] < part->last[cpu])
+			tracecmd_heap_update(&heap, cpu,
+					     rec_ts(recs[cpu].data[part->pos[cpu]],
+						    load->type));
+		else
+			tracecmd_heap_remove(&heap, cpu);
+	}
+
+	tracecmd_heap_free(&heap);
+
+	return NULL;
+}
+
+/*
+ * Execute "func" for each element of "args", using a separate thread per
+ * element. The last element is processed by the calling thread.
+ */
+static void run_threads(void *(*func)(void *), void **args, int n_threads)
+{
+	pthread_t *threads;
+	int i, n_started = 0;
+
+	threads = calloc(n_threads, sizeof(*threads));
+	if (threads) {
+		for (; n_started < n_threads - 1; ++n_started)
+			if (pthread_create(&threads[n_started], NULL, func,
+					   args[n_started]) != 0)
+				break;
+	}
+
+	/* The elements without a thread are processed here. */
+	for (i = n_started; i < n_threads; ++i)
+		func(args[i]);
+
+	for (i = 0; i < n_started; ++i)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+}
+
+static int get_n_threads(struct kshark_context *kshark_ctx, size_t n_max)
+{
+	long n_threads = kshark_ctx->n_load_threads;
+
+	if (n_threads <= 0)
+		n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n_threads > n_max)
+		n_threads = n_max;
+
+	return n_threads > 0 ? n_threads : 1;
+}
+
+static bool merge_rec_arrays(struct load_context *load, void **rows,
+			     size_t total)
+{
+	struct merge_part *parts = NULL;
+	size_t *bounds = NULL, *pos = NULL;
+	void **args = NULL;
+	int n_cpus = load->n_cpus;
+	int n_parts, p, cpu;
+	bool ret = false;
+	uint64_t ts;
+
+	/*
+	 * Split the data into time intervals having (about) the same number
+	 * of elements and merge each interval using a separate thread.
+	 */
+	n_parts = get_n_threads(load->kshark_ctx,
+				total / KS_MERGE_PART_MIN_SIZE);
+
+	parts = calloc(n_parts, sizeof(*parts));
+	args = calloc(n_parts, sizeof(*args));
+	bounds = calloc((n_parts + 1) * n_cpus, sizeof(*bounds));
+	pos = calloc(n_parts * n_cpus, sizeof(*pos));
+	if (!parts || !args || !bounds || !pos)
+		goto out;
+
+	for (cpu = 0; cpu < n_cpus; ++cpu)
+		bounds[n_parts * n_cpus + cpu] = load->cpu_recs[cpu].size;
+
+	for (p = 1; p < n_parts; ++p) {
+		ts = find_split_ts(load, total * p / n_parts);
+		for (cpu = 0; cpu < n_cpus; ++cpu)
+			bounds[p * n_cpus + cpu] =
+				rec_lower_bound(&load->cpu_recs[cpu], ts,
+						load->type);
+	}
+
+	for (p = 0; p < n_parts; ++p) {
+		parts[p].load = load;
+		parts[p].rows = rows;
+		parts[p].pos = &pos[p * n_cpus];
+		parts[p].last = &bounds[(p + 1) * n_cpus];
+		for (cpu = 0; cpu < n_cpus; ++cpu) {
+			parts[p].pos[cpu] = bounds[p * n_cpus + cpu];
+			rows += parts[p].last[cpu] - parts[p].pos[cpu];
+		}
+
+		args[p] = &parts[p];
+	}
+
+	run_threads(merge_part_thread, args, n_parts);
+	ret = !load->failed;
+
+ out:
+	free(parts);
+	free(args);
+	free(bounds);
+	free(pos);
+
+	return ret;
+}
+
+static ssize_t get_records(struct kshark_context *kshark_ctx, int sd,
+			   uint64_t min, uint64_t max, uint64_t step,
+			   struct kshark_entry_block **blocks,
+			   void ***data_rows, enum rec_type type)
+{
+	struct load_context load;
+	size_t total = 0;
+	void **args;
+	void **rows;
+	bool frozen;
+	int n_threads;
+	int cpu, i;
+
+	load.kshark_ctx = kshark_ctx;
+	load.stream = kshark_get_data_stream(kshark_ctx, sd);
+	load.sd = sd;
+	load.type = type;
+	load.min = min;
+	load.max = max;
+	load.step = step;
+	load.next_cpu = 0;
+	load.failed = false;
+
+	load.n_cpus = tracecmd_cpus(load.stream->handle);
+	load.cpu_recs = calloc(load.n_cpus, sizeof(*load.cpu_recs));
+	if (!load.cpu_recs)
+		return -ENOMEM;
+
+	if (pthread_mutex_init(&load.mutex, NULL) != 0) {
+		free(load.cpu_recs);
+		return -EAGAIN;
+	}
+
+	/*
+	 * Resolve all that the pevent handle looks up lazily, so that the
+	 * loading threads can share it. The handle is frozen only while
+	 * they run, unless the caller froze it.
+	 */
+	frozen = tep_is_frozen(load.stream->pevent);
+	if (tep_freeze(load.stream->pevent) < 0) {
+		pthread_mutex_destroy(&load.mutex);
+		free(load.cpu_recs);
+		return -ENOMEM;
+	}
+
+	/*
+	 * All loading threads share the same load context. Each CPU is
+	 * decoded by a single thread, using the CPU's own page iterator.
+	 */
+	n_threads = get_n_threads(kshark_ctx, load.n_cpus);
+	args = calloc(n_threads, sizeof(*args));
+	if (!args) {
+		load.failed = true;
+	} else {
+		for (i = 0; i < n_threads; ++i)
+			args[i] = &load;
+
+		run_threads(load_cpus_thread, args, n_threads);
+		free(args);
+	}
+
+	if (!frozen)
+		tep_thaw(load.stream->pevent);
+
+	pthread_mutex_destroy(&load.mutex);
+
+	if (load.failed)
+		goto fail;
+
+	for (cpu = 0; cpu < load.n_cpus; ++cpu)
+		total += load.cpu_recs[cpu].size;
+
+	rows = calloc(total, sizeof(*rows));
+	if (!rows && total)
+		goto fail;
+
+	if (!merge_rec_arrays(&load, rows, total)) {
+		free(rows);
+		goto fail;
+	}
+
+	/*
+	 * The memory of the entries is now owned by the stream, or by the
+	 * caller if it asked for the blocks.
+	 */
+	if (!blocks)
+		blocks = &load.stream->entry_blocks;
+
+	for (cpu = 0; cpu < load.n_cpus; ++cpu) {
+		struct kshark_entry_block *last = load.cpu_recs[cpu].blocks;
+
+		if (!last)
+			continue;
+
+		while (last->next)
+			last = last->next;
+
+		last->next = *blocks;
+		*blocks = load.cpu_recs[cpu].blocks;
+	}
+
+	/* The loaded data is now referenced by the rows. */
+	free_rec_arrays(load.cpu_recs, load.n_cpus, type, false);
+
+	*data_rows = rows;
+	return total;
+
+ fail:
+	free_rec_arrays(load.cpu_recs, load.n_cpus, type, true);
+	return -ENOMEM;
+}
+
+/**
+ * @brief Load the content of the trace data file into an array of
+ *	  kshark_entries. This function provides an abstraction of the
+ *	  entries from the raw data that is read, however the "latency"
+ *	  and the "info" fields can be accessed only via the offset
+ *	  into the file. This makes the access to these two fields much
+ *	  slower.
+ *	  If one or more filters are set, the "visible" fields of each entry
+ *	  is updated according to the criteria provided by the filters. The
+ *	  field "filter_mask" of the session's context is used to control the
+ *	  level of visibility/invisibility of the filtered entries.
+ *	  The data of each CPU is loaded by a separate thread (see the field
+ *	  "n_load_threads" of the session's context).
+ *
+ * @param kshark_ctx: Input location for context pointer.
+ * @param sd: Data stream identifier.
+ * @param data_rows: Output location for the trace data. The entries are
+ *		     owned by the data stream. Do not free the elements of
+ *		     the outputted array. They get freed all together by
+ *		     kshark_free_data_entries() or when the stream is
+ *		     closed. The user is responsible for freeing the array
+ *		     itself.
+ *
+ * @returns The size of the outputted data in the case of success, or a
+ *	    negative error code on failure.
+ */
+ssize_t kshark_load_data_entries(struct kshark_context *kshark_ctx, int sd,
+				struct kshark_entry ***data_rows)
+{
+	struct kshark_data_stream *stream;
+	ssize_t total;
+
+	if (*data_rows)
+		free(*data_rows);
+
+	*data_rows = NULL;
+
+	stream = kshark_get_data_stream(kshark_ctx, sd);
+	if (!stream)
+		return -EBADF;
+
+	total = get_records(kshark_ctx, sd, 0, UINT64_MAX, 0, NULL,
+			    (void ***) data_rows, REC_ENTRY);
+	if (total < 0)
+		fprintf(stderr,
+			"Failed to allocate memory during data loading.\n");
+
+	return total;
+}
+
+/**
+ * @brief Load the part of the trace data file, which is inside a given time
+ *	  range, into an array of kshark_entries. The position of the range
+ *	  in the file is found using the timestamps of the pages, thus the
+ *	  data outside of the range is not read. Otherwise the loading works
+ *	  the same way as kshark_load_data_entries().
+ *
+ * @param kshark_ctx: Input location for context pointer.
+ * @param sd: Data stream identifier.
+ * @param min: Lower edge of the time range (inclusive).
+ * @param max: Upper edge of the time range (inclusive).
+ * @param step: If not zero, only the first entry of each CPU inside each
+ *		interval of size "step" (starting from "min") is loaded.
+ *		This gives a sample of the data, which is cheap to load
+ *		even if the range is huge.
+ * @param blocks: If not NULL, the entries are not owned by the data
+ *		  stream. Instead, the memory blocks holding them are added
+ *		  to this list, and the caller frees them with
+ *		  kshark_free_entry_blocks(). The list must be initialized.
+ * @param data_rows: Output location for the trace data. See
+ *		     kshark_load_data_entries().
+ *
+ * @returns The size of the outputted data in the case of success, or a
+ *	    negative error code on failure.
+ */
+ssize_t kshark_load_data_entries_range(struct kshark_context *kshark_ctx,
+				       int sd, uint64_t min, uint64_t max,
+				       uint64_t step,
+				       struct kshark_entry_block **blocks,
+				       struct kshark_entry ***data_rows)
+{
+	struct kshark_data_stream *stream;
+	ssize_t total;
+
+	if (*data_rows)
+		free(*data_rows);
+
+	*data_rows = NULL;
+
+	stream = kshark_get_data_stream(kshark_ctx, sd);
+	if (!stream)
+		return -EBADF;
+
+	if (min > max)
+		return -EINVAL;
+
+	total = get_records(kshark_ctx, sd, min, max, step, blocks,
+			    (void ***) data_rows, REC_ENTRY);
+	if (total < 0)
+		fprintf(stderr,
+			"Failed to allocate memory during data loading.\n");
+
+	return total;
+}
+
+/**
+ * @brief Load the content of the trace data file into an array of
+ *	  tep_records. Use this function only if you need fast access
+ *	  to all fields of the record.
+ *
+ * @param kshark_ctx: Input location for the session context pointer.
+ * @param sd: Data stream identifier.
+ * @param data_rows: Output location for the trace data. Use free_record()
+ *	 	     to free the elements of the outputted array.
+ *
+ * @returns The size of the outputted data in the case of success, or a
+ *	    negative error code on failure.
+ */
+ssize_t kshark_load_data_records(struct kshark_context *kshark_ctx, int sd,
+				struct tep_record ***data_rows)
+{
+	struct kshark_data_stream *stream;
+	ssize_t total;
+
+	if (*data_rows)
+		free(*data_rows);
+
+	*data_rows = NULL;
+
+	stream = kshark_get_data_stream(kshark_ctx, sd);
+	if (!stream)
+		return -EBADF;
+
+	total = get_records(kshark_ctx, sd, 0, UINT64_MAX, 0, NULL,
+			    (void ***) data_rows, REC_RECORD);
+	if (total < 0)
+		fprintf(stderr,
+			"Failed to allocate memory during data loading.\n");
+
+	return total;
+}
+
+/** Magic string, identifying the cache files of the trace data. */
+#define KS_CACHE_MAGIC		"KSCACHE"
+
+/** Version of the format of the cache files. */
+#define KS_CACHE_VERSION	1
+
+/** The suffix added to the name of the trace data file, to get the cache. */
+#define KS_CACHE_SUFFIX		".kscache"
+
+/**
+ * The header of a cache file. The header is followed by the array of
+ * entries (in time order) and by the list of tasks. The cache is valid
+ * only for the trace data file and the filters described by the header.
+ */
+struct kshark_cache_header {
+	/** Must be KS_CACHE_MAGIC. */
+	char		magic[8];
+
+	/** Must be KS_CACHE_VERSION. */
+	uint32_t	version;
+
+	/** The size of struct kshark_entry. */
+	uint32_t	entry_size;
+
+	/** Device of the trace data file. */
+	uint64_t	file_dev;
+
+	/** Inode of the trace data file. */
+	uint64_t	file_ino;
+
+	/** Size of the trace data file. */
+	uint64_t	file_size;
+
+	/** Modification time of the trace data file (seconds). */
+	int64_t		file_mtime_sec;
+
+	/** Modification time of the trace data file (nanoseconds). */
+	int64_t		file_mtime_nsec;
+
+	/** Hash of the plugins and of the filters, used for loading. */
+	uint64_t	config_hash;
+
+	/** The number of entries. */
+	uint64_t	n_entries;
+
+	/** The number of tasks. */
+	uint64_t	n_tasks;
+};
+
+/** The size of the part of the header, which identifies the cached data. */
+#define KS_CACHE_ID_SIZE	offsetof(struct kshark_cache_header, n_entries)
+
+/* FNV-1a */
+static uint64_t cache_hash(uint64_t hash, const void *data, size_t size)
+{
+	const uint8_t *ptr = data;
+	size_t i;
+
+	for (i = 0; i < size; ++i)
+		hash = (hash ^ ptr[i]) * 1099511628211ULL;
+
+	return hash;
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+	return *(const int *) a - *(const int *) b;
+}
+
+static uint64_t cache_hash_filter(uint64_t hash,
+				  struct tracecmd_filter_id *filter)
+{
+	int *ids, n;
+
+	ids = tracecmd_filter_ids(filter);
+	if (!ids)
+		return cache_hash(hash, &filter->count, sizeof(filter->count));
+
+	n = filter->count;
+	qsort(ids, n, sizeof(*ids), compare_ids);
+	hash = cache_hash(hash, &n, sizeof(n));
+	hash = cache_hash(hash, ids, n * sizeof(*ids));
+	free(ids);
+
+	return hash;
+}
+
+/*
+ * The plugins, and the events of the stream they handle, while loading the
+ * data. A plugin, which is rebuilt, may handle the events differently.
+ */
+static uint64_t cache_hash_plugins(uint64_t hash,
+				   struct kshark_context *kshark_ctx, int sd)
+{
+	struct kshark_event_handler *evt_handler;
+	struct kshark_plugin_list *plugin;
+	struct stat st;
+
+	for (plugin = kshark_ctx->plugins; plugin; plugin = plugin->next) {
+		hash = cache_hash(hash, plugin->file, strlen(plugin->file) + 1);
+		if (stat(plugin->file, &st) < 0)
+			continue;
+
+		hash = cache_hash(hash, &st.st_size, sizeof(st.st_size));
+		hash = cache_hash(hash, &st.st_mtim, sizeof(st.st_mtim));
+	}
+
+	for (evt_handler = kshark_ctx->event_handlers; evt_handler;
+	     evt_handler = evt_handler->next) {
+		if (evt_handler->sd != sd || !evt_handler->event_func)
+			continue;
+
+		hash = cache_hash(hash, &evt_handler->id,
+				  sizeof(evt_handler->id));
+	}
+
+	return hash;
+}
+
+static uint64_t cache_config_hash(struct kshark_context *kshark_ctx, int sd,
+				  struct kshark_data_stream *stream)
+{
+	struct tep_event_filter *adv_filter = stream->advanced_event_filter;
+	uint64_t hash = 14695981039346656037ULL;
+	char *str;
+	int i;
+
+	hash = cache_hash_plugins(hash, kshark_ctx, sd);
+
+	hash = cache_hash(hash, &stream->filter_mask,
+			  sizeof(stream->filter_mask));
+
+	hash = cache_hash_filter(hash, stream->show_task_filter);
+	hash = cache_hash_filter(hash, stream->hide_task_filter);
+	hash = cache_hash_filter(hash, stream->show_event_filter);
+	hash = cache_hash_filter(hash, stream->hide_event_filter);
+
+	for (i = 0; adv_filter && i < adv_filter->filters; ++i) {
+		str = tep_filter_make_string(adv_filter,
+					     adv_filter->event_filters[i].event_id);
+		if (str) {
+			hash = cache_hash(hash, str, strlen(str) + 1);
+			free(str);
+		}
+	}
+
+	return hash;
+}
+
+static bool cache_header_init(struct kshark_context *kshark_ctx, int sd,
+			      struct kshark_data_stream *stream,
+			      struct kshark_cache_header *header)
+{
+	struct stat st;
+
+	if (!stream->file || stat(stream->file, &st) < 0)
+		return false;
+
+	memset(header, 0, sizeof(*header));
+	strcpy(header->magic, KS_CACHE_MAGIC);
+	header->version = KS_CACHE_VERSION;
+	header->entry_size = sizeof(struct kshark_entry);
+	header->file_dev = st.st_dev;
+	header->file_ino = st.st_ino;
+	header->file_size = st.st_size;
+	header->file_mtime_sec = st.st_mtim.tv_sec;
+	header->file_mtime_nsec = st.st_mtim.tv_nsec;
+	header->config_hash = cache_config_hash(kshark_ctx, sd, stream);
+
+	return true;
+}
+
+/** A name of a task, read from a cache file. */
+struct cache_comm {
+	/** Process Id of the task. */
+	int	pid;
+
+	/** The name of the task. */
+	char	*comm;
+};
+
+static void free_cache_comms(struct cache_comm *comms, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		free(comms[i].comm);
+
+	free(comms);
+}
+
+static bool cache_entry_valid(struct kshark_data_stream *stream,
+			      struct kshark_entry *entry, int n_cpus)
+{
+	return entry->cpu >= 0 && entry->cpu < n_cpus &&
+	       tep_data_event_from_type(stream->pevent, entry->event_id);
+}
+
+/*
+ * Read the list of tasks of a cache file into a private hash of tasks,
+ * and the names of the tasks, unknown to the trace data file, into
+ * "comms". Nothing is registered to the data stream yet.
+ */
+static bool cache_read_tasks(struct kshark_data_stream *stream, FILE *fp,
+			     uint64_t n_tasks, struct kshark_task_list **tasks,
+			     struct cache_comm **comms, size_t *n_comms)
+{
+	struct cache_comm *new_comms;
+	char comm[256];
+	uint32_t len;
+	int32_t pid;
+	uint64_t i;
+
+	for (i = 0; i < n_tasks; ++i) {
+		if (fread(&pid, sizeof(pid), 1, fp) != 1 ||
+		    fread(&len, sizeof(len), 1, fp) != 1 ||
+		    len >= sizeof(comm) ||
+		    fread(comm, 1, len, fp) != len)
+			return false;
+
+		comm[len] = '\0';
+		if (!kshark_add_task(tasks, pid))
+			return false;
+
+		/*
+		 * The plugins may have registered the names of tasks, which
+		 * are unknown to the trace data file.
+		 */
+		if (!len || strcmp(tep_data_comm_from_pid(stream->pevent, pid),
+				   "<...>") != 0)
+			continue;
+
+		new_comms = realloc(*comms, (*n_comms + 1) * sizeof(**comms));
+		if (!new_comms)
+			return false;
+
+		*comms = new_comms;
+		new_comms[*n_comms].pid = pid;
+		new_comms[*n_comms].comm = strdup(comm);
+		if (!new_comms[*n_comms].comm)
+			return false;
+
+		(*n_comms)++;
+	}
+
+	return true;
+}
+
+/* Move the tasks, which are not known to the stream yet, to the stream. */
+static void cache_merge_tasks(struct kshark_data_stream *stream,
+			      struct kshark_task_list **tasks)
+{
+	struct kshark_task_list *task;
+	int i;
+
+	for (i = 0; i < KS_TASK_HASH_SIZE; ++i) {
+		while ((task = tasks[i])) {
+			tasks[i] = task->next;
+			if (kshark_find_task(stream->tasks, i, task->pid)) {
+				free(task);
+				continue;
+			}
+
+			task->next = stream->tasks[i];
+			stream->tasks[i] = task;
+		}
+	}
+}
+
+static ssize_t cache_load(struct kshark_data_stream *stream, int sd,
+			  const char *cache_file,
+			  struct kshark_cache_header *expected,
+			  struct kshark_entry ***data_rows)
+{
+	struct kshark_cache_header header;
+	struct kshark_entry_block *block = NULL;
+	struct kshark_task_list **tasks = NULL;
+	struct cache_comm *comms = NULL;
+	struct kshark_entry **rows = NULL;
+	struct kshark_entry *entries;
+	size_t n_comms = 0;
+	uint64_t i, next;
+	int n_cpus;
+	FILE *fp;
+
+	fp = fopen(cache_file, "r");
+	if (!fp)
+		return -ENOENT;
+
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+	    memcmp(&header, expected, KS_CACHE_ID_SIZE) != 0)
+		goto fail;
+
+	block = entry_block_alloc(header.n_entries);
+	rows = malloc(header.n_entries * sizeof(*rows));
+	tasks = calloc(KS_TASK_HASH_SIZE, sizeof(*tasks));
+	if (!block || (!rows && header.n_entries) || !tasks)
+		goto fail;
+
+	entries = block->entries;
+	block->size = header.n_entries;
+	if (fread(entries, sizeof(*entries), header.n_entries, fp) !=
+	    header.n_entries)
+		goto fail;
+
+	/* The "next" fields hold the (index + 1) of the next entry. */
+	n_cpus = tracecmd_cpus(stream->handle);
+	for (i = 0; i < header.n_entries; ++i) {
+		next = (uintptr_t) entries[i].next;
+		if (next > header.n_entries ||
+		    !cache_entry_valid(stream, &entries[i], n_cpus))
+			goto fail;
+
+		entries[i].next = next ? &entries[next - 1] : NULL;
+		entries[i].stream_id = sd;
+		rows[i] = &entries[i];
+	}
+
+	/*
+	 * Read all of the cache before registering anything, so that
+	 * nothing needs to be undone if the cache turns out to be broken.
+	 */
+	if (!cache_read_tasks(stream, fp, header.n_tasks, tasks,
+			      &comms, &n_comms))
+		goto fail;
+
+	fclose(fp);
+
+	cache_merge_tasks(stream, tasks);
+	free(tasks);
+
+	for (i = 0; i < n_comms; ++i)
+		tep_register_comm(stream->pevent, comms[i].comm, comms[i].pid);
+
+	free_cache_comms(comms, n_comms);
+
+	block->next = stream->entry_blocks;
+	stream->entry_blocks = block;
+	*data_rows = rows;
+
+	return header.n_entries;
+
+ fail:
+	fclose(fp);
+	free(block);
+	free(rows);
+	kshark_free_task_list(tasks);
+	free(tasks);
+	free_cache_comms(comms, n_comms);
+
+	return -EINVAL;
+}
+
+static int cache_save(struct kshark_data_stream *stream,
+		      const char *cache_file,
+		      struct kshark_cache_header *header,
+		      struct kshark_entry **data_rows, size_t n_rows)
+{
+	uint64_t *next_index = NULL, *cpu_next = NULL;
+	struct kshark_task_list *task;
+	struct kshark_entry entry;
+	char *tmp_file = NULL;
+	const char *comm;
+	int n_cpus, cpu, i, fd;
+	FILE *fp = NULL;
+	uint32_t len;
+	ssize_t r;
+
+	/*
+	 * The entries of a CPU are linked in time order. Going backwards,
+	 * find the (index + 1) of the entry following each entry, or 0 if
+	 * it is the last entry of its CPU.
+	 */
+	n_cpus = tracecmd_cpus(stream->handle);
+	cpu_next = calloc(n_cpus, sizeof(*cpu_next));
+	next_index = malloc(n_rows * sizeof(*next_index));
+	if (!cpu_next || !next_index)
+		goto fail;
+
+	for (r = n_rows - 1; r >= 0; --r) {
+		cpu = data_rows[r]->cpu;
+		if (cpu < 0 || cpu >= n_cpus)
+			goto fail;
+
+		/* Make sure that the entries are linked as expected. */
+		if (data_rows[r]->next !=
+		    (cpu_next[cpu] ? data_rows[cpu_next[cpu] - 1] : NULL))
+			goto fail;
+
+		next_index[r] = cpu_next[cpu];
+		cpu_next[cpu] = r + 1;
+	}
+
+	/*
+	 * Write to a new file with an unpredictable name in the same
+	 * directory, and replace the cache with it once complete.
+	 */
+	if (asprintf(&tmp_file, "%s.XXXXXX", cache_file) < 0) {
+		tmp_file = NULL;
+		goto fail;
+	}
+
+	fd = mkstemp(tmp_file);
+	if (fd < 0) {
+		free(tmp_file);
+		tmp_file = NULL;
+		goto fail;
+	}
+
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		goto fail;
+	}
+
+	header->n_entries = n_rows;
+	header->n_tasks = 0;
+	for (i = 0; i < KS_TASK_HASH_SIZE; ++i)
+		for (task = stream->tasks[i]; task; task = task->next)
+			header->n_tasks++;
+
+	if (fwrite(header, sizeof(*header), 1, fp) != 1)
+		goto fail;
+
+	for (r = 0; r < n_rows; ++r) {
+		entry = *data_rows[r];
+		entry.next = (struct kshark_entry *) (uintptr_t) next_index[r];
+		if (fwrite(&entry, sizeof(entry), 1, fp) != 1)
+			goto fail;
+	}
+
+	for (i = 0; i < KS_TASK_HASH_SIZE; ++i) {
+		for (task = stream->tasks[i]; task; task = task->next) {
+			comm = tep_data_comm_from_pid(stream->pevent, task->pid);
+			len = strcmp(comm, "<...>") == 0 ? 0 : strlen(comm);
+
+			if (fwrite(&task->pid, sizeof(int32_t), 1, fp) != 1 ||
+			    fwrite(&len, sizeof(len), 1, fp) != 1 ||
+			    fwrite(comm, 1, len, fp) != len)
+				goto fail;
+		}
+	}
+
+	r = fclose(fp);
+	fp = NULL;
+	if (r != 0 || rename(tmp_file, cache_file) < 0)
+		goto fail;
+
+	free(tmp_file);
+	free(next_index);
+	free(cpu_next);
+
+	return 0;
+
+ fail:
+	if (fp)
+		fclose(fp);
+
+	if (tmp_file) {
+		unlink(tmp_file);
+		free(tmp_file);
+	}
+
+	free(next_index);
+	free(cpu_next);
+
+	return -EIO;
+}
+
+/**
+ * @brief Load the content of the trace data file into an array of
+ *	  kshark_entries, using a cache file. The cache file is stored next
+ *	  to the trace data file (the name of the trace data file with the
+ *	  suffix ".kscache" added). If the cache is valid for the trace data
+ *	  file and for the current configuration of the plugins and of the
+ *	  filters, the entries are read from it. Otherwise the entries are
+ *	  loaded using kshark_load_data_entries() and the cache gets
+ *	  updated, if possible.
+ *	  The entries are saved after the actions of the plugins were
+ *	  executed, together with the names of the tasks registered by the
+ *	  plugins. On a cache hit these are restored, and the plugin actions
+ *	  are not executed again.
+ *
+ * @param kshark_ctx: Input location for context pointer.
+ * @param sd: Data stream identifier.
+ * @param data_rows: Output location for the trace data. See
+ *		     kshark_load_data_entries().
+ *
+ * @returns The size of the outputted data in the case of success, or a
+ *	    negative error code on failure.
+ */
+ssize_t kshark_load_data_entries_cached(struct kshark_context *kshark_ctx,
+					int sd,
+					struct kshark_entry ***data_rows)
+{
+	struct kshark_cache_header header;
+	struct kshark_data_stream *stream;
+	char *cache_file;
+	ssize_t total;
+
+	stream = kshark_get_data_stream(kshark_ctx, sd);
+	if (!stream)
+		return -EBADF;
+
+	if (!cache_header_init(kshark_ctx, sd, stream, &header) ||
+	    asprintf(&cache_file, "%s%s", stream->file, KS_CACHE_SUFFIX) < 0)
+		return kshark_load_data_entries(kshark_ctx, sd, data_rows);
+
+	if (*data_rows)
+		free(*data_rows);
+
+	*data_rows = NULL;
+
+	total = cache_load(stream, sd, cache_file, &header, data_rows);
+	if (total < 0) {
+		total = kshark_load_data_entries(kshark_ctx, sd, data_rows);
+		if (total > 0)
+			cache_save(stream, cache_file, &header,
+				   *data_rows, total);
+	}
+
+	free(cache_file);
+
+	return total;
+}
+
+/**
+ * @brief Free all entries of a data stream, loaded by
+ *	  kshark_load_data_entries(). The entries must not be used after
+ *	  calling this function.
+ *
+ * @param kshark_ctx: Input location for the session context pointer.
+ * @param sd: Data stream identifier.
+ */
+void kshark_free_data_entries(struct kshark_context *kshark_ctx, int sd)
+{
+	struct kshark_data_stream *stream;
+
+	stream = kshark_get_data_stream(kshark_ctx, sd);
+	if (!stream)
+		return;
+
+	free_entry_blocks(stream->entry_blocks);
+	stream->entry_blocks = NULL;
+}
+
+/**
+ * @brief Free the entries loaded by kshark_load_data_entries_range(), when
+ *	  the memory blocks holding them were given to the caller. The
+ *	  other entries of the data stream are not affected.
+ *
+ * @param blocks: The list of memory blocks to free.
+ */
+void kshark_free_entry_blocks(struct kshark_entry_block *blocks)
+{
+	free_entry_blocks(blocks);
+}
+
+/**
+ * @brief A thread-safe read of a record from a specific offset.
+ *
+ * @param kshark_ctx: Input location for the session context pointer.
+ * @param sd: Data stream identifier.
+ * @param offset: the offset into the file to find the record.
+ *
+ * @returns The returned pevent_record must be freed.
+ */
+struct tep_record *kshark_read_at(struct kshark_context *kshark_ctx, int sd,
+				  uint64_t offset)
+{
+	struct kshark_data_stream *stream;
+	struct tep_record *data;
+
+	stream = kshark_get_data_stream(kshark_ctx, sd);
+	if (!stream)
+		return NULL;
+
+	/*
+	 * Calling tracecmd_read_at() is not thread-safe. Use a mutex to
+	 * protect the access.
+	 */
+	pthread_mutex_lock(&stream->input_mutex);
+
+	data = tracecmd_read_at(stream->handle, offset, NULL);
+
+	pthread_mutex_unlock(&stream->input_mutex);
+
+	return data;
+}
+
+static const char *kshark_get_latency(struct tep_handle *pe,
+				      struct tep_record *record)
+{
+	if (!record)
+		return NULL;
+
+	trace_seq_reset(&seq);
+	tep_data_lat_fmt(pe, &seq, record);
+	return seq.buffer;
+}
+
+static const char *kshark_get_info(struct tep_handle *pe,
+				   struct tep_record *record,
+				   struct tep_event_format *event)
+{
+	char *pos;
+
+	if (!record || !event)
+		return NULL;
+
+	trace_seq_reset(&seq);
+	tep_event_info(&seq, event, record);
+
+	/*
+	 * The event info string contains a trailing newline.
+	 * Remove this newline.
+	 */
+	if ((pos = strchr(seq.buffer, '\n')) != NULL)
+		*pos = '\0';
+
+	return seq.buffer;
 }
 
 /**
@@ -1501,6 +2677,151 @@ ssize_t kshark_find_record_by_time(uint64_t time,
 	return h;
 }
 
+/**
+ * @brief Binary search inside a sorted array of timestamps.
+ *
+ * @param time: The value of time to search for.
+ * @param ts: Input location for the timestamps (see kshark_entry_columns).
+ * @param l: Array index specifying the lower edge of the range to search in.
+ * @param h: Array index specifying the upper edge of the range to search in.
+ *
+ * @returns On success, the index of the first timestamp inside the range,
+	    which is equal or bigger than "time".
+	    If all timestamps inside the range are greater than "time" the
+	    function returns BSEARCH_ALL_GREATER (negative value).
+	    If all timestamps inside the range are smaller than "time" the
+	    function returns BSEARCH_ALL_SMALLER (negative value).
+ */
+ssize_t kshark_find_ts_by_time(uint64_t time, const uint64_t *ts,
+			       size_t l, size_t h)
+{
+	size_t mid;
+
+	if (ts[l] > time)
+		return BSEARCH_ALL_GREATER;
+
+	if (ts[h] < time)
+		return BSEARCH_ALL_SMALLER;
+
+	BSEARCH(h, l, ts[mid] < time);
+	return h;
+}
+
+/**
+ * @brief Create a columnar copy of an array of kshark_entries. The copy is
+ *	  an opt-in acceleration structure. It is allocated in addition to
+ *	  the entries (28 bytes per entry) and the entries are still needed.
+ *
+ * @param data: Input location for the trace data.
+ * @param n: The size of the inputted data.
+ *
+ * @returns The columnar copy of the data on success, or NULL on failure.
+ *	    Use kshark_entry_columns_free() to free the outputted object.
+ */
+struct kshark_entry_columns *
+kshark_entry_columns_alloc(struct kshark_entry **data, size_t n)
+{
+	struct kshark_entry_columns *columns;
+	size_t i;
+
+	columns = calloc(1, sizeof(*columns));
+	if (!columns)
+		goto fail;
+
+	columns->size = n;
+	columns->ts = malloc(n * sizeof(*columns->ts));
+	columns->offset = malloc(n * sizeof(*columns->offset));
+	columns->pid = malloc(n * sizeof(*columns->pid));
+	columns->event_id = malloc(n * sizeof(*columns->event_id));
+	columns->cpu = malloc(n * sizeof(*columns->cpu));
+	columns->visible = malloc(n * sizeof(*columns->visible));
+	columns->stream_id = malloc(n * sizeof(*columns->stream_id));
+
+	if (n && (!columns->ts ||
+		  !columns->offset ||
+		  !columns->pid ||
+		  !columns->event_id ||
+		  !columns->cpu ||
+		  !columns->visible ||
+		  !columns->stream_id)) {
+		goto fail;
+	}
+
+	for (i = 0; i < n; ++i) {
+		columns->ts[i] = data[i]->ts;
+		columns->offset[i] = data[i]->offset;
+		columns->pid[i] = data[i]->pid;
+		columns->event_id[i] = data[i]->event_id;
+		columns->cpu[i] = data[i]->cpu;
+		columns->visible[i] = data[i]->visible;
+		columns->stream_id[i] = data[i]->stream_id;
+	}
+
+	return columns;
+
+ fail:
+	fprintf(stderr, "Failed to allocate memory for entry columns.\n");
+	kshark_entry_columns_free(columns);
+	return NULL;
+}
+
+/**
+ * @brief Copy the "visible" fields of the entries into the columnar copy of
+ *	  the data. Call this after the entries have been filtered.
+ *
+ * @param columns: Input location for the columnar copy of the data.
+ * @param data: Input location for the trace data used to create the copy.
+ */
+void kshark_entry_columns_update_visible(struct kshark_entry_columns *columns,
+					 struct kshark_entry **data)
+{
+	size_t i;
+
+	for (i = 0; i < columns->size; ++i)
+		columns->visible[i] = data[i]->visible;
+}
+
+/**
+ * @brief Get the content of an entry from the columnar copy of the data.
+ *
+ * @param columns: Input location for the columnar copy of the data.
+ * @param i: The index of the entry.
+ * @param entry: Output location for the entry. The "next" field of the
+ *		 entry is set to NULL.
+ */
+void kshark_entry_columns_get(const struct kshark_entry_columns *columns,
+			      size_t i, struct kshark_entry *entry)
+{
+	entry->next = NULL;
+	entry->ts = columns->ts[i];
+	entry->offset = columns->offset[i];
+	entry->pid = columns->pid[i];
+	entry->event_id = columns->event_id[i];
+	entry->cpu = columns->cpu[i];
+	entry->visible = columns->visible[i];
+	entry->stream_id = columns->stream_id[i];
+}
+
+/**
+ * @brief Free the columnar copy of the data.
+ *
+ * @param columns: Input location for the columnar copy of the data.
+ */
+void kshark_entry_columns_free(struct kshark_entry_columns *columns)
+{
+	if (!columns)
+		return;
+
+	free(columns->ts);
+	free(columns->offset);
+	free(columns->pid);
+	free(columns->event_id);
+	free(columns->cpu);
+	free(columns->visible);
+	free(columns->stream_id);
+	free(columns);
+}
+
 /**
  * @brief Simple Pid matching function to be user for data requests.
  *
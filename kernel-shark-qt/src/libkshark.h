@@ -86,6 +86,8 @@ struct kshark_task_list {
 	int			 pid;
 };
 
+struct kshark_entry_block;
+
 /** tructure representing a stream of trace data. */
 struct kshark_data_stream {
 	/** Input handle for the trace data file. */
@@ -94,6 +96,9 @@ struct kshark_data_stream {
 	/** Page event used to parse the page. */
 	struct tep_handle	*pevent;
 
+	/** The name of the trace data file. */
+	char			*file;
+
 	/** Hash table of task PIDs. */
 	struct kshark_task_list	**tasks;
 
@@ -124,6 +129,12 @@ struct kshark_data_stream {
 	 * the event.
 	 */
 	struct tep_event_filter		*advanced_event_filter;
+
+	/**
+	 * List of the memory blocks holding the entries, loaded by
+	 * kshark_load_data_entries().
+	 */
+	struct kshark_entry_block	*entry_blocks;
 };
 
 /** Hard-coded maximum number of data stream. */
@@ -145,6 +156,13 @@ struct kshark_context {
 
 	/** List of Plugin Event handlers. */
 	struct kshark_event_handler	*event_handlers;
+
+	/**
+	 * The number of threads used to load the trace data. Each CPU is
+	 * loaded by a single thread. If zero (default), the number of the
+	 * online processors is used.
+	 */
+	int				n_load_threads;
 };
 
 bool kshark_instance(struct kshark_context **kshark_ctx);
@@ -163,6 +181,20 @@ ssize_t kshark_load_data_entries(struct kshark_context *kshark_ctx, int sd,
 ssize_t kshark_load_data_records(struct kshark_context *kshark_ctx, int sd,
 				 struct tep_record ***data_rows);
 
+ssize_t kshark_load_data_entries_range(struct kshark_context *kshark_ctx,
+				       int sd, uint64_t min, uint64_t max,
+				       uint64_t step,
+				       struct kshark_entry_block **blocks,
+				       struct kshark_entry ***data_rows);
+
+ssize_t kshark_load_data_entries_cached(struct kshark_context *kshark_ctx,
+					int sd,
+					struct kshark_entry ***data_rows);
+
+void kshark_free_data_entries(struct kshark_context *kshark_ctx, int sd);
+
+void kshark_free_entry_blocks(struct kshark_entry_block *blocks);
+
 ssize_t kshark_get_task_pids(struct kshark_context *kshark_ctx, int sd,
 			     int **pids);
 
@@ -298,6 +330,54 @@ ssize_t kshark_find_record_by_time(uint64_t time,
 				   struct tep_record **data_rows,
 				   size_t l, size_t h);
 
+/**
+ * Optional columnar (structure of arrays) copy of a time-sorted array of
+ * kshark_entries. Each field of the entries is stored in a separate array,
+ * hence the algorithms using only few of the fields (the timestamps for
+ * example) touch much less memory. The copy does not replace the entries,
+ * it costs 28 more bytes per entry. It is not updated when the entries
+ * change, call kshark_entry_columns_update_visible() after filtering.
+ */
+struct kshark_entry_columns {
+	/** The number of entries. */
+	size_t		size;
+
+	/** The timestamps of the entries. */
+	uint64_t	*ts;
+
+	/** The offsets into the trace file. */
+	uint64_t	*offset;
+
+	/** The PIDs of the tasks. */
+	int32_t		*pid;
+
+	/** The Ids of the trace event types. */
+	int32_t		*event_id;
+
+	/** The CPU cores of the records. */
+	int16_t		*cpu;
+
+	/** The visibility bit masks of the entries. */
+	uint8_t		*visible;
+
+	/** The data stream identifiers. */
+	uint8_t		*stream_id;
+};
+
+struct kshark_entry_columns *
+kshark_entry_columns_alloc(struct kshark_entry **data, size_t n);
+
+void kshark_entry_columns_update_visible(struct kshark_entry_columns *columns,
+					 struct kshark_entry **data);
+
+void kshark_entry_columns_get(const struct kshark_entry_columns *columns,
+			      size_t i, struct kshark_entry *entry);
+
+void kshark_entry_columns_free(struct kshark_entry_columns *columns);
+
+ssize_t kshark_find_ts_by_time(uint64_t time, const uint64_t *ts,
+			       size_t l, size_t h);
+
 bool kshark_match_pid(struct kshark_context *kshark_ctx,
 		      struct kshark_entry *e, int sd, int pid);
 
@@ -0,0 +1,222 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Compression of the trace data, for the "flycompr" section of trace.dat.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "trace-cmd.h"
+
+struct compress_codec {
+	const char	*name;
+	int		default_level;
+	int		min_level;
+	int		max_level;
+	size_t		(*bound)(size_t size);
+	long		(*compress)(int level, void *out, size_t out_size,
+				    const void *in, size_t in_size);
+	long		(*uncompress)(void *out, size_t out_size,
+				      const void *in, size_t in_size);
+};
+
+struct tracecmd_compression {
+	const struct compress_codec	*codec;
+	int				level;
+};
+
+#ifdef HAVE_ZLIB
+static size_t zlib_bound(size_t size)
+{
+	return compressBound(size);
+}
+
+static long zlib_compress(int level, void *out, size_t out_size,
+			  const void *in, size_t in_size)
+{
+	uLongf size = out_size;
+
+	if (compress2(out, &size, in, in_size, level) != Z_OK)
+		return -1;
+
+	return size;
+}
+
+static long zlib_uncompress(void *out, size_t out_size,
+			    const void *in, size_t in_size)
+{
+	uLongf size = out_size;
+
+	if (uncompress(out, &size, in, in_size) != Z_OK)
+		return -1;
+
+	return size;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static size_t zstd_bound(size_t size)
+{
+	return ZSTD_compressBound(size);
+}
+
+static long zstd_compress(int level, void *out, size_t out_size,
+			  const void *in, size_t in_size)
+{
+	size_t size;
+
+	size = ZSTD_compress(out, out_size, in, in_size, level);
+	if (ZSTD_isError(size))
+		return -1;
+
+	return size;
+}
+
+static long zstd_uncompress(void *out, size_t out_size,
+			    const void *in, size_t in_size)
+{
+	size_t size;
+
+	size = ZSTD_decompress(out, out_size, in, in_size);
+	if (ZSTD_isError(size))
+		return -1;
+
+	return size;
+}
+#endif
+
+static const struct compress_codec codecs[] = {
+#ifdef HAVE_ZSTD
+	{ "zstd", 3, 1, 19, zstd_bound, zstd_compress, zstd_uncompress },
+#endif
+#ifdef HAVE_ZLIB
+	{ "zlib", 1, 1, 9, zlib_bound, zlib_compress, zlib_uncompress },
+#endif
+	{ NULL }
+};
+
+/**
+ * tracecmd_compress_alloc - get a compression codec
+ * @spec: "name" or "name:level", NULL or "" for the default codec
+ *
+ * The default codec is the fastest one that this library is built
+ * with (zstd, then zlib).
+ *
+ * Returns the compression handle, that must be freed with
+ * tracecmd_compress_free(), or NULL if the codec is not supported.
+ */
+struct tracecmd_compression *tracecmd_compress_alloc(const char *spec)
+{
+	const struct compress_codec *codec = NULL;
+	struct tracecmd_compression *compress;
+	const char *level = NULL;
+	size_t len = 0;
+	int i;
+
+	if (spec) {
+		level = strchr(spec, ':');
+		len = level ? level - spec : strlen(spec);
+		if (level)
+			level++;
+	}
+
+	for (i = 0; codecs[i].name; i++) {
+		if (!len || (strlen(codecs[i].name) == len &&
+			     strncmp(codecs[i].name, spec, len) == 0)) {
+			codec = &codecs[i];
+			break;
+		}
+	}
+
+	if (!codec) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+
+	compress = malloc(sizeof(*compress));
+	if (!compress)
+		return NULL;
+
+	compress->codec = codec;
+	compress->level = codec->default_level;
+
+	if (level && *level) {
+		compress->level = atoi(level);
+		if (compress->level < codec->min_level)
+			compress->level = codec->min_level;
+		if (compress->level > codec->max_level)
+			compress->level = codec->max_level;
+	}
+
+	return compress;
+}
+
+void tracecmd_compress_free(struct tracecmd_compression *compress)
+{
+	free(compress);
+}
+
+/**
+ * tracecmd_compress_name - the name of the codec, as saved in trace.dat
+ * @compress: the compression handle
+ */
+const char *tracecmd_compress_name(struct tracecmd_compression *compress)
+{
+	return compress->codec->name;
+}
+
+/**
+ * tracecmd_compress_bound - the largest size of compressed data
+ * @compress: the compression handle
+ * @size: the size of the data to compress
+ */
+size_t tracecmd_compress_bound(struct tracecmd_compression *compress,
+			       size_t size)
+{
+	return compress->codec->bound(size);
+}
+
+/**
+ * tracecmd_compress - compress a block of data
+ * @compress: the compression handle
+ * @out: where to write the compressed data
+ * @out_size: the size of @out (see tracecmd_compress_bound())
+ * @in: the data to compress
+ * @in_size: the size of @in
+ *
+ * Returns the size of the compressed data, or -1 on error.
+ */
+long tracecmd_compress(struct tracecmd_compression *compress,
+		       void *out, size_t out_size,
+		       const void *in, size_t in_size)
+{
+	return compress->codec->compress(compress->level, out, out_size,
+					 in, in_size);
+}
+
+/**
+ * tracecmd_uncompress - uncompress a block of data
+ * @compress: the compression handle
+ * @out: where to write the data
+ * @out_size: the size of the data
+ * @in: the compressed data
+ * @in_size: the size of @in
+ *
+ * This can be called by several threads at the same time.
+ *
+ * Returns the size of the data, or -1 on error.
+ */
+long tracecmd_uncompress(struct tracecmd_compression *compress,
+			 void *out, size_t out_size,
+			 const void *in, size_t in_size)
+{
+	return compress->codec->uncompress(out, out_size, in, in_size);
+}
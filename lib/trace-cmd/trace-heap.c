@@ -0,0 +1,143 @@
+// SPDX-License-Identifier: LGPL-2.1
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "trace-heap.h"
+
+int tracecmd_heap_init(struct tracecmd_heap *heap, int size)
+{
+	int i;
+
+	memset(heap, 0, sizeof(*heap));
+
+	heap->heap = malloc(sizeof(*heap->heap) * size);
+	heap->pos = malloc(sizeof(*heap->pos) * size);
+	if (!heap->heap || !heap->pos) {
+		tracecmd_heap_free(heap);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < size; i++)
+		heap->pos[i] = -1;
+
+	heap->size = size;
+
+	return 0;
+}
+
+void tracecmd_heap_free(struct tracecmd_heap *heap)
+{
+	free(heap->heap);
+	free(heap->pos);
+	memset(heap, 0, sizeof(*heap));
+}
+
+/* Items with equal keys are ordered by their ids */
+static inline int heap_less(struct tracecmd_heap_item *a,
+			    struct tracecmd_heap_item *b)
+{
+	if (a->key != b->key)
+		return a->key < b->key;
+	return a->id < b->id;
+}
+
+static inline void heap_set(struct tracecmd_heap *heap, int i,
+			    struct tracecmd_heap_item *item)
+{
+	heap->heap[i] = *item;
+	heap->pos[item->id] = i;
+}
+
+static void sift_up(struct tracecmd_heap *heap, int i)
+{
+	struct tracecmd_heap_item item = heap->heap[i];
+	int parent;
+
+	while (i) {
+		parent = (i - 1) / 2;
+		if (!heap_less(&item, &heap->heap[parent]))
+			break;
+		heap_set(heap, i, &heap->heap[parent]);
+		i = parent;
+	}
+	heap_set(heap, i, &item);
+}
+
+static void sift_down(struct tracecmd_heap *heap, int i)
+{
+	struct tracecmd_heap_item item = heap->heap[i];
+	int child;
+
+	for (;;) {
+		child = i * 2 + 1;
+		if (child >= heap->nr_items)
+			break;
+		if (child + 1 < heap->nr_items &&
+		    heap_less(&heap->heap[child + 1], &heap->heap[child]))
+			child++;
+		if (!heap_less(&heap->heap[child], &item))
+			break;
+		heap_set(heap, i, &heap->heap[child]);
+		i = child;
+	}
+	heap_set(heap, i, &item);
+}
+
+/**
+ * tracecmd_heap_update - add an item or change the key of an item
+ * @heap: the heap to modify
+ * @id: the id of the item (0 <= id < size)
+ * @key: the new key of the item
+ *
+ * Costs O(log n), where n is the number of items in the heap.
+ */
+void tracecmd_heap_update(struct tracecmd_heap *heap, int id,
+			  unsigned long long key)
+{
+	unsigned long long old_key;
+	int i = heap->pos[id];
+
+	if (i < 0) {
+		i = heap->nr_items++;
+		heap->heap[i].key = key;
+		heap->heap[i].id = id;
+		heap->pos[id] = i;
+		sift_up(heap, i);
+		return;
+	}
+
+	old_key = heap->heap[i].key;
+	heap->heap[i].key = key;
+	if (key < old_key)
+		sift_up(heap, i);
+	else if (key > old_key)
+		sift_down(heap, i);
+}
+
+/**
+ * tracecmd_heap_remove - remove an item from the heap
+ * @heap: the heap to modify
+ * @id: the id of the item to remove
+ *
+ * Does nothing if the item is not in the heap.
+ */
+void tracecmd_heap_remove(struct tracecmd_heap *heap, int id)
+{
+	struct tracecmd_heap_item *last;
+	int moved;
+	int i = heap->pos[id];
+
+	if (i < 0)
+		return;
+
+	heap->pos[id] = -1;
+	last = &heap->heap[--heap->nr_items];
+	if (last->id == id)
+		return;
+
+	moved = last->id;
+	heap_set(heap, i, last);
+	sift_up(heap, i);
+	sift_down(heap, heap->pos[moved]);
+}
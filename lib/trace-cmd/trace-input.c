@@ -6,6 +6,7 @@
 #define _LARGEFILE64_SOURCE
 #include <dirent.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,6 +27,7 @@
 
 #include "trace-cmd-local.h"
 #include "trace-local.h"
+#include "trace-heap.h"
 #include "kbuffer.h"
 #include "list.h"
 
@@ -45,6 +47,8 @@ struct page_map {
 	off64_t			size;
 	void			*map;
 	int			ref_count;
+	/* an uncompressed chunk, not a mapping of the file */
+	bool			chunk;
 };
 
 struct page {
@@ -74,9 +78,28 @@ struct cpu_data {
 	struct tep_record	*next;
 	struct page		*page;
 	struct kbuffer		*kbuf;
+	/* timestamps of the pages, read on demand (see find_page_index) */
+	unsigned long long	*page_ts;
+	int			nr_pages;
+	/*
+	 * The data of a compressed file is split into chunks, that are
+	 * uncompressed on demand. The file_offset of the CPU is then a
+	 * virtual offset of the uncompressed data, and chunks[] holds the
+	 * offsets in the file of the chunks (and the end of the last one).
+	 */
+	off64_t			*chunks;
+	unsigned int		nr_chunks;
+	unsigned int		chunk_size;
+	/* decoded events of a page (see tracecmd_read_page_records) */
+	struct kbuffer_event	*events;
+	int			nr_events;
 	int			page_cnt;
 	int			cpu;
 	int			pipe_fd;
+	/* the next record may have changed since added to next_heap */
+	bool			next_dirty;
+	/* ignored by tracecmd_peek_next_data() */
+	bool			skip_next;
 };
 
 struct input_buffer_instance {
@@ -105,9 +128,16 @@ struct tracecmd_input {
 	char *			cpustats;
 	char *			uname;
 	struct input_buffer_instance	*buffers;
+	struct tracecmd_compression	*compress;
 
 	struct tracecmd_ftrace	finfo;
 
+	/* CPUs ordered by the timestamp of their next record */
+	struct tracecmd_heap	next_heap;
+	/* CPUs whose position in next_heap needs to be updated */
+	int			*dirty_cpus;
+	int			nr_dirty;
+
 	struct hook_list	*hooks;
 	/* file information */
 	size_t			header_files_start;
@@ -188,6 +218,35 @@ static const char *show_records(struct page **pages)
 
 static int init_cpu(struct tracecmd_input *handle, int cpu);
 
+/*
+ * Called every time the next record of a CPU may have changed, to have
+ * the CPU's position in the next_heap updated by tracecmd_peek_next_data().
+ *
+ * The calls that work on a single CPU (tracecmd_read_data(),
+ * tracecmd_peek_data(), tracecmd_read_page_records(), ...) may run in
+ * parallel threads, as long as each CPU is read by a single thread.
+ * Thus next_dirty is only touched for the CPU of the caller, and each
+ * CPU takes its own slot of dirty_cpus. The calls that work on all the
+ * CPUs (tracecmd_peek_next_data() and friends) must not run while any
+ * other thread reads the handle.
+ */
+static void mark_next_dirty(struct tracecmd_input *handle, int cpu)
+{
+	struct cpu_data *cpu_data;
+	int slot;
+
+	if (!handle->dirty_cpus)
+		return;
+
+	cpu_data = &handle->cpu_data[cpu];
+	if (cpu_data->next_dirty)
+		return;
+
+	cpu_data->next_dirty = true;
+	slot = __atomic_fetch_add(&handle->nr_dirty, 1, __ATOMIC_RELAXED);
+	handle->dirty_cpus[slot] = cpu;
+}
+
 static ssize_t do_read(struct tracecmd_input *handle, void *data, size_t size)
 {
 	ssize_t tot = 0;
@@ -762,7 +821,6 @@ static unsigned long long calc_page_offset(struct tracecmd_input *handle,
 static int read_page(struct tracecmd_input *handle, off64_t offset,
 		     int cpu, void *map)
 {
-	off64_t save_seek;
 	off64_t ret;
 
 	if (handle->use_pipe) {
@@ -780,19 +838,14 @@ static int read_page(struct tracecmd_input *handle, off64_t offset,
 		return 0;
 	}
 
-	/* other parts of the code may expect the pointer to not move */
-	save_seek = lseek64(handle->fd, 0, SEEK_CUR);
-
-	ret = lseek64(handle->fd, offset, SEEK_SET);
-	if (ret < 0)
-		return -1;
-	ret = read(handle->fd, map, handle->page_size);
+	/*
+	 * Other parts of the code may expect the pointer to not move.
+	 * Use pread, so that pages of different CPUs can be read in parallel.
+	 */
+	ret = pread64(handle->fd, map, handle->page_size, offset);
 	if (ret < 0)
 		return -1;
 
-	/* reset the file pointer back */
-	lseek64(handle->fd, save_seek, SEEK_SET);
-
 	return 0;
 }
 
@@ -817,11 +870,91 @@ static void free_page_map(struct page_map *page_map)
 	if (page_map->ref_count)
 		return;
 
-	munmap(page_map->map, page_map->size);
+	if (page_map->chunk)
+		free(page_map->map);
+	else
+		munmap(page_map->map, page_map->size);
 	list_del(&page_map->list);
 	free(page_map);
 }
 
+/*
+ * Get the uncompressed chunk of a compressed file that holds @offset.
+ * The chunks in use are kept in the page_maps of the CPU, like the
+ * mappings of an uncompressed file.
+ */
+static struct page_map *get_chunk_map(struct tracecmd_input *handle,
+				      int cpu, off64_t offset)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	struct page_map *page_map;
+	unsigned int chunk;
+	off64_t map_offset;
+	off64_t map_size;
+	off64_t csize;
+	void *buf;
+	long r;
+
+	chunk = (offset - cpu_data->file_offset) / cpu_data->chunk_size;
+	if (chunk >= cpu_data->nr_chunks)
+		return NULL;
+
+	map_offset = cpu_data->file_offset + (off64_t)chunk * cpu_data->chunk_size;
+
+	page_map = cpu_data->page_map;
+	if (page_map && page_map->offset == map_offset)
+		return page_map;
+
+	list_for_each_entry(page_map, &cpu_data->page_maps, list) {
+		if (page_map->offset == map_offset)
+			return page_map;
+	}
+
+	map_size = cpu_data->chunk_size;
+	if (map_offset + map_size > cpu_data->file_offset + cpu_data->file_size)
+		map_size = cpu_data->file_offset + cpu_data->file_size - map_offset;
+
+	csize = cpu_data->chunks[chunk + 1] - cpu_data->chunks[chunk];
+	buf = malloc(csize);
+	if (!buf)
+		return NULL;
+
+	page_map = calloc(1, sizeof(*page_map));
+	if (!page_map)
+		goto fail;
+
+	page_map->map = malloc(map_size);
+	if (!page_map->map)
+		goto fail;
+
+	if (pread64(handle->fd, buf, csize, cpu_data->chunks[chunk]) != csize)
+		goto fail;
+
+	r = tracecmd_uncompress(handle->compress, page_map->map, map_size,
+				buf, csize);
+	if (r != map_size) {
+		warning("cpu %d: corrupted compressed data at %lld",
+			cpu, (long long)cpu_data->chunks[chunk]);
+		errno = EINVAL;
+		goto fail;
+	}
+	free(buf);
+
+	page_map->offset = map_offset;
+	page_map->size = map_size;
+	page_map->chunk = true;
+	list_add(&page_map->list, &cpu_data->page_maps);
+
+	return page_map;
+
+ fail:
+	if (page_map)
+		free(page_map->map);
+	free(page_map);
+	free(buf);
+	return NULL;
+}
+
 static void *allocate_page_map(struct tracecmd_input *handle,
 			       struct page *page, int cpu, off64_t offset)
 {
@@ -844,6 +977,13 @@ static void *allocate_page_map(struct tracecmd_input *handle,
 		return map;
 	}
 
+	if (cpu_data->chunks) {
+		page_map = get_chunk_map(handle, cpu, offset);
+		if (!page_map)
+			return NULL;
+		goto out;
+	}
+
 	map_size = handle->page_map_size;
 	map_offset = offset & ~(map_size - 1);
 
@@ -974,6 +1114,7 @@ static void free_page(struct tracecmd_input *handle, int cpu)
 	    !handle->cpu_data[cpu].page)
 		return;
 
+	mark_next_dirty(handle, cpu);
 	__free_page(handle, handle->cpu_data[cpu].page);
 
 	handle->cpu_data[cpu].page = NULL;
@@ -1031,6 +1172,7 @@ static void free_next(struct tracecmd_input *handle, int cpu)
 	if (!record)
 		return;
 
+	mark_next_dirty(handle, cpu);
 	handle->cpu_data[cpu].next = NULL;
 
 	record->locked = 0;
@@ -1052,6 +1194,8 @@ static int update_page_info(struct tracecmd_input *handle, int cpu)
 		return -1;
 	}
 
+	mark_next_dirty(handle, cpu);
+
 	kbuffer_load_subbuffer(kbuf, ptr);
 	if (kbuffer_subbuffer_size(kbuf) > handle->page_size) {
 		warning("bad page read, with size of %d",
@@ -1295,6 +1439,7 @@ int tracecmd_refresh_record(struct tracecmd_input *handle,
 
 	record->data = kbuffer_read_at_offset(cpu_data->kbuf, index, &record->ts);
 	cpu_data->timestamp = record->ts;
+	mark_next_dirty(handle, cpu);
 
 	return 0;
 }
@@ -1380,6 +1525,121 @@ tracecmd_read_cpu_last(struct tracecmd_input *handle, int cpu)
 	return record;
 }
 
+/* Marks the pages of the timestamp index which are not read yet */
+#define PAGE_TS_UNKNOWN		(~0ULL)
+
+static int init_page_index(struct tracecmd_input *handle, int cpu)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	int i;
+
+	if (cpu_data->page_ts)
+		return 0;
+
+	cpu_data->nr_pages = (cpu_data->file_size + handle->page_size - 1) /
+				handle->page_size;
+	if (!cpu_data->nr_pages)
+		return -1;
+
+	cpu_data->page_ts = malloc(sizeof(*cpu_data->page_ts) *
+				   cpu_data->nr_pages);
+	if (!cpu_data->page_ts)
+		return -1;
+
+	for (i = 0; i < cpu_data->nr_pages; i++)
+		cpu_data->page_ts[i] = PAGE_TS_UNKNOWN;
+
+	return 0;
+}
+
+/*
+ * The pages of a compressed file can only be read by uncompressing
+ * their chunk, thus the timestamps of all the pages of the chunk are
+ * saved at once.
+ */
+static int read_chunk_page_ts(struct tracecmd_input *handle, int cpu,
+			      int index)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	struct page_map *page_map;
+	off64_t offset;
+	int i;
+
+	offset = cpu_data->file_offset + (off64_t)index * handle->page_size;
+	page_map = get_chunk_map(handle, cpu, offset);
+	if (!page_map)
+		return -1;
+
+	i = (page_map->offset - cpu_data->file_offset) / handle->page_size;
+	for (offset = 0; offset < page_map->size; offset += handle->page_size, i++)
+		cpu_data->page_ts[i] = tep_read_number(handle->pevent,
+						       page_map->map + offset, 8);
+
+	/* Not used by a page, nor the current map of the CPU */
+	if (!page_map->ref_count) {
+		page_map->ref_count = 1;
+		free_page_map(page_map);
+	}
+
+	return 0;
+}
+
+/*
+ * Get the timestamp of a page, the same way update_page_info() does.
+ * Only the header of the page is read, the page is not mapped.
+ */
+static int get_page_index_ts(struct tracecmd_input *handle, int cpu,
+			     int index, unsigned long long *ts)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	char buf[8];
+
+	if (cpu_data->page_ts[index] == PAGE_TS_UNKNOWN && cpu_data->chunks) {
+		if (read_chunk_page_ts(handle, cpu, index) < 0)
+			return -1;
+	} else if (cpu_data->page_ts[index] == PAGE_TS_UNKNOWN) {
+		if (pread64(handle->fd, buf, 8, cpu_data->file_offset +
+			    (off64_t)index * handle->page_size) != 8)
+			return -1;
+		cpu_data->page_ts[index] = tep_read_number(handle->pevent,
+							   buf, 8);
+	}
+
+	*ts = cpu_data->page_ts[index] + handle->ts_offset;
+	if (handle->ts2secs)
+		*ts *= handle->ts2secs;
+
+	return 0;
+}
+
+/*
+ * Find the last page of the CPU that starts before @ts, or the first
+ * page if there is none. The timestamps of the pages are kept, thus
+ * repeated searches in the same file do not need to read it again.
+ */
+static int find_page_index(struct tracecmd_input *handle, int cpu,
+			   unsigned long long ts)
+{
+	unsigned long long page_ts;
+	int start = 0;
+	int end = handle->cpu_data[cpu].nr_pages;
+	int mid;
+
+	/* The answer is in [start, end) */
+	while (end - start > 1) {
+		mid = start + (end - start) / 2;
+		if (get_page_index_ts(handle, cpu, mid, &page_ts) < 0)
+			return -1;
+
+		if (page_ts < ts)
+			start = mid;
+		else
+			end = mid;
+	}
+
+	return start;
+}
+
 /**
  * tracecmd_set_cpu_to_timestamp - set the CPU iterator to a given time
  * @handle: input handle for the trace.dat file
@@ -1401,6 +1661,8 @@ tracecmd_set_cpu_to_timestamp(struct tracecmd_input *handle, int cpu,
 {
 	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
 	off64_t start, end, next;
+	int index;
+	int ret;
 
 	if (cpu < 0 || cpu >= handle->cpus) {
 		errno = -EINVAL;
@@ -1427,6 +1689,21 @@ tracecmd_set_cpu_to_timestamp(struct tracecmd_input *handle, int cpu,
 		return 0;
 	}
 
+	/* Look up the page in the timestamp index of the CPU */
+	if (!handle->use_pipe && !init_page_index(handle, cpu) &&
+	    (index = find_page_index(handle, cpu, ts)) >= 0) {
+		ret = get_page(handle, cpu, cpu_data->file_offset +
+			       (off64_t)index * handle->page_size);
+		if (ret < 0)
+			return -1;
+
+		/* If the page was already mapped, we need to reset it */
+		if (ret)
+			update_page_info(handle, cpu);
+
+		return 0;
+	}
+
 	/* Set to the first record on current page */
 	update_page_info(handle, cpu);
 
@@ -1503,6 +1780,48 @@ tracecmd_set_all_cpus_to_timestamp(struct tracecmd_input *handle,
 		tracecmd_set_cpu_to_timestamp(handle, cpu, time);
 }
 
+/**
+ * tracecmd_cpu_pages_in_range - count the pages of a CPU in a time range
+ * @handle: input handle for the trace.dat file
+ * @cpu: the CPU to look at
+ * @start: the start of the time range
+ * @end: the end of the time range
+ *
+ * Returns the number of pages of @cpu, which may hold records with
+ * timestamps between @start and @end. Only the timestamps of the pages
+ * are used (see tracecmd_set_cpu_to_timestamp), hence this is a cheap
+ * way to estimate the amount of data in a time range, without reading it.
+ *
+ * Returns -1 on error.
+ */
+int tracecmd_cpu_pages_in_range(struct tracecmd_input *handle, int cpu,
+				unsigned long long start,
+				unsigned long long end)
+{
+	int first, last;
+
+	if (cpu < 0 || cpu >= handle->cpus || handle->use_pipe) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!handle->cpu_data[cpu].file_size)
+		return 0;
+
+	if (init_page_index(handle, cpu))
+		return -1;
+
+	first = find_page_index(handle, cpu, start);
+	if (end == ~0ULL)
+		last = handle->cpu_data[cpu].nr_pages - 1;
+	else
+		last = find_page_index(handle, cpu, end + 1);
+	if (first < 0 || last < 0)
+		return -1;
+
+	return last - first + 1;
+}
+
 /**
  * tracecmd_set_cursor - set the offset for the next tracecmd_read_data
  * @handle: input handle for the trace.dat file
@@ -1834,6 +2153,7 @@ tracecmd_read_data(struct tracecmd_input *handle, int cpu)
 	record = tracecmd_peek_data(handle, cpu);
 	handle->cpu_data[cpu].next = NULL;
 	if (record) {
+		mark_next_dirty(handle, cpu);
 		record->locked = 0;
 #if DEBUG_RECORD
 		record->alloc_addr = (unsigned long)__builtin_return_address(0);
@@ -1842,6 +2162,149 @@ tracecmd_read_data(struct tracecmd_input *handle, int cpu)
 	return record;
 }
 
+static void put_page_records(struct tracecmd_page_records *recs)
+{
+	struct page *page = recs->page;
+
+	if (page)
+		__free_page(page->handle, page);
+
+	recs->page = NULL;
+	recs->nr_records = 0;
+}
+
+/**
+ * tracecmd_read_page_records - read the rest of the page of a CPU at once
+ * @handle: input handle for the trace.dat file
+ * @cpu: the CPU to pull from
+ * @recs: the records of the page
+ *
+ * This returns all records from the current location of the CPU iterator
+ * to the end of its page, and moves the iterator to the next page. The
+ * records are stored in an array, which is reused by the next calls,
+ * hence no memory is allocated per record. The page is held (once) until
+ * the next call or until tracecmd_free_page_records() is called.
+ *
+ * Returns the number of records read, 0 if there are no more records on
+ * the CPU, or -1 on error.
+ */
+int tracecmd_read_page_records(struct tracecmd_input *handle, int cpu,
+			       struct tracecmd_page_records *recs)
+{
+	struct tep_record *record, *next = NULL;
+	struct cpu_data *cpu_data;
+	struct kbuffer_event *ev;
+	struct kbuffer *kbuf;
+	struct page *page;
+	int i, n, max;
+
+	put_page_records(recs);
+
+	if (cpu < 0 || cpu >= handle->cpus)
+		return -1;
+
+	cpu_data = &handle->cpu_data[cpu];
+	kbuf = cpu_data->kbuf;
+
+	/*
+	 * A record which is peeked already is the first one. It is not
+	 * valid if the timestamp changed (see tracecmd_peek_data()).
+	 */
+	if (cpu_data->next && cpu_data->next->ts == cpu_data->timestamp)
+		next = cpu_data->next;
+	else
+		free_next(handle, cpu);
+
+	page = cpu_data->page;
+	if (!page && handle->use_pipe) {
+		get_next_page(handle, cpu);
+		page = cpu_data->page;
+	}
+
+	while (page && !next && !kbuffer_read_event(kbuf, NULL)) {
+		if (get_next_page(handle, cpu))
+			return 0;
+		page = cpu_data->page;
+	}
+
+	if (!page)
+		return 0;
+
+	max = kbuffer_max_events(kbuf);
+	if (cpu_data->nr_events < max) {
+		ev = realloc(cpu_data->events, max * sizeof(*ev));
+		if (!ev)
+			return -1;
+		cpu_data->events = ev;
+		cpu_data->nr_events = max;
+	}
+
+	if (recs->size < max + 1) {
+		record = realloc(recs->records, (max + 1) * sizeof(*record));
+		if (!record)
+			return -1;
+		recs->records = record;
+		recs->size = max + 1;
+	}
+
+	n = kbuffer_decode_events(kbuf, cpu_data->events, max);
+
+	record = recs->records;
+	if (next) {
+		*record = *next;
+		record->ref_count = 1;
+		record->locked = 1;
+		record++;
+	}
+
+	for (i = 0; i < n; i++, record++) {
+		ev = &cpu_data->events[i];
+
+		memset(record, 0, sizeof(*record));
+		record->ts = ev->ts + handle->ts_offset;
+		if (handle->ts2secs)
+			record->ts *= handle->ts2secs;
+
+		record->offset = cpu_data->offset + ev->offset;
+		record->size = ev->size;
+		record->record_size = ev->record_size;
+		record->data = page->map + ev->index;
+		record->cpu = cpu;
+		record->priv = page;
+
+		/* The records are owned by the array */
+		record->ref_count = 1;
+		record->locked = 1;
+	}
+
+	/* Only the first event of the page can have missed events */
+	if (n && !next)
+		recs->records[0].missed_events = kbuffer_missed_events(kbuf);
+
+	recs->nr_records = record - recs->records;
+	recs->page = page;
+	page->ref_count++;
+
+	free_next(handle, cpu);
+	get_next_page(handle, cpu);
+
+	return recs->nr_records;
+}
+
+/**
+ * tracecmd_free_page_records - release the records of a page
+ * @recs: the records returned by tracecmd_read_page_records()
+ *
+ * Releases the page and frees the array of records.
+ */
+void tracecmd_free_page_records(struct tracecmd_page_records *recs)
+{
+	put_page_records(recs);
+	free(recs->records);
+	recs->records = NULL;
+	recs->size = 0;
+}
+
 /**
  * tracecmd_read_next_data - read the next record
  * @handle: input handle to the trace.dat file
@@ -1875,32 +2338,20 @@ tracecmd_read_next_data(struct tracecmd_input *handle, int *rec_cpu)
 	return tracecmd_read_data(handle, next_cpu);
 }
 
-/**
- * tracecmd_peek_next_data - return the next record
- * @handle: input handle to the trace.dat file
- * @rec_cpu: return pointer to the CPU that the record belongs to
- *
- * This returns the next record by time. This is different than
- * tracecmd_peek_data in that it looks at all CPUs. It does a peek
- * at each CPU and the record with the earliest time stame is
- * returned. If @rec_cpu is not NULL it gets the CPU id the record was
- * on. It does not increment the CPU iterator.
- */
-struct tep_record *
-tracecmd_peek_next_data(struct tracecmd_input *handle, int *rec_cpu)
+static struct tep_record *
+scan_next_data(struct tracecmd_input *handle, int *rec_cpu)
 {
 	unsigned long long ts;
 	struct tep_record *record, *next_record = NULL;
 	int next_cpu;
 	int cpu;
 
-	if (rec_cpu)
-		*rec_cpu = -1;
-
 	next_cpu = -1;
 	ts = 0;
 
 	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		if (handle->cpu_data[cpu].skip_next)
+			continue;
 		record = tracecmd_peek_data(handle, cpu);
 		if (record && (!next_record || record->ts < ts)) {
 			ts = record->ts;
@@ -1918,6 +2369,119 @@ tracecmd_peek_next_data(struct tracecmd_input *handle, int *rec_cpu)
 	return NULL;
 }
 
+static int init_next_heap(struct tracecmd_input *handle)
+{
+	int cpu;
+
+	if (tracecmd_heap_init(&handle->next_heap, handle->cpus) < 0)
+		return -1;
+
+	handle->dirty_cpus = malloc(sizeof(*handle->dirty_cpus) * handle->cpus);
+	if (!handle->dirty_cpus) {
+		tracecmd_heap_free(&handle->next_heap);
+		return -1;
+	}
+
+	handle->nr_dirty = 0;
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		handle->cpu_data[cpu].next_dirty = false;
+		mark_next_dirty(handle, cpu);
+	}
+
+	return 0;
+}
+
+static void free_next_heap(struct tracecmd_input *handle)
+{
+	tracecmd_heap_free(&handle->next_heap);
+	free(handle->dirty_cpus);
+	handle->dirty_cpus = NULL;
+	handle->nr_dirty = 0;
+}
+
+/**
+ * tracecmd_peek_next_data - return the next record
+ * @handle: input handle to the trace.dat file
+ * @rec_cpu: return pointer to the CPU that the record belongs to
+ *
+ * This returns the next record by time. This is different than
+ * tracecmd_peek_data in that it looks at all CPUs. It does a peek
+ * at each CPU and the record with the earliest time stame is
+ * returned. If @rec_cpu is not NULL it gets the CPU id the record was
+ * on. It does not increment the CPU iterator.
+ *
+ * The CPUs are kept in a heap, ordered by the timestamps of their next
+ * records. Only the CPUs whose iterators moved since the last call
+ * are peeked again, thus the cost is O(log(cpus)) per record.
+ *
+ * This must not be called while other threads read from @handle.
+ */
+struct tep_record *
+tracecmd_peek_next_data(struct tracecmd_input *handle, int *rec_cpu)
+{
+	struct tep_record *record;
+	int cpu;
+
+	if (rec_cpu)
+		*rec_cpu = -1;
+
+	/* Pipes can get new data at any time, they must always be peeked */
+	if (handle->use_pipe ||
+	    (!handle->dirty_cpus && init_next_heap(handle) < 0))
+		return scan_next_data(handle, rec_cpu);
+
+	do {
+		while (handle->nr_dirty) {
+			cpu = handle->dirty_cpus[--handle->nr_dirty];
+			handle->cpu_data[cpu].next_dirty = false;
+
+			record = NULL;
+			if (!handle->cpu_data[cpu].skip_next)
+				record = tracecmd_peek_data(handle, cpu);
+
+			if (record)
+				tracecmd_heap_update(&handle->next_heap, cpu,
+						     record->ts);
+			else
+				tracecmd_heap_remove(&handle->next_heap, cpu);
+		}
+
+		cpu = tracecmd_heap_top(&handle->next_heap);
+		if (cpu < 0)
+			return NULL;
+
+		/* This is cached, unless the CPU changed in the mean time */
+		record = tracecmd_peek_data(handle, cpu);
+	} while (handle->nr_dirty);
+
+	if (rec_cpu)
+		*rec_cpu = cpu;
+
+	return record;
+}
+
+/**
+ * tracecmd_filter_next_cpus - limit the CPUs used by read/peek_next_data
+ * @handle: input handle to the trace.dat file
+ * @cpus: array of CPU ids terminated by -1, or NULL for all CPUs
+ *
+ * After this call, tracecmd_read_next_data() and tracecmd_peek_next_data()
+ * will only return records of the CPUs in @cpus.
+ */
+void tracecmd_filter_next_cpus(struct tracecmd_input *handle, int *cpus)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		handle->cpu_data[cpu].skip_next = !!cpus;
+		mark_next_dirty(handle, cpu);
+	}
+
+	for (; cpus && *cpus >= 0; cpus++)
+		if (*cpus < handle->cpus)
+			handle->cpu_data[*cpus].skip_next = false;
+}
+
 /**
  * tracecmd_read_prev - read the record before the given record
  * @handle: input handle to the trace.dat file
@@ -2202,6 +2766,11 @@ static int handle_options(struct tracecmd_input *handle)
 			cpus = *(int *)buf;
 			handle->cpus = __tep_data2host4(handle->pevent, cpus);
 			break;
+		case TRACECMD_OPTION_COMPRESSION:
+			handle->compress = tracecmd_compress_alloc(buf);
+			if (!handle->compress)
+				warning("unsupported compression '%s'", buf);
+			break;
 		default:
 			warning("unknown option %d", option);
 			break;
@@ -2216,6 +2785,73 @@ static int handle_options(struct tracecmd_input *handle)
 	return 0;
 }
 
+/*
+ * Read the index of the compressed data of a CPU (see the "flycompr"
+ * section written by tracecmd_append_cpu_data()).
+ */
+static int read_chunks(struct tracecmd_input *handle, int cpu,
+		       unsigned long long offset, unsigned long long size)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	unsigned long long *index;
+	unsigned long long data_size;
+	unsigned int chunk_size;
+	unsigned int nr_chunks;
+	char buf[16];
+	size_t nr, i;
+
+	if (size < 16 || pread64(handle->fd, buf, 16, offset) != 16)
+		goto fail;
+
+	data_size = tep_read_number(handle->pevent, buf, 8);
+	chunk_size = tep_read_number(handle->pevent, buf + 8, 4);
+	nr_chunks = tep_read_number(handle->pevent, buf + 12, 4);
+
+	/* The index has nr_chunks + 1 offsets, it must fit in the section */
+	if (!chunk_size || chunk_size % handle->page_size ||
+	    (unsigned long long)nr_chunks * chunk_size < data_size ||
+	    (unsigned long long)nr_chunks + 1 > (size - 16) / 8 ||
+	    (unsigned long long)nr_chunks + 1 > SIZE_MAX / 8)
+		goto fail;
+
+	nr = (size_t)nr_chunks + 1;
+	index = malloc(nr * 8);
+	cpu_data->chunks = malloc(nr * sizeof(*cpu_data->chunks));
+	if (!index || !cpu_data->chunks) {
+		free(index);
+		free(cpu_data->chunks);
+		cpu_data->chunks = NULL;
+		return -1;
+	}
+
+	if (pread64(handle->fd, index, nr * 8, offset + 16) != nr * 8)
+		goto fail_free;
+
+	for (i = 0; i < nr; i++) {
+		cpu_data->chunks[i] = offset +
+			tep_read_number(handle->pevent, &index[i], 8);
+		if (cpu_data->chunks[i] > offset + size ||
+		    (i && cpu_data->chunks[i] < cpu_data->chunks[i - 1]))
+			goto fail_free;
+	}
+	free(index);
+
+	cpu_data->nr_chunks = nr_chunks;
+	cpu_data->chunk_size = chunk_size;
+	cpu_data->file_size = data_size;
+
+	return 0;
+
+ fail_free:
+	free(index);
+	free(cpu_data->chunks);
+	cpu_data->chunks = NULL;
+ fail:
+	warning("cpu %d: bad index of compressed data", cpu);
+	errno = EINVAL;
+	return -1;
+}
+
 static int read_cpu_data(struct tracecmd_input *handle)
 {
 	struct tep_handle *pevent = handle->pevent;
@@ -2223,7 +2859,9 @@ static int read_cpu_data(struct tracecmd_input *handle)
 	enum kbuffer_endian endian;
 	unsigned long long size;
 	unsigned long long max_size = 0;
+	unsigned long long vbase = 0;
 	unsigned long long pages;
+	bool compressed = false;
 	char buf[10];
 	int cpus;
 	int cpu;
@@ -2249,8 +2887,14 @@ static int read_cpu_data(struct tracecmd_input *handle)
 		return 1;
 	}
 
-	/* We expect this to be flyrecord */
-	if (strncmp(buf, "flyrecord", 9) != 0)
+	/* We expect this to be flyrecord, or its compressed flycompr */
+	if (strncmp(buf, "flycompr", 8) == 0) {
+		if (!handle->compress) {
+			warning("compressed data without a supported codec");
+			return -1;
+		}
+		compressed = true;
+	} else if (strncmp(buf, "flyrecord", 9) != 0)
 		return -1;
 
 	handle->cpu_data = malloc(sizeof(*handle->cpu_data) * handle->cpus);
@@ -2258,8 +2902,14 @@ static int read_cpu_data(struct tracecmd_input *handle)
 		return -1;
 	memset(handle->cpu_data, 0, sizeof(*handle->cpu_data) * handle->cpus);
 
-	if (force_read)
+	/* The pages of compressed data are read from their chunks */
+	if (force_read && !compressed)
 		handle->read_page = true;
+	if (compressed) {
+		handle->read_page = false;
+		vbase = (handle->total_file_size + handle->page_size - 1) &
+			~((unsigned long long)handle->page_size - 1);
+	}
 
 	if (handle->long_size == 8)
 		long_size = KBUFFER_LSIZE_8;
@@ -2285,11 +2935,6 @@ static int read_cpu_data(struct tracecmd_input *handle)
 		read8(handle, &offset);
 		read8(handle, &size);
 
-		handle->cpu_data[cpu].file_offset = offset;
-		handle->cpu_data[cpu].file_size = size;
-		if (size > max_size)
-			max_size = size;
-
 		if (size && (offset + size > handle->total_file_size)) {
 			/* this happens if the file got truncated */
 			printf("File possibly truncated. "
@@ -2298,6 +2943,20 @@ static int read_cpu_data(struct tracecmd_input *handle)
 			errno = EINVAL;
 			goto out_free;
 		}
+
+		if (compressed && size) {
+			if (read_chunks(handle, cpu, offset, size) < 0)
+				goto out_free;
+			offset = vbase;
+			size = handle->cpu_data[cpu].file_size;
+			vbase += (size + handle->page_size - 1) &
+				~((unsigned long long)handle->page_size - 1);
+		}
+
+		handle->cpu_data[cpu].file_offset = offset;
+		handle->cpu_data[cpu].file_size = size;
+		if (size > max_size)
+			max_size = size;
 	}
 
 	/* Calculate about a meg of pages for buffering */
@@ -2788,9 +3447,14 @@ void tracecmd_close(struct tracecmd_input *handle)
 					handle->cpu_data[cpu].page_cnt,
 					cpu, show_records(handle->cpu_data[cpu].pages));
 			free(handle->cpu_data[cpu].pages);
+			free(handle->cpu_data[cpu].page_ts);
+			free(handle->cpu_data[cpu].events);
 		}
+		if (handle->cpu_data)
+			free(handle->cpu_data[cpu].chunks);
 	}
 
+	free_next_heap(handle);
 	free(handle->cpustats);
 	free(handle->cpu_data);
 	free(handle->uname);
@@ -2802,9 +3466,10 @@ void tracecmd_close(struct tracecmd_input *handle)
 	if (handle->flags & TRACECMD_FL_BUFFER_INSTANCE)
 		tracecmd_close(handle->parent);
 	else {
-		/* Only main handle frees plugins and pevent */
+		/* Only main handle frees plugins, pevent and compression */
 		tracecmd_unload_plugins(handle->plugin_list, handle->pevent);
 		tep_free(handle->pevent);
+		tracecmd_compress_free(handle->compress);
 	}
 	free(handle);
 }
@@ -3130,6 +3795,9 @@ tracecmd_buffer_instance_handle(struct tracecmd_input *handle, int indx)
 
 	*new_handle = *handle;
 	new_handle->cpu_data = NULL;
+	memset(&new_handle->next_heap, 0, sizeof(new_handle->next_heap));
+	new_handle->dirty_cpus = NULL;
+	new_handle->nr_dirty = 0;
 	new_handle->nr_buffers = 0;
 	new_handle->buffers = NULL;
 	new_handle->ref = 1;
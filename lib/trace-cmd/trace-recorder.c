@@ -12,12 +12,20 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
 #include <pthread.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <errno.h>
 
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
 #include "trace-cmd.h"
 #include "event-utils.h"
 
@@ -26,10 +34,20 @@
 # define F_GETPIPE_SZ	1032 /* The Linux number for the option */
 #endif
 
+/*
+ * With a max size, the data of a CPU is recorded into a ring of
+ * segments. When the current segment is full, the oldest one is
+ * truncated and recorded into next.
+ */
+struct recorder_segment {
+	int			fd;
+	/* The time stamps of the first and last pages of the segment */
+	unsigned long long	start_ts;
+	unsigned long long	end_ts;
+};
+
 struct tracecmd_recorder {
 	int		fd;
-	int		fd1;
-	int		fd2;
 	int		trace_fd;
 	int		brass[2];
 	int		pipe_size;
@@ -39,6 +57,9 @@ struct tracecmd_recorder {
 	int		max;
 	int		pages;
 	int		count;
+	int		segment;
+	int		nr_segments;
+	struct recorder_segment	*segments;
 	unsigned	fd_flags;
 	unsigned	flags;
 };
@@ -50,6 +71,15 @@ static int append_file(int size, int dst, int src)
 
 	lseek64(src, 0, SEEK_SET);
 
+#ifdef HAVE_COPY_FILE_RANGE
+	do {
+		r = copy_file_range(src, NULL, dst, NULL, 1 << 30, 0);
+	} while (r > 0 || (r < 0 && errno == EINTR));
+	/* Not supported, copy the rest by hand */
+	if (!r)
+		return 0;
+#endif
+
 	/* If there's an error, then we are pretty much screwed :-p */
 	do {
 		r = read(src, buf, size);
@@ -62,57 +92,128 @@ static int append_file(int size, int dst, int src)
 	return 0;
 }
 
+/* Save the time range of @seg, that is written up to its file offset */
+static void index_segment(struct tracecmd_recorder *recorder,
+			  struct recorder_segment *seg)
+{
+	off64_t size;
+
+	seg->start_ts = 0;
+	seg->end_ts = 0;
+
+	size = lseek64(seg->fd, 0, SEEK_CUR);
+	if (size < (off64_t)sizeof(seg->start_ts))
+		return;
+
+	/* Each page of the ring buffer starts with its time stamp */
+	pread(seg->fd, &seg->start_ts, sizeof(seg->start_ts), 0);
+	size = ((size - 1) / recorder->page_size) * recorder->page_size;
+	pread(seg->fd, &seg->end_ts, sizeof(seg->end_ts), size);
+}
+
+static int cmp_segments(const void *a, const void *b)
+{
+	const struct recorder_segment *sa = *(const struct recorder_segment **)a;
+	const struct recorder_segment *sb = *(const struct recorder_segment **)b;
+
+	if (sa->start_ts < sb->start_ts)
+		return -1;
+	if (sa->start_ts > sb->start_ts)
+		return 1;
+	return sa < sb ? -1 : sa > sb;
+}
+
+/*
+ * Put the data of the segments in the first one, that is the file
+ * the recorder was created with, oldest first.
+ */
+static void join_segments(struct tracecmd_recorder *recorder)
+{
+	struct recorder_segment **order;
+	struct recorder_segment *seg;
+	int nr = 0;
+	int i;
+
+	order = malloc(sizeof(*order) * recorder->nr_segments);
+	if (!order)
+		return;
+
+	for (i = 0; i < recorder->nr_segments; i++) {
+		seg = &recorder->segments[i];
+		index_segment(recorder, seg);
+		/* The truncated segments are empty */
+		if (lseek64(seg->fd, 0, SEEK_END) > 0)
+			order[nr++] = seg;
+	}
+
+	/* The segments are in the order of the ring, from any one */
+	qsort(order, nr, sizeof(*order), cmp_segments);
+
+	if (!nr || (nr == 1 && order[0] == recorder->segments))
+		goto out;
+
+	/*
+	 * If the first file is not the oldest, the newer data is appended
+	 * to the oldest segment, that is copied over the first file.
+	 */
+	seg = order[0];
+	for (i = 1; i < nr; i++) {
+		if (append_file(recorder->page_size, seg->fd, order[i]->fd))
+			goto out;
+	}
+
+	if (seg != recorder->segments) {
+		lseek64(recorder->segments[0].fd, 0, SEEK_SET);
+		ftruncate(recorder->segments[0].fd, 0);
+		append_file(recorder->page_size, recorder->segments[0].fd,
+			    seg->fd);
+	}
+ out:
+	free(order);
+}
+
 void tracecmd_free_recorder(struct tracecmd_recorder *recorder)
 {
+	int i;
+
 	if (!recorder)
 		return;
 
-	if (recorder->max) {
-		/* Need to put everything into fd1 */
-		if (recorder->fd == recorder->fd1) {
-			int ret;
-			/*
-			 * Crap, the older data is in fd2, and we need
-			 * to append fd1 onto it, and then copy over to fd1
-			 */
-			ret = append_file(recorder->page_size,
-					  recorder->fd2, recorder->fd1);
-			/* Error on copying, then just keep fd1 */
-			if (ret) {
-				lseek64(recorder->fd1, 0, SEEK_END);
-				goto close;
-			}
-			lseek64(recorder->fd1, 0, SEEK_SET);
-			ftruncate(recorder->fd1, 0);
-		}
-		append_file(recorder->page_size, recorder->fd1, recorder->fd2);
-	}
- close:
+	if (recorder->max)
+		join_segments(recorder);
+
 	if (recorder->trace_fd >= 0)
 		close(recorder->trace_fd);
 
-	if (recorder->fd1 >= 0)
-		close(recorder->fd1);
-
-	if (recorder->fd2 >= 0)
-		close(recorder->fd2);
+	for (i = 0; i < recorder->nr_segments; i++) {
+		if (recorder->segments[i].fd >= 0)
+			close(recorder->segments[i].fd);
+	}
 
+	free(recorder->segments);
 	free(recorder);
 }
 
-struct tracecmd_recorder *
-tracecmd_create_buffer_recorder_fd2(int fd, int fd2, int cpu, unsigned flags,
-				    const char *buffer, int maxkb)
+static struct tracecmd_recorder *
+create_buffer_recorder(int *fds, int nr_fds, int cpu, unsigned flags,
+		       const char *buffer, int maxkb)
 {
 	struct tracecmd_recorder *recorder;
 	char *path = NULL;
 	int pipe_size = 0;
 	int ret;
+	int i;
 
 	recorder = malloc(sizeof(*recorder));
 	if (!recorder)
 		return NULL;
 
+	recorder->segments = calloc(nr_fds, sizeof(*recorder->segments));
+	if (!recorder->segments) {
+		free(recorder);
+		return NULL;
+	}
+
 	recorder->cpu = cpu;
 	recorder->flags = flags;
 
@@ -126,15 +227,19 @@ tracecmd_create_buffer_recorder_fd2(int fd, int fd2, int cpu, unsigned flags,
 	recorder->brass[0] = -1;
 	recorder->brass[1] = -1;
 
+	recorder->nr_segments = nr_fds;
+	for (i = 0; i < nr_fds; i++)
+		recorder->segments[i].fd = fds[i];
+
 	recorder->page_size = getpagesize();
-	if (maxkb) {
+	if (maxkb && nr_fds > 1) {
 		int kb_per_page = recorder->page_size >> 10;
 
 		if (!kb_per_page)
 			kb_per_page = 1;
 		recorder->max = maxkb / kb_per_page;
-		/* keep max half */
-		recorder->max >>= 1;
+		/* split max between the segments */
+		recorder->max /= nr_fds;
 		if (!recorder->max)
 			recorder->max = 1;
 	} else
@@ -142,11 +247,10 @@ tracecmd_create_buffer_recorder_fd2(int fd, int fd2, int cpu, unsigned flags,
 
 	recorder->count = 0;
 	recorder->pages = 0;
+	recorder->segment = 0;
 
 	/* fd always points to what to write to */
-	recorder->fd = fd;
-	recorder->fd1 = fd;
-	recorder->fd2 = fd2;
+	recorder->fd = fds[0];
 
 	if (flags & TRACECMD_RECORD_SNAPSHOT)
 		ret = asprintf(&path, "%s/per_cpu/cpu%d/snapshot_raw", buffer, cpu);
@@ -184,10 +288,22 @@ tracecmd_create_buffer_recorder_fd2(int fd, int fd2, int cpu, unsigned flags,
  out_free:
 	free(path);
 
+	/* The files are closed by the caller */
+	recorder->nr_segments = 0;
 	tracecmd_free_recorder(recorder);
 	return NULL;
 }
 
+struct tracecmd_recorder *
+tracecmd_create_buffer_recorder_fd2(int fd, int fd2, int cpu, unsigned flags,
+				    const char *buffer, int maxkb)
+{
+	int fds[2] = { fd, fd2 };
+
+	return create_buffer_recorder(fds, fd2 >= 0 ? 2 : 1, cpu, flags,
+				      buffer, maxkb);
+}
+
 struct tracecmd_recorder *
 tracecmd_create_buffer_recorder_fd(int fd, int cpu, unsigned flags, const char *buffer)
 {
@@ -213,51 +329,76 @@ tracecmd_create_buffer_recorder(const char *file, int cpu, unsigned flags, const
 	return recorder;
 }
 
+/**
+ * tracecmd_create_buffer_recorder_segments - record into a ring of files
+ * @file: the file that holds the data when the recorder is freed
+ * @cpu: the CPU to record
+ * @flags: TRACECMD_RECORD_* flags
+ * @buffer: the directory of the ring buffer instance
+ * @maxkb: the max size of the data of the CPU
+ * @segments: the number of files to split @maxkb between
+ *
+ * The data is recorded into @segments files of @maxkb / @segments each.
+ * When the last one is full, the one with the oldest data is truncated
+ * and recorded into. When the recorder is freed, the data left in the
+ * segments is put into @file, ordered by time. That is, at least
+ * (@segments - 1) / @segments of @maxkb of the latest data is kept.
+ */
 struct tracecmd_recorder *
-tracecmd_create_buffer_recorder_maxkb(const char *file, int cpu, unsigned flags,
-				      const char *buffer, int maxkb)
+tracecmd_create_buffer_recorder_segments(const char *file, int cpu,
+					 unsigned flags, const char *buffer,
+					 int maxkb, int segments)
 {
 	struct tracecmd_recorder *recorder = NULL;
-	char *file2;
-	int len;
-	int fd;
-	int fd2;
+	char *seg_file;
+	int *fds;
+	int i;
 
-	if (!maxkb)
+	if (!maxkb || segments < 2)
 		return tracecmd_create_buffer_recorder(file, cpu, flags, buffer);
 
-	len = strlen(file);
-	file2 = malloc(len + 3);
-	if (!file2)
-		return NULL;
-
-	sprintf(file2, "%s.1", file);
+	fds = malloc(sizeof(*fds) * segments);
+	seg_file = malloc(strlen(file) + 12);
+	if (!fds || !seg_file)
+		goto out;
 
-	fd = open(file, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
-	if (fd < 0)
+	fds[0] = open(file, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+	if (fds[0] < 0)
 		goto out;
 
-	fd2 = open(file2, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
-	if (fd < 0)
-		goto err;
+	for (i = 1; i < segments; i++) {
+		sprintf(seg_file, "%s.%d", file, i);
+		fds[i] = open(seg_file, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+		/* Only file is needed at the end */
+		unlink(seg_file);
+		if (fds[i] < 0)
+			goto err;
+	}
 
-	recorder = tracecmd_create_buffer_recorder_fd2(fd, fd2, cpu, flags, buffer, maxkb);
+	recorder = create_buffer_recorder(fds, segments, cpu, flags,
+					  buffer, maxkb);
 	if (!recorder)
-		goto err2;
+		goto err;
  out:
-	/* Unlink file2, we need to add everything to file at the end */
-	unlink(file2);
-	free(file2);
+	free(seg_file);
+	free(fds);
 
 	return recorder;
- err2:
-	close(fd2);
  err:
-	close(fd);
+	while (--i >= 0)
+		close(fds[i]);
 	unlink(file);
 	goto out;
 }
 
+struct tracecmd_recorder *
+tracecmd_create_buffer_recorder_maxkb(const char *file, int cpu, unsigned flags,
+				      const char *buffer, int maxkb)
+{
+	return tracecmd_create_buffer_recorder_segments(file, cpu, flags, buffer,
+							maxkb, 2);
+}
+
 struct tracecmd_recorder *tracecmd_create_recorder_fd(int fd, int cpu, unsigned flags)
 {
 	const char *tracing;
@@ -286,6 +427,13 @@ struct tracecmd_recorder *tracecmd_create_recorder(const char *file, int cpu, un
 
 struct tracecmd_recorder *
 tracecmd_create_recorder_maxkb(const char *file, int cpu, unsigned flags, int maxkb)
+{
+	return tracecmd_create_recorder_segments(file, cpu, flags, maxkb, 2);
+}
+
+struct tracecmd_recorder *
+tracecmd_create_recorder_segments(const char *file, int cpu, unsigned flags,
+				  int maxkb, int segments)
 {
 	const char *tracing;
 
@@ -295,12 +443,13 @@ tracecmd_create_recorder_maxkb(const char *file, int cpu, unsigned flags, int ma
 		return NULL;
 	}
 
-	return tracecmd_create_buffer_recorder_maxkb(file, cpu, flags, tracing, maxkb);
+	return tracecmd_create_buffer_recorder_segments(file, cpu, flags, tracing,
+							maxkb, segments);
 }
 
 static inline void update_fd(struct tracecmd_recorder *recorder, int size)
 {
-	int fd;
+	struct recorder_segment *seg;
 
 	if (!recorder->max)
 		return;
@@ -317,19 +466,15 @@ static inline void update_fd(struct tracecmd_recorder *recorder, int size)
 
 	recorder->pages = 0;
 
-	fd = recorder->fd;
-
-	/* Swap fd to next file. */
-	if (fd == recorder->fd1)
-		fd = recorder->fd2;
-	else
-		fd = recorder->fd1;
+	/* Move on to the segment with the oldest data. */
+	recorder->segment = (recorder->segment + 1) % recorder->nr_segments;
+	seg = &recorder->segments[recorder->segment];
 
 	/* Zero out the new file we are writing to */
-	lseek64(fd, 0, SEEK_SET);
-	ftruncate(fd, 0);
+	lseek64(seg->fd, 0, SEEK_SET);
+	ftruncate(seg->fd, 0);
 
-	recorder->fd = fd;
+	recorder->fd = seg->fd;
 }
 
 /*
@@ -406,18 +551,45 @@ static long read_data(struct tracecmd_recorder *recorder)
 	return r;
 }
 
-static void set_nonblock(struct tracecmd_recorder *recorder)
+static void set_read_nonblock(struct tracecmd_recorder *recorder)
 {
 	long flags;
 
-	/* Do not block on reads for flushing */
 	flags = fcntl(recorder->trace_fd, F_GETFL);
 	fcntl(recorder->trace_fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void set_nonblock(struct tracecmd_recorder *recorder)
+{
+	/* Do not block on reads for flushing */
+	set_read_nonblock(recorder);
 
 	/* Do not block on streams for write */
 	recorder->fd_flags |= 2; /* NON_BLOCK */
 }
 
+/*
+ * Returns -1 on error.
+ *          or bytes of data read.
+ */
+static long drain_data(struct tracecmd_recorder *recorder)
+{
+	long total = 0;
+	long ret;
+
+	do {
+		if (recorder->flags & TRACECMD_RECORD_NOSPLICE)
+			ret = read_data(recorder);
+		else
+			ret = splice_data(recorder);
+		if (ret < 0)
+			return ret;
+		total += ret;
+	} while (ret);
+
+	return total;
+}
+
 long tracecmd_flush_recording(struct tracecmd_recorder *recorder)
 {
 	char buf[recorder->page_size];
@@ -458,7 +630,101 @@ long tracecmd_flush_recording(struct tracecmd_recorder *recorder)
 	return total;
 }
 
-int tracecmd_start_recording(struct tracecmd_recorder *recorder, unsigned long sleep)
+/*
+ * With a buffer_percent of zero, the ring buffer polls as readable as
+ * soon as it has any data, but splice only moves full pages. Back off
+ * for this long when a wake up did not give anything to read.
+ */
+#define POLL_BACKOFF_USECS	1000
+
+/**
+ * tracecmd_start_recording_poll - record from a set of recorders
+ * @recorders: the recorders to read from
+ * @nr_recorders: the number of @recorders
+ * @sleep: the maximum time (in usecs) to wait for data
+ *
+ * Instead of sleeping when there is nothing to read, wait in poll()
+ * for any of the ring buffers of @recorders to fill up to its
+ * watermark (buffer_percent), and drain all the ready ones. This
+ * returns after all of @recorders were stopped with
+ * tracecmd_stop_recording() and flushed.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int tracecmd_start_recording_poll(struct tracecmd_recorder **recorders,
+				  int nr_recorders, unsigned long sleep)
+{
+	struct timespec req;
+	struct pollfd *pfds;
+	int timeout;
+	int stopped;
+	int ready;
+	long read;
+	long ret;
+	int i;
+
+	pfds = malloc(sizeof(*pfds) * nr_recorders);
+	if (!pfds)
+		return -1;
+
+	for (i = 0; i < nr_recorders; i++) {
+		recorders[i]->stop = 0;
+		/* The data is only read when poll says so */
+		set_read_nonblock(recorders[i]);
+		pfds[i].fd = recorders[i]->trace_fd;
+		pfds[i].events = POLLIN;
+	}
+
+	timeout = (sleep + 999) / 1000;
+
+	do {
+		for (i = 0; i < nr_recorders; i++)
+			pfds[i].revents = 0;
+
+		ready = poll(pfds, nr_recorders, timeout);
+		if (ready < 0 && errno != EINTR) {
+			warning("recorder error in poll");
+			ret = -1;
+			goto out;
+		}
+
+		read = 0;
+		for (i = 0; i < nr_recorders; i++) {
+			if (!(pfds[i].revents & POLLIN))
+				continue;
+			ret = drain_data(recorders[i]);
+			if (ret < 0)
+				goto out;
+			read += ret;
+		}
+
+		if (ready > 0 && !read) {
+			req.tv_sec = 0;
+			req.tv_nsec = POLL_BACKOFF_USECS * 1000;
+			nanosleep(&req, NULL);
+		}
+
+		stopped = 1;
+		for (i = 0; i < nr_recorders; i++) {
+			if (!recorders[i]->stop)
+				stopped = 0;
+		}
+	} while (!stopped);
+
+	/* Flush out the rest */
+	for (i = 0; i < nr_recorders; i++) {
+		ret = tracecmd_flush_recording(recorders[i]);
+		if (ret < 0)
+			goto out;
+	}
+	ret = 0;
+ out:
+	free(pfds);
+
+	return ret < 0 ? -1 : 0;
+}
+
+static int start_recording(struct tracecmd_recorder *recorder, unsigned long sleep)
 {
 	struct timespec req;
 	long read = 1;
@@ -473,16 +739,9 @@ int tracecmd_start_recording(struct tracecmd_recorder *recorder, unsigned long s
 			req.tv_nsec = (sleep % 1000000) * 1000;
 			nanosleep(&req, NULL);
 		}
-		read = 0;
-		do {
-			if (recorder->flags & TRACECMD_RECORD_NOSPLICE)
-				ret = read_data(recorder);
-			else
-				ret = splice_data(recorder);
-			if (ret < 0)
-				return ret;
-			read += ret;
-		} while (ret);
+		read = drain_data(recorder);
+		if (read < 0)
+			return read;
 	} while (!recorder->stop);
 
 	/* Flush out the rest */
@@ -494,6 +753,592 @@ int tracecmd_start_recording(struct tracecmd_recorder *recorder, unsigned long s
 	return 0;
 }
 
+#ifdef HAVE_IO_URING
+
+/* Number of pages read from a ring buffer by one chain of reads */
+#define URING_CHAIN_PAGES	16
+
+/* The maximum number of submission queue entries */
+#define URING_MAX_ENTRIES	4096
+
+enum {
+	URING_READ,
+	URING_WRITE,
+	URING_POLL,
+	URING_TIMEOUT,
+};
+
+/*
+ * The user data of a request is the index of the recorder, the buffer
+ * area used by the request and the request type.
+ */
+#define URING_DATA(idx, area, type)	\
+	(((unsigned long long)(idx) << 8) | ((area) << 4) | (type))
+#define URING_DATA_IDX(data)	((data) >> 8)
+#define URING_DATA_AREA(data)	(((data) >> 4) & 1)
+#define URING_DATA_TYPE(data)	((data) & 0xf)
+
+struct uring {
+	int			fd;
+	unsigned		*sq_head;
+	unsigned		*sq_tail;
+	unsigned		*sq_mask;
+	unsigned		*sq_array;
+	unsigned		sq_entries;
+	unsigned		sq_local_tail;
+	unsigned		sq_submitted;
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		*cq_mask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+	void			*sq_ptr;
+	void			*cq_ptr;
+	size_t			sq_size;
+	size_t			cq_size;
+	size_t			sqes_size;
+};
+
+/* The state of a recorder, recording through io_uring */
+struct uring_recorder {
+	struct tracecmd_recorder *recorder;
+	/* Two areas of URING_CHAIN_PAGES pages, registered with the ring */
+	char			*buf;
+	/* File offset of the next write */
+	off64_t			offset;
+	/* The area to read into next */
+	int			area;
+	/* Reads in flight, and what they have read so far */
+	int			reads;
+	int			chain_area;
+	long			chain_len;
+	/* Writes in flight, per area */
+	int			writes;
+	int			busy[2];
+	long			len[2];
+	long			done[2];
+	off64_t			off[2];
+	/* The last read found the ring buffer empty */
+	int			drained;
+	int			polling;
+};
+
+static int uring_setup(struct uring *ring, unsigned entries)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	memset(ring, 0, sizeof(*ring));
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd,
+			    IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ptr = ring->sq_ptr;
+	else {
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ring->fd,
+				    IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			ring->cq_ptr = NULL;
+			goto fail_sq;
+		}
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	ring->sq_head = ring->sq_ptr + p.sq_off.head;
+	ring->sq_tail = ring->sq_ptr + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ptr + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ptr + p.sq_off.array;
+	ring->sq_entries = p.sq_entries;
+	ring->sq_local_tail = *ring->sq_tail;
+	ring->sq_submitted = ring->sq_local_tail;
+
+	ring->cq_head = ring->cq_ptr + p.cq_off.head;
+	ring->cq_tail = ring->cq_ptr + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ptr + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ptr + p.cq_off.cqes;
+
+	return 0;
+
+ fail_cq:
+	if (ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+ fail_sq:
+	munmap(ring->sq_ptr, ring->sq_size);
+ fail:
+	close(ring->fd);
+	return -1;
+}
+
+static void uring_free(struct uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+}
+
+/*
+ * Submit the queued requests, and wait for at least @wait of them to
+ * complete. Returns -1 on error (errno is EINTR if a signal arrived).
+ */
+static int uring_enter(struct uring *ring, unsigned wait)
+{
+	unsigned submit;
+	int ret;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	submit = ring->sq_local_tail - ring->sq_submitted;
+
+	ret = syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+		      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (ret < 0)
+		return -1;
+
+	ring->sq_submitted += ret;
+	return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned head;
+	unsigned idx;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_local_tail - head >= ring->sq_entries) {
+		/* Full, make room */
+		if (uring_enter(ring, 0) < 0)
+			return NULL;
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (ring->sq_local_tail - head >= ring->sq_entries)
+			return NULL;
+	}
+
+	idx = ring->sq_local_tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[idx] = idx;
+	ring->sq_local_tail++;
+
+	return sqe;
+}
+
+/*
+ * Read up to URING_CHAIN_PAGES pages of the ring buffer. The reads are
+ * linked, thus they are done in order, and the first one that finds
+ * the ring buffer empty cancels the rest.
+ */
+static int uring_queue_reads(struct uring *ring, struct uring_recorder *ur,
+			     int idx)
+{
+	struct tracecmd_recorder *recorder = ur->recorder;
+	int page_size = recorder->page_size;
+	struct io_uring_sqe *sqe;
+	char *area;
+	int i;
+
+	area = ur->buf + ur->area * URING_CHAIN_PAGES * page_size;
+
+	for (i = 0; i < URING_CHAIN_PAGES; i++) {
+		sqe = uring_get_sqe(ring);
+		if (!sqe)
+			return -1;
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->fd = recorder->trace_fd;
+		sqe->addr = (unsigned long)(area + i * page_size);
+		sqe->len = page_size;
+		sqe->buf_index = idx;
+		sqe->user_data = URING_DATA(idx, ur->area, URING_READ);
+		if (i < URING_CHAIN_PAGES - 1)
+			sqe->flags |= IOSQE_IO_LINK;
+		ur->reads++;
+	}
+
+	ur->chain_area = ur->area;
+	ur->chain_len = 0;
+	ur->area ^= 1;
+
+	return 0;
+}
+
+static int uring_queue_write(struct uring *ring, struct uring_recorder *ur,
+			     int idx, int area)
+{
+	struct tracecmd_recorder *recorder = ur->recorder;
+	struct io_uring_sqe *sqe;
+	char *buf;
+
+	buf = ur->buf + area * URING_CHAIN_PAGES * recorder->page_size;
+
+	sqe = uring_get_sqe(ring);
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = recorder->fd;
+	sqe->addr = (unsigned long)(buf + ur->done[area]);
+	sqe->len = ur->len[area] - ur->done[area];
+	sqe->off = ur->off[area] + ur->done[area];
+	sqe->buf_index = idx;
+	sqe->user_data = URING_DATA(idx, area, URING_WRITE);
+	ur->writes++;
+
+	return 0;
+}
+
+static int uring_queue_poll(struct uring *ring, struct uring_recorder *ur,
+			    int idx)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(ring);
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = ur->recorder->trace_fd;
+	sqe->poll_events = POLLIN;
+	sqe->user_data = URING_DATA(idx, 0, URING_POLL);
+	ur->polling = 1;
+
+	return 0;
+}
+
+static int uring_complete(struct uring *ring, struct uring_recorder *urs,
+			  struct io_uring_cqe *cqe, int *timeout)
+{
+	unsigned long long data = cqe->user_data;
+	struct uring_recorder *ur;
+	int area = URING_DATA_AREA(data);
+	int res = cqe->res;
+
+	if (URING_DATA_TYPE(data) == URING_TIMEOUT) {
+		*timeout = 0;
+		return 0;
+	}
+
+	ur = &urs[URING_DATA_IDX(data)];
+
+	switch (URING_DATA_TYPE(data)) {
+	case URING_READ:
+		ur->reads--;
+		if (res > 0)
+			ur->chain_len += res;
+		else if (res == 0 || res == -EAGAIN || res == -ECANCELED ||
+			 res == -EINTR)
+			ur->drained = 1;
+		else {
+			errno = -res;
+			warning("recorder error in io_uring read");
+			return -1;
+		}
+		if (ur->reads || !ur->chain_len)
+			break;
+		area = ur->chain_area;
+		ur->busy[area] = 1;
+		ur->len[area] = ur->chain_len;
+		ur->done[area] = 0;
+		ur->off[area] = ur->offset;
+		ur->offset += ur->chain_len;
+		return uring_queue_write(ring, ur, URING_DATA_IDX(data), area);
+
+	case URING_WRITE:
+		ur->writes--;
+		if (res <= 0) {
+			errno = res ? -res : ENOSPC;
+			warning("recorder error in io_uring write");
+			return -1;
+		}
+		ur->done[area] += res;
+		if (ur->done[area] < ur->len[area])
+			return uring_queue_write(ring, ur, URING_DATA_IDX(data), area);
+		ur->busy[area] = 0;
+		break;
+
+	case URING_POLL:
+		ur->polling = 0;
+		ur->drained = 0;
+		break;
+	}
+
+	return 0;
+}
+
+static int uring_reap(struct uring *ring, struct uring_recorder *urs,
+		      int *timeout)
+{
+	unsigned head, tail;
+	int ret = 0;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		if (uring_complete(ring, urs, &ring->cqes[head & *ring->cq_mask],
+				   timeout) < 0)
+			ret = -1;
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return ret;
+}
+
+static int uring_supported(struct tracecmd_recorder *recorder)
+{
+	struct stat st;
+
+	/* The writes are done at explicit offsets of a regular file */
+	if (recorder->max)
+		return 0;
+
+	if (fstat(recorder->fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return 0;
+
+	return 1;
+}
+
+/*
+ * Returns 1 if @recorders were recorded with io_uring, 0 if io_uring
+ * can not be used, and -1 on error.
+ */
+static int start_recording_uring(struct tracecmd_recorder **recorders,
+				 int nr_recorders, unsigned long sleep)
+{
+	struct __kernel_timespec ts;
+	struct uring_recorder *urs;
+	struct io_uring_sqe *sqe;
+	struct timespec req;
+	struct iovec *iovs;
+	struct uring ring;
+	unsigned entries;
+	size_t area_size;
+	int timeout = 0;
+	int stopped;
+	int error = 0;
+	int busy;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < nr_recorders; i++) {
+		if (!uring_supported(recorders[i]))
+			return 0;
+	}
+
+	entries = nr_recorders * (URING_CHAIN_PAGES + 3) + 1;
+	if (entries > URING_MAX_ENTRIES)
+		entries = URING_MAX_ENTRIES;
+
+	if (uring_setup(&ring, entries) < 0)
+		return 0;
+
+	urs = calloc(nr_recorders, sizeof(*urs));
+	iovs = calloc(nr_recorders, sizeof(*iovs));
+	if (!urs || !iovs)
+		goto out_free;
+
+	for (i = 0; i < nr_recorders; i++) {
+		area_size = URING_CHAIN_PAGES * recorders[i]->page_size;
+		if (posix_memalign((void **)&urs[i].buf,
+				   recorders[i]->page_size, area_size * 2))
+			goto out_free;
+		urs[i].recorder = recorders[i];
+		urs[i].offset = lseek64(recorders[i]->fd, 0, SEEK_CUR);
+		iovs[i].iov_base = urs[i].buf;
+		iovs[i].iov_len = area_size * 2;
+	}
+
+	/* Without registered buffers, keep on using splice */
+	if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS,
+		    iovs, nr_recorders) < 0)
+		goto out_free;
+
+	for (i = 0; i < nr_recorders; i++) {
+		recorders[i]->stop = 0;
+		/* An empty ring buffer must fail the read, not wait */
+		set_read_nonblock(recorders[i]);
+	}
+
+	ret = 1;
+
+	for (;;) {
+		stopped = 1;
+		for (i = 0; i < nr_recorders; i++) {
+			if (!recorders[i]->stop)
+				stopped = 0;
+		}
+
+		busy = 0;
+		for (i = 0; i < nr_recorders; i++) {
+			struct uring_recorder *ur = &urs[i];
+
+			if (!stopped && !error && !ur->drained && !ur->reads &&
+			    !ur->busy[ur->area]) {
+				if (uring_queue_reads(&ring, ur, i) < 0)
+					error = 1;
+			}
+			if (ur->reads || ur->writes)
+				busy = 1;
+		}
+
+		if (!busy) {
+			/* Everything read so far is written out */
+			if (stopped || error)
+				break;
+
+			if (!(recorders[0]->flags & TRACECMD_RECORD_POLL)) {
+				if (sleep) {
+					req.tv_sec = sleep / 1000000;
+					req.tv_nsec = (sleep % 1000000) * 1000;
+					nanosleep(&req, NULL);
+				}
+				for (i = 0; i < nr_recorders; i++)
+					urs[i].drained = 0;
+				continue;
+			}
+
+			/* Wait for the ring buffers to fill up to the watermark */
+			for (i = 0; i < nr_recorders; i++) {
+				if (!urs[i].polling &&
+				    uring_queue_poll(&ring, &urs[i], i) < 0)
+					error = 1;
+			}
+			if (sleep && !timeout && !error) {
+				ts.tv_sec = sleep / 1000000;
+				ts.tv_nsec = (sleep % 1000000) * 1000;
+				sqe = uring_get_sqe(&ring);
+				if (sqe) {
+					sqe->opcode = IORING_OP_TIMEOUT;
+					sqe->addr = (unsigned long)&ts;
+					sqe->len = 1;
+					sqe->user_data = URING_DATA(0, 0, URING_TIMEOUT);
+					timeout = 1;
+				} else
+					error = 1;
+			}
+		}
+
+		if (uring_enter(&ring, 1) < 0 && errno != EINTR) {
+			warning("recorder error in io_uring_enter");
+			/* Can not tell what is still in flight */
+			ret = -1;
+			goto out_leak;
+		}
+
+		if (uring_reap(&ring, urs, &timeout) < 0)
+			error = 1;
+	}
+
+	if (error)
+		ret = -1;
+
+	/* Polls and timeouts do not use the buffers, close() cancels them */
+	for (i = 0; i < nr_recorders; i++)
+		lseek64(recorders[i]->fd, urs[i].offset, SEEK_SET);
+
+ out_free:
+	uring_free(&ring);
+	for (i = 0; urs && i < nr_recorders; i++)
+		free(urs[i].buf);
+	free(urs);
+	free(iovs);
+
+	return ret;
+
+ out_leak:
+	/* The kernel may still write into the buffers, do not free them */
+	uring_free(&ring);
+	return ret;
+}
+
+#else
+
+static int start_recording_uring(struct tracecmd_recorder **recorders,
+				 int nr_recorders, unsigned long sleep)
+{
+	return 0;
+}
+
+#endif /* HAVE_IO_URING */
+
+/**
+ * tracecmd_start_recording_uring - record from a set of recorders with io_uring
+ * @recorders: the recorders to read from
+ * @nr_recorders: the number of @recorders
+ * @sleep: the time (in usecs) to wait when there is nothing to read
+ *
+ * The reads of the ring buffers of all @recorders and the writes into
+ * their files are batched through a single io_uring, with registered
+ * buffers. If the recorders have TRACECMD_RECORD_POLL set, the wait
+ * for data is done with io_uring polls as well.
+ *
+ * If io_uring is not supported (by the kernel, or for the output of
+ * the recorders), this falls back to tracecmd_start_recording_poll(),
+ * or to tracecmd_start_recording() for a single recorder.
+ *
+ * This returns after all of @recorders were stopped with
+ * tracecmd_stop_recording() and flushed.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int tracecmd_start_recording_uring(struct tracecmd_recorder **recorders,
+				   int nr_recorders, unsigned long sleep)
+{
+	int ret;
+	int i;
+
+	ret = start_recording_uring(recorders, nr_recorders, sleep);
+	if (ret < 0)
+		return -1;
+
+	if (ret) {
+		/* Flush out the rest */
+		for (i = 0; i < nr_recorders; i++) {
+			if (tracecmd_flush_recording(recorders[i]) < 0)
+				return -1;
+		}
+		return 0;
+	}
+
+	if (nr_recorders > 1 || recorders[0]->flags & TRACECMD_RECORD_POLL)
+		return tracecmd_start_recording_poll(recorders, nr_recorders,
+						     sleep);
+
+	return start_recording(recorders[0], sleep);
+}
+
+int tracecmd_start_recording(struct tracecmd_recorder *recorder, unsigned long sleep)
+{
+	if (recorder->flags & TRACECMD_RECORD_URING)
+		return tracecmd_start_recording_uring(&recorder, 1, sleep);
+
+	if (recorder->flags & TRACECMD_RECORD_POLL)
+		return tracecmd_start_recording_poll(&recorder, 1, sleep);
+
+	return start_recording(recorder, sleep);
+}
+
 void tracecmd_stop_recording(struct tracecmd_recorder *recorder)
 {
 	if (!recorder)
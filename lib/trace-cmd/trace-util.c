@@ -373,9 +373,11 @@ void tracecmd_parse_cmdlines(struct tep_handle *pevent,
 
 	line = strtok_r(file, "\n", &next);
 	while (line) {
-		sscanf(line, "%d %ms", &pid, &comm);
-		tep_register_comm(pevent, comm, pid);
-		free(comm);
+		/* comms may contain spaces, take the rest of the line */
+		if (sscanf(line, "%d %m[^\n]", &pid, &comm) == 2) {
+			tep_register_comm(pevent, comm, pid);
+			free(comm);
+		}
 		line = strtok_r(NULL, "\n", &next);
 	}
 }
@@ -36,6 +36,20 @@ struct tep_event_format *tep_get_first_event(struct tep_handle *tep)
 	return tep_get_event(tep, 0);
 }
 
+/**
+ * tep_is_frozen - check if tep_freeze() was called on the handle
+ * @tep: a handle to the tep_handle
+ *
+ * This returns 1 if @tep can be shared by threads parsing the records,
+ * or 0 otherwise.
+ */
+int tep_is_frozen(struct tep_handle *tep)
+{
+	if (tep)
+		return tep->frozen;
+	return 0;
+}
+
 /**
  * tep_get_events_count - get the number of defined events
  * @tep: a handle to the tep_handle
@@ -7,8 +7,9 @@
 #ifndef _PARSE_EVENTS_INT_H
 #define _PARSE_EVENTS_INT_H
 
+#include <pthread.h>
+
 struct cmdline;
-struct cmdline_list;
 struct func_map;
 struct func_list;
 struct event_handler;
@@ -36,9 +37,13 @@ struct tep_handle {
 	int long_size;
 	int page_size;
 
-	struct cmdline *cmdlines;
-	struct cmdline_list *cmdlist;
+	/* hashed by pid, and by comm */
+	struct cmdline **cmdlines;
+	struct cmdline **comm_cmdlines;
+	int cmdline_bits;
 	int cmdline_count;
+	/* only taken once frozen, the comms can then be shared */
+	pthread_rwlock_t cmdlines_lock;
 
 	struct func_map *func_map;
 	struct func_resolver *func_resolver;
@@ -52,6 +57,9 @@ struct tep_handle {
 
 	struct tep_event_format **events;
 	int nr_events;
+	/* events indexed by their ids, for tep_find_event() */
+	struct tep_event_format **event_ids;
+	int nr_event_ids;
 	struct tep_event_format **sort_events;
 	enum tep_event_sort_type last_type;
 
@@ -70,6 +78,9 @@ struct tep_handle {
 	int ld_offset;
 	int ld_size;
 
+	int md_offset;
+	int md_size;
+
 	int print_raw;
 
 	int test_filters;
@@ -85,8 +96,8 @@ struct tep_handle {
 
 	int parsing_failures;
 
-	/* cache */
-	struct tep_event_format *last_event;
+	/* set by tep_freeze(), nothing is lazily resolved anymore */
+	int frozen;
 
 	char *trace_clock;
 };
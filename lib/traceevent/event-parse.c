@@ -126,54 +126,106 @@ struct tep_print_arg *alloc_arg(void)
 }
 
 struct cmdline {
+	/* the next cmdline in the buckets of the pid and of the comm */
+	struct cmdline *next;
+	struct cmdline *comm_next;
+	unsigned int comm_hash;
 	char *comm;
 	int pid;
 };
 
-static int cmdline_cmp(const void *a, const void *b)
+/* The hashes start with 256 buckets, and double when they are full */
+#define CMDLINE_HASH_BITS	8
+
+static inline unsigned int pid_hash(int pid, int bits)
 {
-	const struct cmdline *ca = a;
-	const struct cmdline *cb = b;
+	return ((unsigned int)pid * 2654435761U) >> (32 - bits);
+}
 
-	if (ca->pid < cb->pid)
-		return -1;
-	if (ca->pid > cb->pid)
-		return 1;
+/* FNV-1a */
+static unsigned int comm_hash(const char *comm)
+{
+	unsigned int hash = 2166136261U;
 
-	return 0;
+	for (; *comm; comm++) {
+		hash ^= (unsigned char)*comm;
+		hash *= 16777619U;
+	}
+
+	return hash;
 }
 
-struct cmdline_list {
-	struct cmdline_list	*next;
-	char			*comm;
-	int			pid;
-};
+/*
+ * A frozen handle is shared by several threads, and the plugins
+ * may still register comms while printing the records.
+ */
+static inline void cmdlines_read_lock(struct tep_handle *pevent)
+{
+	if (pevent->frozen)
+		pthread_rwlock_rdlock(&pevent->cmdlines_lock);
+}
+
+static inline void cmdlines_write_lock(struct tep_handle *pevent)
+{
+	if (pevent->frozen)
+		pthread_rwlock_wrlock(&pevent->cmdlines_lock);
+}
+
+static inline void cmdlines_unlock(struct tep_handle *pevent)
+{
+	if (pevent->frozen)
+		pthread_rwlock_unlock(&pevent->cmdlines_lock);
+}
+
+static struct cmdline *find_cmdline_pid(struct tep_handle *pevent, int pid)
+{
+	struct cmdline *cmdline;
+
+	if (!pevent->cmdlines)
+		return NULL;
+
+	cmdline = pevent->cmdlines[pid_hash(pid, pevent->cmdline_bits)];
+	while (cmdline && cmdline->pid != pid)
+		cmdline = cmdline->next;
+
+	return cmdline;
+}
 
-static int cmdline_init(struct tep_handle *pevent)
+static int resize_cmdlines(struct tep_handle *pevent, int bits)
 {
-	struct cmdline_list *cmdlist = pevent->cmdlist;
-	struct cmdline_list *item;
-	struct cmdline *cmdlines;
+	struct cmdline **cmdlines;
+	struct cmdline **comm_cmdlines;
+	struct cmdline *cmdline, *next;
+	unsigned int key;
 	int i;
 
-	cmdlines = malloc(sizeof(*cmdlines) * pevent->cmdline_count);
-	if (!cmdlines)
+	cmdlines = calloc(1 << bits, sizeof(*cmdlines));
+	comm_cmdlines = calloc(1 << bits, sizeof(*comm_cmdlines));
+	if (!cmdlines || !comm_cmdlines) {
+		free(cmdlines);
+		free(comm_cmdlines);
 		return -1;
-
-	i = 0;
-	while (cmdlist) {
-		cmdlines[i].pid = cmdlist->pid;
-		cmdlines[i].comm = cmdlist->comm;
-		i++;
-		item = cmdlist;
-		cmdlist = cmdlist->next;
-		free(item);
 	}
 
-	qsort(cmdlines, pevent->cmdline_count, sizeof(*cmdlines), cmdline_cmp);
+	for (i = 0; pevent->cmdlines && i < (1 << pevent->cmdline_bits); i++) {
+		for (cmdline = pevent->cmdlines[i]; cmdline; cmdline = next) {
+			next = cmdline->next;
+
+			key = pid_hash(cmdline->pid, bits);
+			cmdline->next = cmdlines[key];
+			cmdlines[key] = cmdline;
+
+			key = cmdline->comm_hash >> (32 - bits);
+			cmdline->comm_next = comm_cmdlines[key];
+			comm_cmdlines[key] = cmdline;
+		}
+	}
 
+	free(pevent->cmdlines);
+	free(pevent->comm_cmdlines);
 	pevent->cmdlines = cmdlines;
-	pevent->cmdlist = NULL;
+	pevent->comm_cmdlines = comm_cmdlines;
+	pevent->cmdline_bits = bits;
 
 	return 0;
 }
@@ -181,18 +233,14 @@ static int cmdline_init(struct tep_handle *pevent)
 static const char *find_cmdline(struct tep_handle *pevent, int pid)
 {
 	const struct cmdline *comm;
-	struct cmdline key;
 
 	if (!pid)
 		return "<idle>";
 
-	if (!pevent->cmdlines && cmdline_init(pevent))
-		return "<not enough memory for cmdlines!>";
-
-	key.pid = pid;
-
-	comm = bsearch(&key, pevent->cmdlines, pevent->cmdline_count,
-		       sizeof(*pevent->cmdlines), cmdline_cmp);
+	/* The cmdlines are never freed before the handle */
+	cmdlines_read_lock(pevent);
+	comm = find_cmdline_pid(pevent, pid);
+	cmdlines_unlock(pevent);
 
 	if (comm)
 		return comm->comm;
@@ -209,69 +257,64 @@ static const char *find_cmdline(struct tep_handle *pevent, int pid)
  */
 int tep_pid_is_registered(struct tep_handle *pevent, int pid)
 {
-	const struct cmdline *comm;
-	struct cmdline key;
+	int ret;
 
 	if (!pid)
 		return 1;
 
-	if (!pevent->cmdlines && cmdline_init(pevent))
-		return 0;
+	cmdlines_read_lock(pevent);
+	ret = find_cmdline_pid(pevent, pid) ? 1 : 0;
+	cmdlines_unlock(pevent);
 
-	key.pid = pid;
-
-	comm = bsearch(&key, pevent->cmdlines, pevent->cmdline_count,
-		       sizeof(*pevent->cmdlines), cmdline_cmp);
-
-	if (comm)
-		return 1;
-	return 0;
+	return ret;
 }
 
-/*
- * If the command lines have been converted to an array, then
- * we must add this pid. This is much slower than when cmdlines
- * are added before the array is initialized.
- */
 static int add_new_comm(struct tep_handle *pevent, const char *comm, int pid)
 {
-	struct cmdline *cmdlines = pevent->cmdlines;
-	const struct cmdline *cmdline;
-	struct cmdline key;
-
-	if (!pid)
-		return 0;
+	struct cmdline *cmdline;
+	unsigned int key;
+	int bits;
 
 	/* avoid duplicates */
-	key.pid = pid;
-
-	cmdline = bsearch(&key, pevent->cmdlines, pevent->cmdline_count,
-		       sizeof(*pevent->cmdlines), cmdline_cmp);
-	if (cmdline) {
+	if (find_cmdline_pid(pevent, pid)) {
 		errno = EEXIST;
 		return -1;
 	}
 
-	cmdlines = realloc(cmdlines, sizeof(*cmdlines) * (pevent->cmdline_count + 1));
-	if (!cmdlines) {
+	if (!pevent->cmdlines ||
+	    pevent->cmdline_count >= (1 << pevent->cmdline_bits)) {
+		bits = pevent->cmdlines ? pevent->cmdline_bits + 1 :
+			CMDLINE_HASH_BITS;
+		if (resize_cmdlines(pevent, bits) < 0) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	cmdline = malloc(sizeof(*cmdline));
+	if (!cmdline) {
 		errno = ENOMEM;
 		return -1;
 	}
 
-	cmdlines[pevent->cmdline_count].comm = strdup(comm);
-	if (!cmdlines[pevent->cmdline_count].comm) {
-		free(cmdlines);
+	cmdline->comm = strdup(comm ? comm : "<...>");
+	if (!cmdline->comm) {
+		free(cmdline);
 		errno = ENOMEM;
 		return -1;
 	}
+	cmdline->pid = pid;
+	cmdline->comm_hash = comm_hash(cmdline->comm);
 
-	cmdlines[pevent->cmdline_count].pid = pid;
-		
-	if (cmdlines[pevent->cmdline_count].comm)
-		pevent->cmdline_count++;
+	key = pid_hash(pid, pevent->cmdline_bits);
+	cmdline->next = pevent->cmdlines[key];
+	pevent->cmdlines[key] = cmdline;
 
-	qsort(cmdlines, pevent->cmdline_count, sizeof(*cmdlines), cmdline_cmp);
-	pevent->cmdlines = cmdlines;
+	key = cmdline->comm_hash >> (32 - pevent->cmdline_bits);
+	cmdline->comm_next = pevent->comm_cmdlines[key];
+	pevent->comm_cmdlines[key] = cmdline;
+
+	pevent->cmdline_count++;
 
 	return 0;
 }
@@ -284,33 +327,21 @@ static int add_new_comm(struct tep_handle *pevent, const char *comm, int pid)
  *
  * This adds a mapping to search for command line names with
  * a given pid. The comm is duplicated.
+ *
+ * This may be called on a frozen handle while other threads use it.
+ *
+ * Returns 0 on success, or -1 with errno set to EEXIST if @pid
+ * already has a command line, or to ENOMEM.
  */
 int tep_register_comm(struct tep_handle *pevent, const char *comm, int pid)
 {
-	struct cmdline_list *item;
-
-	if (pevent->cmdlines)
-		return add_new_comm(pevent, comm, pid);
-
-	item = malloc(sizeof(*item));
-	if (!item)
-		return -1;
-
-	if (comm)
-		item->comm = strdup(comm);
-	else
-		item->comm = strdup("<...>");
-	if (!item->comm) {
-		free(item);
-		return -1;
-	}
-	item->pid = pid;
-	item->next = pevent->cmdlist;
+	int ret;
 
-	pevent->cmdlist = item;
-	pevent->cmdline_count++;
+	cmdlines_write_lock(pevent);
+	ret = add_new_comm(pevent, comm, pid);
+	cmdlines_unlock(pevent);
 
-	return 0;
+	return ret;
 }
 
 int tep_register_trace_clock(struct tep_handle *pevent, const char *trace_clock)
@@ -429,9 +460,11 @@ __find_func(struct tep_handle *pevent, unsigned long long addr)
 struct func_resolver {
 	tep_func_resolver_t	*func;
 	void			*priv;
-	struct func_map		map;
 };
 
+/* The resolved function, per thread as the handle may be shared */
+static __thread struct func_map resolver_map;
+
 /**
  * tep_set_function_resolver - set an alternative function resolver
  * @pevent: handle for the pevent
@@ -480,7 +513,7 @@ find_func(struct tep_handle *pevent, unsigned long long addr)
 	if (!pevent->func_resolver)
 		return __find_func(pevent, addr);
 
-	map = &pevent->func_resolver->map;
+	map = &resolver_map;
 	map->mod  = NULL;
 	map->addr = addr;
 	map->func = pevent->func_resolver->func(pevent->func_resolver->priv,
@@ -545,8 +578,14 @@ tep_find_function_address(struct tep_handle *pevent, unsigned long long addr)
 int tep_register_function(struct tep_handle *pevent, char *func,
 			  unsigned long long addr, char *mod)
 {
-	struct func_list *item = malloc(sizeof(*item));
+	struct func_list *item;
 
+	if (pevent->frozen) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	item = malloc(sizeof(*item));
 	if (!item)
 		return -1;
 
@@ -685,9 +724,15 @@ find_printk(struct tep_handle *pevent, unsigned long long addr)
 int tep_register_print_string(struct tep_handle *pevent, const char *fmt,
 			      unsigned long long addr)
 {
-	struct printk_list *item = malloc(sizeof(*item));
+	struct printk_list *item;
 	char *p;
 
+	if (pevent->frozen) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	item = malloc(sizeof(*item));
 	if (!item)
 		return -1;
 
@@ -745,6 +790,34 @@ static struct tep_event_format *alloc_event(void)
 	return calloc(1, sizeof(struct tep_event_format));
 }
 
+/* The ids of the events are small, except for broken files */
+#define MAX_EVENT_IDS	(1 << 16)
+
+static int add_event_id(struct tep_handle *pevent, struct tep_event_format *event)
+{
+	struct tep_event_format **event_ids;
+	int nr;
+
+	if (event->id < 0 || event->id >= MAX_EVENT_IDS)
+		return 0;
+
+	if (event->id >= pevent->nr_event_ids) {
+		nr = event->id + 1;
+		event_ids = realloc(pevent->event_ids, sizeof(*event_ids) * nr);
+		if (!event_ids)
+			return -1;
+		memset(event_ids + pevent->nr_event_ids, 0,
+		       sizeof(*event_ids) * (nr - pevent->nr_event_ids));
+		pevent->event_ids = event_ids;
+		pevent->nr_event_ids = nr;
+	}
+
+	if (!pevent->event_ids[event->id])
+		pevent->event_ids[event->id] = event;
+
+	return 0;
+}
+
 static int add_event(struct tep_handle *pevent, struct tep_event_format *event)
 {
 	int i;
@@ -755,6 +828,9 @@ static int add_event(struct tep_handle *pevent, struct tep_event_format *event)
 
 	pevent->events = events;
 
+	if (add_event_id(pevent, event) < 0)
+		return -1;
+
 	for (i = 0; i < pevent->nr_events; i++) {
 		if (pevent->events[i]->id > event->id)
 			break;
@@ -3399,13 +3475,32 @@ static int get_common_info(struct tep_handle *pevent,
 	return 0;
 }
 
+/*
+ * A size of zero means that the common field was not looked up yet,
+ * and a negative size that the events do not have it.
+ */
+static int resolve_common(struct tep_handle *pevent, const char *name,
+			  int *size, int *offset)
+{
+	if (*size)
+		return *size < 0 ? -1 : 0;
+
+	if (get_common_info(pevent, name, offset, size) < 0) {
+		if (pevent->events)
+			*size = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
 static int __parse_common(struct tep_handle *pevent, void *data,
 			  int *size, int *offset, const char *name)
 {
 	int ret;
 
-	if (!*size) {
-		ret = get_common_info(pevent, name, offset, size);
+	if (*size <= 0) {
+		ret = resolve_common(pevent, name, size, offset);
 		if (ret < 0)
 			return ret;
 	}
@@ -3450,7 +3545,7 @@ static int parse_common_lock_depth(struct tep_handle *pevent, void *data)
 static int parse_common_migrate_disable(struct tep_handle *pevent, void *data)
 {
 	return __parse_common(pevent, data,
-			      &pevent->ld_size, &pevent->ld_offset,
+			      &pevent->md_size, &pevent->md_offset,
 			      "common_migrate_disable");
 }
 
@@ -3469,21 +3564,19 @@ struct tep_event_format *tep_find_event(struct tep_handle *pevent, int id)
 	struct tep_event_format key;
 	struct tep_event_format *pkey = &key;
 
-	/* Check cache first */
-	if (pevent->last_event && pevent->last_event->id == id)
-		return pevent->last_event;
+	/* All the events with small ids are in event_ids */
+	if (id >= 0 && id < MAX_EVENT_IDS) {
+		if (id >= pevent->nr_event_ids)
+			return NULL;
+		return pevent->event_ids[id];
+	}
 
 	key.id = id;
 
 	eventptr = bsearch(&pkey, pevent->events, pevent->nr_events,
 			   sizeof(*pevent->events), events_id_cmp);
 
-	if (eventptr) {
-		pevent->last_event = *eventptr;
-		return *eventptr;
-	}
-
-	return NULL;
+	return eventptr ? *eventptr : NULL;
 }
 
 /**
@@ -3502,11 +3595,6 @@ tep_find_event_by_name(struct tep_handle *pevent,
 	struct tep_event_format *event;
 	int i;
 
-	if (pevent->last_event &&
-	    strcmp(pevent->last_event->name, name) == 0 &&
-	    (!sys || strcmp(pevent->last_event->system, sys) == 0))
-		return pevent->last_event;
-
 	for (i = 0; i < pevent->nr_events; i++) {
 		event = pevent->events[i];
 		if (strcmp(event->name, name) == 0) {
@@ -3519,7 +3607,6 @@ tep_find_event_by_name(struct tep_handle *pevent,
 	if (i == pevent->nr_events)
 		event = NULL;
 
-	pevent->last_event = event;
 	return event;
 }
 
@@ -4867,18 +4954,83 @@ void tep_print_fields(struct trace_seq *s, void *data,
 	}
 }
 
-static void pretty_print(struct trace_seq *s, void *data, int size, struct tep_event_format *event)
+/*
+ * The print args look up their fields at the first record that is
+ * printed. Look them all up now instead.
+ */
+static void resolve_arg_fields(struct tep_event_format *event,
+			       struct tep_print_arg *arg)
+{
+	struct tep_format_field *field;
+
+	for (; arg; arg = arg->next) {
+		switch (arg->type) {
+		case TEP_PRINT_FIELD:
+			if (!arg->field.field)
+				arg->field.field = tep_find_any_field(event,
+								      arg->field.name);
+			break;
+		case TEP_PRINT_FLAGS:
+			resolve_arg_fields(event, arg->flags.field);
+			break;
+		case TEP_PRINT_SYMBOL:
+			resolve_arg_fields(event, arg->symbol.field);
+			break;
+		case TEP_PRINT_HEX:
+		case TEP_PRINT_HEX_STR:
+			resolve_arg_fields(event, arg->hex.field);
+			resolve_arg_fields(event, arg->hex.size);
+			break;
+		case TEP_PRINT_INT_ARRAY:
+			resolve_arg_fields(event, arg->int_array.field);
+			resolve_arg_fields(event, arg->int_array.count);
+			resolve_arg_fields(event, arg->int_array.el_size);
+			break;
+		case TEP_PRINT_TYPE:
+			resolve_arg_fields(event, arg->typecast.item);
+			break;
+		case TEP_PRINT_STRING:
+			if (arg->string.offset != -1)
+				break;
+			field = tep_find_any_field(event, arg->string.string);
+			if (field)
+				arg->string.offset = field->offset;
+			break;
+		case TEP_PRINT_BITMASK:
+			if (arg->bitmask.offset != -1)
+				break;
+			field = tep_find_any_field(event, arg->bitmask.bitmask);
+			if (field)
+				arg->bitmask.offset = field->offset;
+			break;
+		case TEP_PRINT_OP:
+			resolve_arg_fields(event, arg->op.left);
+			resolve_arg_fields(event, arg->op.right);
+			break;
+		case TEP_PRINT_FUNC:
+			resolve_arg_fields(event, arg->func.args);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/*
+ * Print the format from @ptr, up to @end or to its end if @end is NULL,
+ * with the args starting at @arg.
+ *
+ * Returns -1 if the event failed to parse, 0 otherwise.
+ */
+static int print_fmt_args(struct trace_seq *s, void *data, int size,
+			  struct tep_event_format *event, const char *ptr,
+			  const char *end, struct tep_print_arg *arg)
 {
 	struct tep_handle *pevent = event->pevent;
-	struct tep_print_fmt *print_fmt = &event->print_fmt;
-	struct tep_print_arg *arg = print_fmt->args;
-	struct tep_print_arg *args = NULL;
-	const char *ptr = print_fmt->format;
 	unsigned long long val;
 	struct func_map *func;
 	const char *saveptr;
 	struct trace_seq p;
-	char *bprint_fmt = NULL;
 	char format[32];
 	int show_func;
 	int len_as_arg;
@@ -4886,20 +5038,7 @@ static void pretty_print(struct trace_seq *s, void *data, int size, struct tep_e
 	int len;
 	int ls;
 
-	if (event->flags & TEP_EVENT_FL_FAILED) {
-		trace_seq_printf(s, "[FAILED TO PARSE]");
-		tep_print_fields(s, data, size, event);
-		return;
-	}
-
-	if (event->flags & TEP_EVENT_FL_ISBPRINT) {
-		bprint_fmt = get_bprint_format(data, size, event);
-		args = make_bprint_args(bprint_fmt, data, size, event);
-		arg = args;
-		ptr = bprint_fmt;
-	}
-
-	for (; *ptr; ptr++) {
+	for (; *ptr && ptr != end; ptr++) {
 		ls = 0;
 		if (*ptr == '\\') {
 			ptr++;
@@ -5118,15 +5257,441 @@ static void pretty_print(struct trace_seq *s, void *data, int size, struct tep_e
 			trace_seq_putc(s, *ptr);
 	}
 
-	if (event->flags & TEP_EVENT_FL_FAILED) {
+	return 0;
+
 out_failed:
+	return -1;
+}
+
+/*
+ * The print format of an event is compiled into a list of instructions
+ * the first time it is printed, with its text and its simple integer
+ * and string conversions resolved. The other conversions are printed
+ * by print_fmt_args().
+ */
+enum print_insn_type {
+	PRINT_INSN_TEXT,	/* constant text */
+	PRINT_INSN_NUM,		/* %d, %u, %x or %X of a number */
+	PRINT_INSN_STR,		/* %s of a string field or of __get_str() */
+	PRINT_INSN_FMT,		/* any other conversion */
+};
+
+struct print_insn {
+	enum print_insn_type		type;
+	struct tep_print_arg		*arg;
+	/* the field of @arg, resolved for a faster read */
+	struct tep_format_field		*field;
+	union {
+		struct {
+			const char	*text;
+			int		len;
+		} text;
+		struct {
+			int		ls;
+			int		width;
+			char		conv;
+			char		zero;
+		} num;
+		struct {
+			/* the conversion in the format, NULL end for the rest */
+			const char	*start;
+			const char	*end;
+		} fmt;
+	};
+};
+
+struct tep_print_prog {
+	struct print_insn	*insns;
+	int			nr_insns;
+	char			*text;
+};
+
+static void free_print_prog(struct tep_print_prog *prog)
+{
+	if (!prog)
+		return;
+
+	free(prog->insns);
+	free(prog->text);
+	free(prog);
+}
+
+static struct print_insn *add_print_insn(struct tep_print_prog *prog,
+					 enum print_insn_type type)
+{
+	struct print_insn *insns;
+
+	insns = realloc(prog->insns, (prog->nr_insns + 1) * sizeof(*insns));
+	if (!insns)
+		return NULL;
+
+	prog->insns = insns;
+	insns += prog->nr_insns++;
+	memset(insns, 0, sizeof(*insns));
+	insns->type = type;
+
+	return insns;
+}
+
+/* Emit the text from @start up to @end, that was not emitted yet */
+static int flush_print_text(struct tep_print_prog *prog, char **start,
+			    char *end)
+{
+	struct print_insn *insn;
+
+	if (end == *start)
+		return 0;
+
+	insn = add_print_insn(prog, PRINT_INSN_TEXT);
+	if (!insn)
+		return -1;
+
+	insn->text.text = *start;
+	insn->text.len = end - *start;
+	*start = end;
+
+	return 0;
+}
+
+/*
+ * Parse "%[0][width][hh|h|l|ll]<conv>" from @ptr. Returns the pointer
+ * to the conversion character, or NULL if the conversion is not that
+ * simple.
+ */
+static const char *parse_simple_conv(const char *ptr, struct print_insn *insn)
+{
+	char mod;
+
+	ptr++;
+	if (*ptr == '0') {
+		insn->num.zero = 1;
+		ptr++;
+	}
+
+	while (isdigit(*ptr)) {
+		insn->num.width = insn->num.width * 10 + *ptr - '0';
+		if (insn->num.width > 64)
+			return NULL;
+		ptr++;
+	}
+
+	if (*ptr == 'h' || *ptr == 'l') {
+		/* Only %hhd, %hd, %ld and %lld */
+		mod = *ptr;
+		while (*ptr == mod) {
+			insn->num.ls += mod == 'h' ? -1 : 1;
+			ptr++;
+		}
+	}
+
+	if (insn->num.ls < -2 || insn->num.ls > 2)
+		return NULL;
+
+	insn->num.conv = *ptr;
+
+	return ptr;
+}
+
+static struct tep_print_prog *compile_print_fmt(struct tep_event_format *event)
+{
+	struct tep_handle *pevent = event->pevent;
+	struct tep_print_arg *arg = event->print_fmt.args;
+	struct tep_print_prog *prog;
+	struct print_insn *insn;
+	struct print_insn conv;
+	const char *ptr = event->print_fmt.format;
+	const char *saveptr;
+	const char *end;
+	char *text, *next;
+	int nr_args;
+	int i;
+
+	resolve_arg_fields(event, arg);
+
+	prog = calloc(1, sizeof(*prog));
+	if (!prog)
+		return NULL;
+
+	/* The text can only shrink, with its escapes handled */
+	prog->text = malloc(strlen(ptr) + 1);
+	if (!prog->text)
+		goto fail;
+
+	text = next = prog->text;
+
+	for (; *ptr; ptr++) {
+		if (*ptr == '\\') {
+			if (!ptr[1])
+				break;
+			ptr++;
+			switch (*ptr) {
+			case 'n':
+				*next++ = '\n';
+				break;
+			case 't':
+				*next++ = '\t';
+				break;
+			case 'r':
+				*next++ = '\r';
+				break;
+			default:
+				*next++ = *ptr;
+				break;
+			}
+			continue;
+		}
+
+		if (*ptr != '%') {
+			*next++ = *ptr;
+			continue;
+		}
+
+		if (ptr[1] == '%') {
+			*next++ = '%';
+			ptr++;
+			continue;
+		}
+
+		/* Find the end of the conversion, as print_fmt_args() does */
+		saveptr = ptr;
+		nr_args = 0;
+		for (end = ptr + 1; *end && strchr("#hlL*.zZ0123456789-", *end); end++)
+			if (*end == '*')
+				nr_args++;
+
+		/* %p may use more of the format, leave the rest as is */
+		if (!*end || *end == 'p')
+			break;
+
+		if (strchr("diuxXs", *end))
+			nr_args++;
+
+		/* Not enough args, let print_fmt_args() fail */
+		for (i = 0, conv.arg = arg; i < nr_args; i++) {
+			if (!conv.arg)
+				break;
+			conv.arg = conv.arg->next;
+		}
+		if (i < nr_args)
+			break;
+
+		if (flush_print_text(prog, &text, next) < 0)
+			goto fail;
+
+		memset(&conv, 0, sizeof(conv));
+		conv.arg = arg;
+		ptr = parse_simple_conv(saveptr, &conv);
+
+		if (ptr == end && strchr("diuxX", *end)) {
+			conv.type = PRINT_INSN_NUM;
+			/* make %l into %ll, as print_fmt_args() does */
+			if (pevent->long_size == 8 && conv.num.ls == 1 &&
+			    sizeof(long) != 8)
+				conv.num.ls = 2;
+			if (arg->type == TEP_PRINT_FIELD)
+				conv.field = arg->field.field;
+
+		} else if (ptr == end && *end == 's' && end == saveptr + 1 &&
+			   ((arg->type == TEP_PRINT_STRING &&
+			     arg->string.offset != -1) ||
+			    (arg->type == TEP_PRINT_FIELD && arg->field.field &&
+			     ((arg->field.field->flags & TEP_FIELD_IS_ARRAY) ||
+			      arg->field.field->size != pevent->long_size)))) {
+			/* Not a pointer, that print_str_arg() looks up */
+			conv.type = PRINT_INSN_STR;
+			if (arg->type == TEP_PRINT_FIELD)
+				conv.field = arg->field.field;
+
+		} else {
+			conv.type = PRINT_INSN_FMT;
+			conv.fmt.start = saveptr;
+			conv.fmt.end = end + 1;
+		}
+
+		insn = add_print_insn(prog, conv.type);
+		if (!insn)
+			goto fail;
+		*insn = conv;
+
+		ptr = end;
+		for (i = 0; i < nr_args; i++)
+			arg = arg->next;
+	}
+
+	if (flush_print_text(prog, &text, next) < 0)
+		goto fail;
+
+	/* Print what could not be compiled with the args left */
+	if (*ptr) {
+		insn = add_print_insn(prog, PRINT_INSN_FMT);
+		if (!insn)
+			goto fail;
+		insn->arg = arg;
+		insn->fmt.start = ptr;
+	}
+
+	return prog;
+
+fail:
+	free_print_prog(prog);
+	return NULL;
+}
+
+static void print_num_insn(struct trace_seq *s, struct print_insn *insn,
+			   unsigned long long val)
+{
+	static const char lower[] = "0123456789abcdef";
+	static const char upper[] = "0123456789ABCDEF";
+	const char *digits = insn->num.conv == 'X' ? upper : lower;
+	int base = (insn->num.conv == 'x' || insn->num.conv == 'X') ? 16 : 10;
+	int is_signed = insn->num.conv == 'd' || insn->num.conv == 'i';
+	char buf[24];
+	char *p = buf + sizeof(buf);
+	int neg = 0;
+	int len;
+
+	/* Cast the value like the arg of a printf() with the same format */
+	switch (insn->num.ls) {
+	case -2:
+		val = is_signed ? (long long)(signed char)val :
+			(unsigned char)val;
+		break;
+	case -1:
+		val = is_signed ? (long long)(short)val :
+			(unsigned short)val;
+		break;
+	case 0:
+		val = is_signed ? (long long)(int)val : (unsigned int)val;
+		break;
+	case 1:
+		val = is_signed ? (long long)(long)val : (unsigned long)val;
+		break;
+	}
+
+	if (is_signed && (long long)val < 0) {
+		neg = 1;
+		val = -val;
+	}
+
+	do {
+		*--p = digits[val % base];
+		val /= base;
+	} while (val);
+
+	len = buf + sizeof(buf) - p + neg;
+
+	if (insn->num.zero) {
+		if (neg)
+			trace_seq_putc(s, '-');
+		for (; len < insn->num.width; len++)
+			trace_seq_putc(s, '0');
+	} else {
+		for (; len < insn->num.width; len++)
+			trace_seq_putc(s, ' ');
+		if (neg)
+			trace_seq_putc(s, '-');
+	}
+
+	trace_seq_putmem(s, p, buf + sizeof(buf) - p);
+}
+
+static void print_str_insn(struct trace_seq *s, struct print_insn *insn,
+			   void *data, int size, struct tep_handle *pevent)
+{
+	struct tep_format_field *field = insn->field;
+	unsigned int offset;
+	int len;
+
+	if (!field) {
+		/* __get_str() */
+		offset = tep_data2host4(pevent, data + insn->arg->string.offset);
+		trace_seq_puts(s, (char *)data + (offset & 0xffff));
+		return;
+	}
+
+	/* Zero sized fields, mean the rest of the data */
+	len = field->size ? : size - field->offset;
+	if (len <= 0)
+		return;
+
+	trace_seq_putmem(s, data + field->offset,
+			 strnlen(data + field->offset, len));
+}
+
+static int run_print_prog(struct trace_seq *s, void *data, int size,
+			  struct tep_event_format *event,
+			  struct tep_print_prog *prog)
+{
+	struct tep_handle *pevent = event->pevent;
+	struct print_insn *insn;
+	unsigned long long val;
+	int i;
+
+	for (i = 0; i < prog->nr_insns; i++) {
+		insn = &prog->insns[i];
+
+		switch (insn->type) {
+		case PRINT_INSN_TEXT:
+			trace_seq_putmem(s, insn->text.text, insn->text.len);
+			break;
+		case PRINT_INSN_NUM:
+			if (insn->field)
+				val = tep_read_number(pevent,
+						      data + insn->field->offset,
+						      insn->field->size);
+			else
+				val = eval_num_arg(data, size, event, insn->arg);
+			print_num_insn(s, insn, val);
+			break;
+		case PRINT_INSN_STR:
+			print_str_insn(s, insn, data, size, pevent);
+			break;
+		case PRINT_INSN_FMT:
+			if (print_fmt_args(s, data, size, event, insn->fmt.start,
+					   insn->fmt.end, insn->arg) < 0)
+				return -1;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static void pretty_print(struct trace_seq *s, void *data, int size, struct tep_event_format *event)
+{
+	struct tep_print_fmt *print_fmt = &event->print_fmt;
+	struct tep_print_arg *args;
+	char *bprint_fmt;
+
+	if (event->flags & TEP_EVENT_FL_FAILED) {
 		trace_seq_printf(s, "[FAILED TO PARSE]");
+		tep_print_fields(s, data, size, event);
+		return;
 	}
 
-	if (args) {
-		free_args(args);
-		free(bprint_fmt);
+	if (event->flags & TEP_EVENT_FL_ISBPRINT) {
+		/* The format is in the record */
+		bprint_fmt = get_bprint_format(data, size, event);
+		args = make_bprint_args(bprint_fmt, data, size, event);
+		print_fmt_args(s, data, size, event, bprint_fmt, NULL, args);
+		if (args) {
+			free_args(args);
+			free(bprint_fmt);
+		}
+	} else {
+		/* A frozen handle had all its print formats compiled */
+		if (!print_fmt->prog && !event->pevent->frozen)
+			print_fmt->prog = compile_print_fmt(event);
+
+		if (print_fmt->prog)
+			run_print_prog(s, data, size, event, print_fmt->prog);
+		else
+			print_fmt_args(s, data, size, event, print_fmt->format,
+				       NULL, print_fmt->args);
 	}
+
+	if (event->flags & TEP_EVENT_FL_FAILED)
+		trace_seq_printf(s, "[FAILED TO PARSE]");
 }
 
 /**
@@ -5142,10 +5707,6 @@ out_failed:
 void tep_data_lat_fmt(struct tep_handle *pevent,
 		      struct trace_seq *s, struct tep_record *record)
 {
-	static int check_lock_depth = 1;
-	static int check_migrate_disable = 1;
-	static int lock_depth_exists;
-	static int migrate_disable_exists;
 	unsigned int lat_flags;
 	unsigned int pc;
 	int lock_depth;
@@ -5156,27 +5717,9 @@ void tep_data_lat_fmt(struct tep_handle *pevent,
 
 	lat_flags = parse_common_flags(pevent, data);
 	pc = parse_common_pc(pevent, data);
-	/* lock_depth may not always exist */
-	if (lock_depth_exists)
-		lock_depth = parse_common_lock_depth(pevent, data);
-	else if (check_lock_depth) {
-		lock_depth = parse_common_lock_depth(pevent, data);
-		if (lock_depth < 0)
-			check_lock_depth = 0;
-		else
-			lock_depth_exists = 1;
-	}
-
-	/* migrate_disable may not always exist */
-	if (migrate_disable_exists)
-		migrate_disable = parse_common_migrate_disable(pevent, data);
-	else if (check_migrate_disable) {
-		migrate_disable = parse_common_migrate_disable(pevent, data);
-		if (migrate_disable < 0)
-			check_migrate_disable = 0;
-		else
-			migrate_disable_exists = 1;
-	}
+	/* lock_depth and migrate_disable may not always exist */
+	lock_depth = parse_common_lock_depth(pevent, data);
+	migrate_disable = parse_common_migrate_disable(pevent, data);
 
 	hardirq = lat_flags & TRACE_FLAG_HARDIRQ;
 	softirq = lat_flags & TRACE_FLAG_SOFTIRQ;
@@ -5195,14 +5738,14 @@ void tep_data_lat_fmt(struct tep_handle *pevent,
 	else
 		trace_seq_putc(s, '.');
 
-	if (migrate_disable_exists) {
+	if (pevent->md_size > 0) {
 		if (migrate_disable < 0)
 			trace_seq_putc(s, '.');
 		else
 			trace_seq_printf(s, "%d", migrate_disable);
 	}
 
-	if (lock_depth_exists) {
+	if (pevent->ld_size > 0) {
 		if (lock_depth < 0)
 			trace_seq_putc(s, '.');
 		else
@@ -5290,22 +5833,6 @@ const char *tep_data_comm_from_pid(struct tep_handle *pevent, int pid)
 	return comm;
 }
 
-static struct cmdline *
-pid_from_cmdlist(struct tep_handle *pevent, const char *comm, struct cmdline *next)
-{
-	struct cmdline_list *cmdlist = (struct cmdline_list *)next;
-
-	if (cmdlist)
-		cmdlist = cmdlist->next;
-	else
-		cmdlist = pevent->cmdlist;
-
-	while (cmdlist && strcmp(cmdlist->comm, comm) != 0)
-		cmdlist = cmdlist->next;
-
-	return (struct cmdline *)cmdlist;
-}
-
 /**
  * tep_data_pid_from_comm - return the pid from a given comm
  * @pevent: a handle to the pevent
@@ -5317,41 +5844,29 @@ pid_from_cmdlist(struct tep_handle *pevent, const char *comm, struct cmdline *ne
  * a given comm, the result of this call can be passed back into
  * a recurring call in the @next paramater, and then it will find the
  * next pid.
- * Also, it does a linear seach, so it may be slow.
  */
 struct cmdline *tep_data_pid_from_comm(struct tep_handle *pevent, const char *comm,
 				       struct cmdline *next)
 {
 	struct cmdline *cmdline;
 
-	/*
-	 * If the cmdlines have not been converted yet, then use
-	 * the list.
-	 */
-	if (!pevent->cmdlines)
-		return pid_from_cmdlist(pevent, comm, next);
+	cmdlines_read_lock(pevent);
 
-	if (next) {
-		/*
-		 * The next pointer could have been still from
-		 * a previous call before cmdlines were created
-		 */
-		if (next < pevent->cmdlines ||
-		    next >= pevent->cmdlines + pevent->cmdline_count)
-			next = NULL;
-		else
-			cmdline  = next++;
-	}
+	if (!pevent->comm_cmdlines)
+		cmdline = NULL;
+	else if (next)
+		cmdline = next->comm_next;
+	else
+		cmdline = pevent->comm_cmdlines[comm_hash(comm) >>
+						(32 - pevent->cmdline_bits)];
 
-	if (!next)
-		cmdline = pevent->cmdlines;
+	/* Other comms may be in the same bucket */
+	while (cmdline && strcmp(cmdline->comm, comm) != 0)
+		cmdline = cmdline->comm_next;
 
-	while (cmdline < pevent->cmdlines + pevent->cmdline_count) {
-		if (strcmp(cmdline->comm, comm) == 0)
-			return cmdline;
-		cmdline++;
-	}
-	return NULL;
+	cmdlines_unlock(pevent);
+
+	return cmdline;
 }
 
 /**
@@ -5363,20 +5878,9 @@ struct cmdline *tep_data_pid_from_comm(struct tep_handle *pevent, const char *co
  */
 int tep_cmdline_pid(struct tep_handle *pevent, struct cmdline *cmdline)
 {
-	struct cmdline_list *cmdlist = (struct cmdline_list *)cmdline;
-
 	if (!cmdline)
 		return -1;
 
-	/*
-	 * If cmdlines have not been created yet, or cmdline is
-	 * not part of the array, then treat it as a cmdlist instead.
-	 */
-	if (!pevent->cmdlines ||
-	    cmdline < pevent->cmdlines ||
-	    cmdline >= pevent->cmdlines + pevent->cmdline_count)
-		return cmdlist->pid;
-
 	return cmdline->pid;
 }
 
@@ -6138,9 +6642,17 @@ __parse_event(struct tep_handle *pevent,
 	      const char *buf, unsigned long size,
 	      const char *sys)
 {
-	int ret = __tep_parse_format(eventp, pevent, buf, size, sys);
-	struct tep_event_format *event = *eventp;
+	struct tep_event_format *event;
+	int ret;
+
+	/* The events can not be added while other threads look them up */
+	if (pevent && pevent->frozen) {
+		*eventp = NULL;
+		return TEP_ERRNO__HANDLE_FROZEN;
+	}
 
+	ret = __tep_parse_format(eventp, pevent, buf, size, sys);
+	event = *eventp;
 	if (event == NULL)
 		return ret;
 
@@ -6750,8 +7262,15 @@ struct tep_handle *tep_alloc(void)
 {
 	struct tep_handle *pevent = calloc(1, sizeof(*pevent));
 
-	if (pevent)
-		pevent->ref_count = 1;
+	if (!pevent)
+		return NULL;
+
+	if (pthread_rwlock_init(&pevent->cmdlines_lock, NULL) != 0) {
+		free(pevent);
+		return NULL;
+	}
+
+	pevent->ref_count = 1;
 
 	return pevent;
 }
@@ -6796,6 +7315,7 @@ void tep_free_format(struct tep_event_format *event)
 
 	free(event->print_fmt.format);
 	free_args(event->print_fmt.args);
+	free_print_prog(event->print_fmt.prog);
 
 	free(event);
 }
@@ -6806,7 +7326,7 @@ void tep_free_format(struct tep_event_format *event)
  */
 void tep_free(struct tep_handle *pevent)
 {
-	struct cmdline_list *cmdlist, *cmdnext;
+	struct cmdline *cmdline, *cmdnext;
 	struct func_list *funclist, *funcnext;
 	struct printk_list *printklist, *printknext;
 	struct tep_function_handler *func_handler;
@@ -6816,7 +7336,6 @@ void tep_free(struct tep_handle *pevent)
 	if (!pevent)
 		return;
 
-	cmdlist = pevent->cmdlist;
 	funclist = pevent->funclist;
 	printklist = pevent->printklist;
 
@@ -6824,18 +7343,16 @@ void tep_free(struct tep_handle *pevent)
 	if (pevent->ref_count)
 		return;
 
-	if (pevent->cmdlines) {
-		for (i = 0; i < pevent->cmdline_count; i++)
-			free(pevent->cmdlines[i].comm);
-		free(pevent->cmdlines);
-	}
-
-	while (cmdlist) {
-		cmdnext = cmdlist->next;
-		free(cmdlist->comm);
-		free(cmdlist);
-		cmdlist = cmdnext;
+	for (i = 0; pevent->cmdlines && i < (1 << pevent->cmdline_bits); i++) {
+		for (cmdline = pevent->cmdlines[i]; cmdline; cmdline = cmdnext) {
+			cmdnext = cmdline->next;
+			free(cmdline->comm);
+			free(cmdline);
+		}
 	}
+	free(pevent->cmdlines);
+	free(pevent->comm_cmdlines);
+	pthread_rwlock_destroy(&pevent->cmdlines_lock);
 
 	if (pevent->func_map) {
 		for (i = 0; i < (int)pevent->func_count; i++) {
@@ -6883,6 +7400,7 @@ void tep_free(struct tep_handle *pevent)
 
 	free(pevent->trace_clock);
 	free(pevent->events);
+	free(pevent->event_ids);
 	free(pevent->sort_events);
 	free(pevent->func_resolver);
 
@@ -6893,3 +7411,91 @@ void tep_unref(struct tep_handle *pevent)
 {
 	tep_free(pevent);
 }
+
+/**
+ * tep_freeze - make a pevent handle read only
+ * @pevent: the pevent handle to freeze
+ *
+ * The handle looks up the common fields of the records, the fields
+ * of the print formats, compiles the print formats and sorts its
+ * functions and strings the first time they are needed. This does it all now, so that the records can
+ * be parsed and printed by several threads sharing @pevent.
+ *
+ * Once frozen, no events, functions or print strings can be added to
+ * the handle until tep_thaw() is called. The comms can still be
+ * registered by any thread.
+ *
+ * Returns 0 on success, or -1 on failure to allocate memory.
+ */
+int tep_freeze(struct tep_handle *pevent)
+{
+	struct tep_event_format *event;
+	struct tep_format_field *field;
+	int i;
+
+	if (pevent->frozen)
+		return 0;
+
+	if (!pevent->func_map && func_map_init(pevent) < 0)
+		return -1;
+
+	if (!pevent->printk_map && printk_map_init(pevent) < 0)
+		return -1;
+
+	if (pevent->events) {
+		resolve_common(pevent, "common_type",
+			       &pevent->type_size, &pevent->type_offset);
+		resolve_common(pevent, "common_pid",
+			       &pevent->pid_size, &pevent->pid_offset);
+		resolve_common(pevent, "common_preempt_count",
+			       &pevent->pc_size, &pevent->pc_offset);
+		resolve_common(pevent, "common_flags",
+			       &pevent->flags_size, &pevent->flags_offset);
+		resolve_common(pevent, "common_lock_depth",
+			       &pevent->ld_size, &pevent->ld_offset);
+		resolve_common(pevent, "common_migrate_disable",
+			       &pevent->md_size, &pevent->md_offset);
+	}
+
+	for (i = 0; i < pevent->nr_events; i++) {
+		event = pevent->events[i];
+
+		resolve_arg_fields(event, event->print_fmt.args);
+
+		if (!(event->flags & TEP_EVENT_FL_ISBPRINT)) {
+			if (event->flags & TEP_EVENT_FL_FAILED ||
+			    event->print_fmt.prog)
+				continue;
+			event->print_fmt.prog = compile_print_fmt(event);
+			if (!event->print_fmt.prog)
+				return -1;
+			continue;
+		}
+
+		if (!pevent->bprint_fmt_field)
+			pevent->bprint_fmt_field = tep_find_field(event, "fmt");
+
+		if (!pevent->bprint_buf_field) {
+			field = tep_find_field(event, "buf");
+			pevent->bprint_ip_field = tep_find_field(event, "ip");
+			if (pevent->bprint_ip_field)
+				pevent->bprint_buf_field = field;
+		}
+	}
+
+	pevent->frozen = 1;
+
+	return 0;
+}
+
+/**
+ * tep_thaw - make a frozen pevent handle writable again
+ * @pevent: the pevent handle to thaw
+ *
+ * This must only be called once no other thread uses @pevent.
+ * What tep_freeze() resolved stays resolved.
+ */
+void tep_thaw(struct tep_handle *pevent)
+{
+	pevent->frozen = 0;
+}
@@ -23,6 +23,10 @@ enum {
 
 #define ENDIAN_MASK (KBUFFER_FL_HOST_BIG_ENDIAN | KBUFFER_FL_BIG_ENDIAN)
 
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+
 /** kbuffer
  * @timestamp		- timestamp of current event
  * @lost_events		- # of lost events between this subbuffer and previous
@@ -39,6 +43,8 @@ enum {
  * @read_4		- Function to read 4 raw bytes (may swap)
  * @read_8		- Function to read 8 raw bytes (may swap)
  * @read_long		- Function to read a long word (4 or 8 bytes with needed swap)
+ * @next_event		- Function to move to the next event
+ * @decode_events	- Function to decode all events of the subbuffer
  */
 struct kbuffer {
 	unsigned long long 	timestamp;
@@ -56,6 +62,8 @@ struct kbuffer {
 	unsigned long long (*read_8)(void *ptr);
 	unsigned long long (*read_long)(struct kbuffer *kbuf, void *ptr);
 	int (*next_event)(struct kbuffer *kbuf);
+	int (*decode_events)(struct kbuffer *kbuf,
+			     struct kbuffer_event *events, int max);
 };
 
 static void *zmalloc(size_t size)
@@ -152,7 +160,9 @@ static int calc_index(struct kbuffer *kbuf, void *ptr)
 	return (unsigned long)ptr - (unsigned long)kbuf->data;
 }
 
-static int __next_event(struct kbuffer *kbuf);
+static int __old_decode_events(struct kbuffer *kbuf,
+			       struct kbuffer_event *events, int max);
+static void set_fast_path(struct kbuffer *kbuf);
 
 /**
  * kbuffer_alloc - allocat a new kbuffer
@@ -210,7 +220,7 @@ kbuffer_alloc(enum kbuffer_long_size size, enum kbuffer_endian endian)
 		kbuf->read_long = __read_long_4;
 
 	/* May be changed by kbuffer_set_old_format() */
-	kbuf->next_event = __next_event;
+	set_fast_path(kbuf);
 
 	return kbuf;
 }
@@ -243,15 +253,6 @@ static unsigned int len4host(struct kbuffer *kbuf,
 		return (type_len_ts >> 2) & 7;
 }
 
-static unsigned int type_len4host(struct kbuffer *kbuf,
-				  unsigned int type_len_ts)
-{
-	if (kbuf->flags & KBUFFER_FL_BIG_ENDIAN)
-		return (type_len_ts >> 27) & ((1 << 5) - 1);
-	else
-		return type_len_ts & ((1 << 5) - 1);
-}
-
 static unsigned int ts4host(struct kbuffer *kbuf,
 			    unsigned int type_len_ts)
 {
@@ -341,27 +342,37 @@ static int __old_next_event(struct kbuffer *kbuf)
 	return 0;
 }
 
-static unsigned int
-translate_data(struct kbuffer *kbuf, void *data, void **rptr,
-	       unsigned long long *delta, int *length)
+/*
+ * Decode the header of the event at @data. This is the innermost loop of
+ * all readers, hence it is always inlined, with @swap and @big_endian known
+ * at compile time whenever possible.
+ */
+static __always_inline unsigned int
+__translate_data(void *data, void **rptr, unsigned long long *delta,
+		 int *length, int swap, int big_endian)
 {
 	unsigned long long extend;
 	unsigned int type_len_ts;
 	unsigned int type_len;
 
-	type_len_ts = read_4(kbuf, data);
+	type_len_ts = swap ? __read_4_sw(data) : __read_4(data);
 	data += 4;
 
-	type_len = type_len4host(kbuf, type_len_ts);
-	*delta = ts4host(kbuf, type_len_ts);
+	if (big_endian) {
+		type_len = (type_len_ts >> 27) & ((1 << 5) - 1);
+		*delta = type_len_ts & ((1 << 27) - 1);
+	} else {
+		type_len = type_len_ts & ((1 << 5) - 1);
+		*delta = type_len_ts >> 5;
+	}
 
 	switch (type_len) {
 	case KBUFFER_TYPE_PADDING:
-		*length = read_4(kbuf, data);
+		*length = swap ? __read_4_sw(data) : __read_4(data);
 		break;
 
 	case KBUFFER_TYPE_TIME_EXTEND:
-		extend = read_4(kbuf, data);
+		extend = swap ? __read_4_sw(data) : __read_4(data);
 		data += 4;
 		extend <<= TS_SHIFT;
 		extend += *delta;
@@ -374,7 +385,7 @@ translate_data(struct kbuffer *kbuf, void *data, void **rptr,
 		*length = 0;
 		break;
 	case 0:
-		*length = read_4(kbuf, data) - 4;
+		*length = (swap ? __read_4_sw(data) : __read_4(data)) - 4;
 		*length = (*length + 3) & ~3;
 		data += 4;
 		break;
@@ -388,20 +399,12 @@ translate_data(struct kbuffer *kbuf, void *data, void **rptr,
 	return type_len;
 }
 
-static unsigned int update_pointers(struct kbuffer *kbuf)
+static unsigned int
+translate_data(struct kbuffer *kbuf, void *data, void **rptr,
+	       unsigned long long *delta, int *length)
 {
-	unsigned long long delta;
-	unsigned int type_len;
-	int length;
-	void *ptr = kbuf->data + kbuf->curr;
-
-	type_len = translate_data(kbuf, ptr, &ptr, &delta, &length);
-
-	kbuf->timestamp += delta;
-	kbuf->index = calc_index(kbuf, ptr);
-	kbuf->next = kbuf->index + length;
-
-	return type_len;
+	return __translate_data(data, rptr, delta, length, do_swap(kbuf),
+				kbuf->flags & KBUFFER_FL_BIG_ENDIAN);
 }
 
 /**
@@ -417,22 +420,20 @@ static unsigned int update_pointers(struct kbuffer *kbuf)
 void *kbuffer_translate_data(int swap, void *data, unsigned int *size)
 {
 	unsigned long long delta;
-	struct kbuffer kbuf;
+	int big_endian;
 	int type_len;
 	int length;
 	void *ptr;
 
-	if (swap) {
-		kbuf.read_8 = __read_8_sw;
-		kbuf.read_4 = __read_4_sw;
-		kbuf.flags = host_is_bigendian() ? 0 : KBUFFER_FL_BIG_ENDIAN;
-	} else {
-		kbuf.read_8 = __read_8;
-		kbuf.read_4 = __read_4;
-		kbuf.flags = host_is_bigendian() ? KBUFFER_FL_BIG_ENDIAN: 0;
-	}
+	/* The data is big endian if it is swapped on a little endian host */
+	big_endian = swap ? !host_is_bigendian() : host_is_bigendian();
 
-	type_len = translate_data(&kbuf, data, &ptr, &delta, &length);
+	if (swap)
+		type_len = __translate_data(data, &ptr, &delta, &length,
+					    1, big_endian);
+	else
+		type_len = __translate_data(data, &ptr, &delta, &length,
+					    0, big_endian);
 	switch (type_len) {
 	case KBUFFER_TYPE_PADDING:
 	case KBUFFER_TYPE_TIME_EXTEND:
@@ -445,23 +446,214 @@ void *kbuffer_translate_data(int swap, void *data, unsigned int *size)
 	return ptr;
 }
 
-static int __next_event(struct kbuffer *kbuf)
+static int next_event(struct kbuffer *kbuf)
 {
-	int type;
+	return kbuf->next_event(kbuf);
+}
+
+/*
+ * Specialized versions of __next_event() and of the subbuffer decoder, one
+ * for each combination of swapping and endianness of the data. They avoid
+ * the indirect calls and the flag tests made for every event by the
+ * generic code.
+ */
+static __always_inline int
+do_next_event(struct kbuffer *kbuf, int swap, int big_endian)
+{
+	unsigned long long delta;
+	unsigned int type_len;
+	int length;
+	void *ptr;
 
 	do {
 		kbuf->curr = kbuf->next;
 		if (kbuf->next >= kbuf->size)
 			return -1;
-		type = update_pointers(kbuf);
-	} while (type == KBUFFER_TYPE_TIME_EXTEND || type == KBUFFER_TYPE_PADDING);
+
+		ptr = kbuf->data + kbuf->curr;
+		type_len = __translate_data(ptr, &ptr, &delta, &length,
+					    swap, big_endian);
+
+		kbuf->timestamp += delta;
+		kbuf->index = calc_index(kbuf, ptr);
+		kbuf->next = kbuf->index + length;
+	} while (type_len == KBUFFER_TYPE_TIME_EXTEND ||
+		 type_len == KBUFFER_TYPE_PADDING);
 
 	return 0;
 }
 
-static int next_event(struct kbuffer *kbuf)
+static __always_inline int
+do_decode_events(struct kbuffer *kbuf, struct kbuffer_event *events,
+		 int max, int swap, int big_endian)
 {
-	return kbuf->next_event(kbuf);
+	unsigned long long ts = kbuf->timestamp;
+	unsigned int start = kbuf->start;
+	unsigned int curr = kbuf->curr;
+	unsigned int size = kbuf->size;
+	unsigned long long delta;
+	unsigned int type_len_ts;
+	unsigned int type_len;
+	void *data = kbuf->data;
+	unsigned int index;
+	int length;
+	void *ptr;
+	int n = 0;
+
+	/* The current event has been decoded already. */
+	if (curr >= size || max <= 0)
+		return 0;
+
+	events[n].ts = ts;
+	events[n].offset = curr + start;
+	events[n].index = kbuf->index + start;
+	events[n].size = kbuf->next - kbuf->index;
+	events[n].record_size = kbuf->next - curr;
+	curr = kbuf->next;
+	n++;
+
+	while (curr < size && n < max) {
+		type_len_ts = swap ? __read_4_sw(data + curr) :
+				     __read_4(data + curr);
+
+		type_len = big_endian ? (type_len_ts >> 27) & ((1 << 5) - 1) :
+					type_len_ts & ((1 << 5) - 1);
+
+		if (type_len && type_len < KBUFFER_TYPE_PADDING) {
+			/* Most events are small, with the length in the header. */
+			ts += big_endian ? type_len_ts & ((1 << 27) - 1) :
+					   type_len_ts >> 5;
+			length = type_len * 4;
+			events[n].ts = ts;
+			events[n].offset = curr + start;
+			events[n].index = curr + 4 + start;
+			events[n].size = length;
+			events[n].record_size = length + 4;
+			curr += length + 4;
+			n++;
+			continue;
+		}
+
+		type_len = __translate_data(data + curr, &ptr, &delta, &length,
+					    swap, big_endian);
+		ts += delta;
+		index = ptr - data;
+
+		if (type_len != KBUFFER_TYPE_TIME_EXTEND &&
+		    type_len != KBUFFER_TYPE_PADDING) {
+			events[n].ts = ts;
+			events[n].offset = curr + start;
+			events[n].index = index + start;
+			events[n].size = length;
+			events[n].record_size = index + length - curr;
+			n++;
+		}
+
+		curr = index + length;
+	}
+
+	return n;
+}
+
+#define DEFINE_FAST_PATH(name, swap, big_endian)			\
+static int __next_event_##name(struct kbuffer *kbuf)			\
+{									\
+	return do_next_event(kbuf, swap, big_endian);			\
+}									\
+									\
+static int __decode_events_##name(struct kbuffer *kbuf,			\
+				  struct kbuffer_event *events,		\
+				  int max)				\
+{									\
+	return do_decode_events(kbuf, events, max, swap, big_endian);	\
+}
+
+DEFINE_FAST_PATH(le, 0, 0)
+DEFINE_FAST_PATH(le_sw, 1, 0)
+DEFINE_FAST_PATH(be, 0, 1)
+DEFINE_FAST_PATH(be_sw, 1, 1)
+
+static void set_fast_path(struct kbuffer *kbuf)
+{
+	int swap = do_swap(kbuf);
+
+	if (kbuf->flags & KBUFFER_FL_BIG_ENDIAN) {
+		kbuf->next_event = swap ? __next_event_be_sw : __next_event_be;
+		kbuf->decode_events = swap ? __decode_events_be_sw :
+					     __decode_events_be;
+	} else {
+		kbuf->next_event = swap ? __next_event_le_sw : __next_event_le;
+		kbuf->decode_events = swap ? __decode_events_le_sw :
+					     __decode_events_le;
+	}
+}
+
+/*
+ * The old format is rare enough to be decoded one event at a time, using
+ * kbuffer_next_event(). The state of the kbuffer is restored at the end.
+ */
+static int __old_decode_events(struct kbuffer *kbuf,
+			       struct kbuffer_event *events, int max)
+{
+	struct kbuffer save = *kbuf;
+	int n = 0;
+
+	while (n < max && kbuf->curr < kbuf->size) {
+		events[n].ts = kbuf->timestamp;
+		events[n].offset = kbuf->curr + kbuf->start;
+		events[n].index = kbuf->index + kbuf->start;
+		events[n].size = kbuf->next - kbuf->index;
+		events[n].record_size = kbuf->next - kbuf->curr;
+		n++;
+
+		if (next_event(kbuf) < 0)
+			break;
+	}
+
+	*kbuf = save;
+
+	return n;
+}
+
+/**
+ * kbuffer_decode_events - decode the events of the subbuffer at once
+ * @kbuf:	The kbuffer to read from
+ * @events:	Array to store the decoded events
+ * @max:	The size of the @events array
+ *
+ * Decodes the events of the loaded subbuffer, starting from the current
+ * event, into @events. The timestamp, the offsets of the record and of its
+ * data (both from the start of the subbuffer) and the sizes of every event
+ * are stored. Padding and time extend entries are skipped.
+ *
+ * The kbuffer itself is not moved. To continue after the last decoded
+ * event use kbuffer_read_at_offset() with the offset of that event, then
+ * kbuffer_next_event().
+ *
+ * An array of kbuffer_max_events() elements is always enough to hold
+ * all events of a subbuffer.
+ *
+ * Returns the number of events stored in @events.
+ */
+int kbuffer_decode_events(struct kbuffer *kbuf,
+			  struct kbuffer_event *events, int max)
+{
+	if (!kbuf || !kbuf->subbuffer || !events)
+		return 0;
+
+	return kbuf->decode_events(kbuf, events, max);
+}
+
+/**
+ * kbuffer_max_events - the maximum number of events in the subbuffer
+ * @kbuf:	The kbuffer to read from
+ *
+ * Returns the maximum number of events the loaded subbuffer can hold.
+ * Every event takes at least 8 bytes.
+ */
+int kbuffer_max_events(struct kbuffer *kbuf)
+{
+	return kbuf->size / 8 + 1;
 }
 
 /**
@@ -742,6 +934,7 @@ void kbuffer_set_old_format(struct kbuffer *kbuf)
 	kbuf->flags |= KBUFFER_FL_OLD_FORMAT;
 
 	kbuf->next_event = __old_next_event;
+	kbuf->decode_events = __old_decode_events;
 }
 
 /**
@@ -113,6 +113,12 @@ find_filter_type(struct tep_event_filter *filter, int id)
 	struct tep_filter_type *filter_type;
 	struct tep_filter_type key;
 
+	if (filter->id_map) {
+		if (id < 0 || id >= filter->id_map_size || !filter->id_map[id])
+			return NULL;
+		return &filter->event_filters[filter->id_map[id] - 1];
+	}
+
 	key.event_id = id;
 
 	filter_type = bsearch(&key, filter->event_filters,
@@ -123,6 +129,37 @@ find_filter_type(struct tep_event_filter *filter, int id)
 	return filter_type;
 }
 
+/*
+ * Map the event ids to their filters, to find the filter of a record
+ * (or that it has none) without a search.
+ */
+static void update_id_map(struct tep_event_filter *filter)
+{
+	int size;
+	int i;
+
+	free(filter->id_map);
+	filter->id_map = NULL;
+	filter->id_map_size = 0;
+
+	if (!filter->filters)
+		return;
+
+	/* event_filters is sorted by id */
+	size = filter->event_filters[filter->filters - 1].event_id + 1;
+	if (filter->event_filters[0].event_id < 0)
+		return;
+
+	/* Without the map, the filters are searched for */
+	filter->id_map = calloc(size, sizeof(*filter->id_map));
+	if (!filter->id_map)
+		return;
+
+	filter->id_map_size = size;
+	for (i = 0; i < filter->filters; i++)
+		filter->id_map[filter->event_filters[i].event_id] = i + 1;
+}
+
 static struct tep_filter_type *
 add_filter_type(struct tep_event_filter *filter, int id)
 {
@@ -156,9 +193,12 @@ add_filter_type(struct tep_event_filter *filter, int id)
 	filter_type->event_id = id;
 	filter_type->event = tep_find_event(filter->pevent, id);
 	filter_type->filter = NULL;
+	filter_type->prog = NULL;
 
 	filter->filters++;
 
+	update_id_map(filter);
+
 	return filter_type;
 }
 
@@ -1204,6 +1244,22 @@ process_event(struct tep_event_format *event, const char *filter_str,
 	return 0;
 }
 
+static struct tep_filter_prog *
+compile_filter(struct tep_event_format *event, struct tep_filter_arg *arg);
+
+/* Replace the filter of @filter_type with @arg */
+static void set_filter_arg(struct tep_filter_type *filter_type,
+			   struct tep_filter_arg *arg)
+{
+	if (filter_type->filter)
+		free_arg(filter_type->filter);
+	free(filter_type->prog);
+
+	filter_type->filter = arg;
+	/* If it can't be compiled, the tree is walked */
+	filter_type->prog = compile_filter(filter_type->event, arg);
+}
+
 static enum tep_errno
 filter_event(struct tep_event_filter *filter, struct tep_event_format *event,
 	     const char *filter_str, char *error_str)
@@ -1231,9 +1287,7 @@ filter_event(struct tep_event_filter *filter, struct tep_event_format *event,
 	if (filter_type == NULL)
 		return TEP_ERRNO__MEM_ALLOC_FAILED;
 
-	if (filter_type->filter)
-		free_arg(filter_type->filter);
-	filter_type->filter = arg;
+	set_filter_arg(filter_type, arg);
 
 	return 0;
 }
@@ -1355,6 +1409,7 @@ enum tep_errno tep_filter_add_filter_str(struct tep_event_filter *filter,
 static void free_filter_type(struct tep_filter_type *filter_type)
 {
 	free_arg(filter_type->filter);
+	free(filter_type->prog);
 }
 
 /**
@@ -1420,6 +1475,8 @@ int tep_filter_remove_event(struct tep_event_filter *filter,
 	memset(&filter->event_filters[filter->filters], 0,
 	       sizeof(*filter_type));
 
+	update_id_map(filter);
+
 	return 1;
 }
 
@@ -1439,6 +1496,8 @@ void tep_filter_reset(struct tep_event_filter *filter)
 	free(filter->event_filters);
 	filter->filters = 0;
 	filter->event_filters = NULL;
+
+	update_id_map(filter);
 }
 
 void tep_filter_free(struct tep_event_filter *filter)
@@ -1489,7 +1548,7 @@ static int copy_filter_type(struct tep_event_filter *filter,
 		if (filter_type == NULL)
 			return -1;
 
-		filter_type->filter = arg;
+		set_filter_arg(filter_type, arg);
 
 		free(str);
 		return 0;
@@ -2001,6 +2060,373 @@ static int test_filter(struct tep_event_format *event, struct tep_filter_arg *ar
 	}
 }
 
+/*
+ * The filters are compiled into a program for a stack machine, with
+ * the offsets, sizes and byte order of the fields resolved, that
+ * tep_filter_match() runs instead of walking the tree of the filter.
+ * Filters that could give an error when they are tested are not
+ * compiled, and still walk the tree.
+ */
+enum filter_insn_op {
+	FILTER_INSN_CONST,	/* push val */
+	FILTER_INSN_FIELD,	/* push the field at offset */
+	FILTER_INSN_CPU,	/* push the CPU of the record */
+	FILTER_INSN_COMM,	/* push the comm of the record */
+	FILTER_INSN_EXP,	/* pop right and left, push left <type> right */
+	FILTER_INSN_CMP,	/* pop right and left, push left <type> right */
+	FILTER_INSN_STR,	/* push the string compare of arg */
+	FILTER_INSN_BOOL,	/* top = !!top */
+	FILTER_INSN_NOT,	/* top = !top */
+	FILTER_INSN_JMP_FALSE,	/* jump to target if top is 0, else pop */
+	FILTER_INSN_JMP_TRUE,	/* jump to target if top is not 0, else pop */
+};
+
+struct filter_insn {
+	unsigned char			op;
+	unsigned char			size;
+	unsigned char			sign;
+	unsigned char			swap;
+	int				type;
+	union {
+		unsigned long long	val;
+		unsigned int		offset;
+		int			target;
+		struct tep_filter_arg	*arg;
+	};
+};
+
+/* Deeper filters walk the tree */
+#define FILTER_STACK_MAX	64
+
+struct tep_filter_prog {
+	int				nr_insns;
+	int				stack_size;
+	struct filter_insn		insns[];
+};
+
+struct filter_compiler {
+	struct filter_insn		*insns;
+	int				nr_insns;
+	int				alloc;
+	int				depth;
+	int				max_depth;
+};
+
+static struct filter_insn *
+emit_insn(struct filter_compiler *c, enum filter_insn_op op, int push)
+{
+	struct filter_insn *insns;
+
+	if (c->nr_insns == c->alloc) {
+		c->alloc = c->alloc ? c->alloc * 2 : 16;
+		insns = realloc(c->insns, sizeof(*insns) * c->alloc);
+		if (!insns)
+			return NULL;
+		c->insns = insns;
+	}
+
+	c->depth += push;
+	if (c->depth > c->max_depth)
+		c->max_depth = c->depth;
+
+	insns = &c->insns[c->nr_insns++];
+	memset(insns, 0, sizeof(*insns));
+	insns->op = op;
+
+	return insns;
+}
+
+static int compile_value(struct filter_compiler *c, struct tep_filter_arg *arg)
+{
+	struct tep_format_field *field;
+	struct tep_handle *pevent;
+	struct filter_insn *insn;
+
+	switch (arg->type) {
+	case TEP_FILTER_ARG_FIELD:
+		field = arg->field.field;
+		if (field == &comm)
+			return emit_insn(c, FILTER_INSN_COMM, 1) ? 0 : -1;
+		if (field == &cpu)
+			return emit_insn(c, FILTER_INSN_CPU, 1) ? 0 : -1;
+		if (field->size != 1 && field->size != 2 &&
+		    field->size != 4 && field->size != 8)
+			return -1;
+		insn = emit_insn(c, FILTER_INSN_FIELD, 1);
+		if (!insn)
+			return -1;
+		pevent = field->event->pevent;
+		insn->offset = field->offset;
+		insn->size = field->size;
+		insn->sign = !!(field->flags & TEP_FIELD_IS_SIGNED);
+		insn->swap = pevent->host_bigendian != pevent->file_bigendian;
+		return 0;
+
+	case TEP_FILTER_ARG_VALUE:
+		if (arg->value.type != TEP_FILTER_NUMBER)
+			return -1;
+		insn = emit_insn(c, FILTER_INSN_CONST, 1);
+		if (!insn)
+			return -1;
+		insn->val = arg->value.val;
+		return 0;
+
+	case TEP_FILTER_ARG_EXP:
+		if (arg->exp.type <= TEP_FILTER_EXP_NONE ||
+		    arg->exp.type >= TEP_FILTER_EXP_NOT)
+			return -1;
+		if (compile_value(c, arg->exp.left) < 0 ||
+		    compile_value(c, arg->exp.right) < 0)
+			return -1;
+		insn = emit_insn(c, FILTER_INSN_EXP, -1);
+		if (!insn)
+			return -1;
+		insn->type = arg->exp.type;
+		return 0;
+
+	default:
+		return -1;
+	}
+}
+
+/* Compile @arg to push 1 if it matches, and 0 if it does not */
+static int compile_test(struct filter_compiler *c, struct tep_filter_arg *arg)
+{
+	struct filter_insn *insn;
+	int jump;
+
+	switch (arg->type) {
+	case TEP_FILTER_ARG_BOOLEAN:
+		insn = emit_insn(c, FILTER_INSN_CONST, 1);
+		if (!insn)
+			return -1;
+		insn->val = arg->boolean.value;
+		return 0;
+
+	case TEP_FILTER_ARG_OP:
+		switch (arg->op.type) {
+		case TEP_FILTER_OP_AND:
+		case TEP_FILTER_OP_OR:
+			if (compile_test(c, arg->op.left) < 0)
+				return -1;
+			jump = c->nr_insns;
+			if (!emit_insn(c, arg->op.type == TEP_FILTER_OP_AND ?
+				       FILTER_INSN_JMP_FALSE : FILTER_INSN_JMP_TRUE,
+				       -1))
+				return -1;
+			if (compile_test(c, arg->op.right) < 0)
+				return -1;
+			c->insns[jump].target = c->nr_insns;
+			return 0;
+
+		case TEP_FILTER_OP_NOT:
+			if (compile_test(c, arg->op.right) < 0)
+				return -1;
+			return emit_insn(c, FILTER_INSN_NOT, 0) ? 0 : -1;
+
+		default:
+			return -1;
+		}
+
+	case TEP_FILTER_ARG_NUM:
+		if (arg->num.type < TEP_FILTER_CMP_EQ ||
+		    arg->num.type > TEP_FILTER_CMP_LE)
+			return -1;
+		if (compile_value(c, arg->num.left) < 0 ||
+		    compile_value(c, arg->num.right) < 0)
+			return -1;
+		insn = emit_insn(c, FILTER_INSN_CMP, -1);
+		if (!insn)
+			return -1;
+		insn->type = arg->num.type;
+		return 0;
+
+	case TEP_FILTER_ARG_STR:
+		if (arg->str.type < TEP_FILTER_CMP_MATCH ||
+		    arg->str.type > TEP_FILTER_CMP_NOT_REGEX)
+			return -1;
+		insn = emit_insn(c, FILTER_INSN_STR, 1);
+		if (!insn)
+			return -1;
+		insn->arg = arg;
+		return 0;
+
+	case TEP_FILTER_ARG_EXP:
+	case TEP_FILTER_ARG_VALUE:
+	case TEP_FILTER_ARG_FIELD:
+		if (compile_value(c, arg) < 0)
+			return -1;
+		return emit_insn(c, FILTER_INSN_BOOL, 0) ? 0 : -1;
+
+	default:
+		return -1;
+	}
+}
+
+static struct tep_filter_prog *
+compile_filter(struct tep_event_format *event, struct tep_filter_arg *arg)
+{
+	struct filter_compiler c;
+	struct tep_filter_prog *prog = NULL;
+
+	if (!event || !arg)
+		return NULL;
+
+	memset(&c, 0, sizeof(c));
+
+	if (compile_test(&c, arg) < 0 || c.max_depth > FILTER_STACK_MAX)
+		goto out;
+
+	prog = malloc(sizeof(*prog) + sizeof(*c.insns) * c.nr_insns);
+	if (!prog)
+		goto out;
+
+	prog->nr_insns = c.nr_insns;
+	prog->stack_size = c.max_depth;
+	memcpy(prog->insns, c.insns, sizeof(*c.insns) * c.nr_insns);
+ out:
+	free(c.insns);
+	return prog;
+}
+
+static unsigned long long
+read_field(struct tep_event_format *event, struct filter_insn *insn,
+	   struct tep_record *record)
+{
+	const void *ptr = record->data + insn->offset;
+	unsigned short val2;
+	unsigned int val4;
+	unsigned long long val8;
+
+	switch (insn->size) {
+	case 1:
+		val8 = *(unsigned char *)ptr;
+		return insn->sign ? (char)val8 : val8;
+	case 2:
+		memcpy(&val2, ptr, 2);
+		if (insn->swap)
+			val2 = __tep_data2host2(event->pevent, val2);
+		return insn->sign ? (short)val2 : val2;
+	case 4:
+		memcpy(&val4, ptr, 4);
+		if (insn->swap)
+			val4 = __tep_data2host4(event->pevent, val4);
+		return insn->sign ? (int)val4 : val4;
+	default:
+		memcpy(&val8, ptr, 8);
+		if (insn->swap)
+			val8 = __tep_data2host8(event->pevent, val8);
+		return val8;
+	}
+}
+
+static unsigned long long exp_value(int type, unsigned long long lval,
+				    unsigned long long rval)
+{
+	switch (type) {
+	case TEP_FILTER_EXP_ADD:
+		return lval + rval;
+	case TEP_FILTER_EXP_SUB:
+		return lval - rval;
+	case TEP_FILTER_EXP_MUL:
+		return lval * rval;
+	case TEP_FILTER_EXP_DIV:
+		return lval / rval;
+	case TEP_FILTER_EXP_MOD:
+		return lval % rval;
+	case TEP_FILTER_EXP_RSHIFT:
+		return lval >> rval;
+	case TEP_FILTER_EXP_LSHIFT:
+		return lval << rval;
+	case TEP_FILTER_EXP_AND:
+		return lval & rval;
+	case TEP_FILTER_EXP_OR:
+		return lval | rval;
+	default: /* TEP_FILTER_EXP_XOR */
+		return lval ^ rval;
+	}
+}
+
+static int cmp_value(int type, unsigned long long lval,
+		     unsigned long long rval)
+{
+	switch (type) {
+	case TEP_FILTER_CMP_EQ:
+		return lval == rval;
+	case TEP_FILTER_CMP_NE:
+		return lval != rval;
+	case TEP_FILTER_CMP_GT:
+		return lval > rval;
+	case TEP_FILTER_CMP_LT:
+		return lval < rval;
+	case TEP_FILTER_CMP_GE:
+		return lval >= rval;
+	default: /* TEP_FILTER_CMP_LE */
+		return lval <= rval;
+	}
+}
+
+static int run_filter(struct tep_event_format *event,
+		      struct tep_filter_prog *prog, struct tep_record *record)
+{
+	unsigned long long stack[FILTER_STACK_MAX];
+	struct filter_insn *insn;
+	enum tep_errno err = 0;
+	int sp = -1;
+	int i;
+
+	for (i = 0; i < prog->nr_insns; i++) {
+		insn = &prog->insns[i];
+
+		switch (insn->op) {
+		case FILTER_INSN_CONST:
+			stack[++sp] = insn->val;
+			break;
+		case FILTER_INSN_FIELD:
+			stack[++sp] = read_field(event, insn, record);
+			break;
+		case FILTER_INSN_CPU:
+			stack[++sp] = record->cpu;
+			break;
+		case FILTER_INSN_COMM:
+			stack[++sp] = (unsigned long)get_comm(event, record);
+			break;
+		case FILTER_INSN_EXP:
+			sp--;
+			stack[sp] = exp_value(insn->type, stack[sp], stack[sp + 1]);
+			break;
+		case FILTER_INSN_CMP:
+			sp--;
+			stack[sp] = cmp_value(insn->type, stack[sp], stack[sp + 1]);
+			break;
+		case FILTER_INSN_STR:
+			/* The compare type was checked when compiled */
+			stack[++sp] = test_str(event, insn->arg, record, &err);
+			break;
+		case FILTER_INSN_BOOL:
+			stack[sp] = !!stack[sp];
+			break;
+		case FILTER_INSN_NOT:
+			stack[sp] = !stack[sp];
+			break;
+		case FILTER_INSN_JMP_FALSE:
+			if (!stack[sp])
+				i = insn->target - 1;
+			else
+				sp--;
+			break;
+		case FILTER_INSN_JMP_TRUE:
+			if (stack[sp])
+				i = insn->target - 1;
+			else
+				sp--;
+			break;
+		}
+	}
+
+	return stack[0];
+}
+
 /**
  * tep_event_filtered - return true if event has filter
  * @filter: filter struct with filter information
@@ -2053,7 +2479,11 @@ enum tep_errno tep_filter_match(struct tep_event_filter *filter,
 	if (!filter_type)
 		return TEP_ERRNO__FILTER_NOT_FOUND;
 
-	ret = test_filter(filter_type->event, filter_type->filter, record, &err);
+	if (filter_type->prog)
+		ret = run_filter(filter_type->event, filter_type->prog, record);
+	else
+		ret = test_filter(filter_type->event, filter_type->filter,
+				  record, &err);
 	if (err)
 		return err;
 
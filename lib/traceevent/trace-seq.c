@@ -211,6 +211,29 @@ int trace_seq_putc(struct trace_seq *s, unsigned char c)
 	return 1;
 }
 
+/**
+ * trace_seq_putmem - trace sequence printing of raw memory
+ * @s: trace sequence descriptor
+ * @mem: the memory to record
+ * @len: the number of bytes of @mem to record
+ *
+ * Like trace_seq_puts(), but @mem does not need to be terminated.
+ */
+int trace_seq_putmem(struct trace_seq *s, const void *mem, unsigned int len)
+{
+	TRACE_SEQ_CHECK_RET0(s);
+
+	while (len > ((s->buffer_size - 1) - s->len))
+		expand_buffer(s);
+
+	TRACE_SEQ_CHECK_RET0(s);
+
+	memcpy(s->buffer + s->len, mem, len);
+	s->len += len;
+
+	return len;
+}
+
 void trace_seq_terminate(struct trace_seq *s)
 {
 	TRACE_SEQ_CHECK_RET(s);
@@ -0,0 +1,165 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0
+#
+# Compare the output of two builds of trace-cmd: a known good one (old)
+# and the one being tested (new).
+#
+# usage: compare-output.sh [-r] old-trace-cmd new-trace-cmd [trace.dat ...]
+#
+# The given trace data files are read by both builds:
+#   - report, with and without plugins, raw and latency formats
+#   - report with event filters (-F), and the filter strings (-T)
+#   - hist, which registers the comms of the sched events
+#   - split -m -r, read back by the old build
+#
+# With -r, both builds also record a small workload (this needs root
+# and tracefs), and the number of recorded events is compared:
+#   - a plain recording, and one with the top buffer and a buffer
+#     instance (-B), which are written together
+#   - --compress, and -m with --segments (new build only, compared
+#     against the plain recording of the old build)
+#
+# Extra options for all recordings can be given in RECORD_OPTS.
+# The script exits with the number of failed checks.
+#
+# Expected differences against builds older than the hashed comms:
+# comms containing spaces are now printed in full, and when a pid has
+# several comms, hist prints the one saved in the trace data file.
+
+usage() {
+	echo "usage: $0 [-r] old-trace-cmd new-trace-cmd [trace.dat ...]"
+	exit 255
+}
+
+record=0
+if [ "$1" = "-r" ]; then
+	record=1
+	shift
+fi
+
+[ $# -lt 2 ] && usage
+
+OLD=$1
+NEW=$2
+shift 2
+
+TMP=$(mktemp -d) || exit 255
+trap 'rm -rf "$TMP"' EXIT
+
+failed=0
+
+# compare "name" trace-cmd-args...: run both builds, compare the outputs
+compare() {
+	name=$1
+	shift
+
+	"$OLD" "$@" > "$TMP/old.out" 2>/dev/null
+	"$NEW" "$@" > "$TMP/new.out" 2>/dev/null
+
+	if cmp -s "$TMP/old.out" "$TMP/new.out"; then
+		echo "ok     $name"
+		return
+	fi
+
+	echo "DIFF   $name"
+	diff "$TMP/old.out" "$TMP/new.out" | head -10
+	failed=$((failed + 1))
+}
+
+# check "name" old-value new-value
+check() {
+	if [ "$2" = "$3" ]; then
+		echo "ok     $1 ($2)"
+		return
+	fi
+
+	echo "DIFF   $1: old $2, new $3"
+	failed=$((failed + 1))
+}
+
+# Write the trace data file by both builds with split -m -r, and read
+# all the pieces with the old build.
+compare_split() {
+	file=$1
+
+	for b in old new; do
+		rm -rf "$TMP/split.$b"
+		mkdir "$TMP/split.$b"
+	done
+
+	"$OLD" split -i "$file" -o "$TMP/split.old/s.dat" -m 10 -r >/dev/null 2>&1
+	"$NEW" split -i "$file" -o "$TMP/split.new/s.dat" -m 10 -r >/dev/null 2>&1
+
+	check "$file: split -m files" "$(ls "$TMP/split.old" | wc -l)" \
+		"$(ls "$TMP/split.new" | wc -l)"
+
+	for piece in "$TMP"/split.old/*; do
+		piece=$(basename "$piece")
+		"$OLD" report -i "$TMP/split.old/$piece" > "$TMP/old.out" 2>/dev/null
+		"$OLD" report -i "$TMP/split.new/$piece" > "$TMP/new.out" 2>/dev/null
+		if ! cmp -s "$TMP/old.out" "$TMP/new.out"; then
+			echo "DIFF   $file: split piece $piece"
+			failed=$((failed + 1))
+		fi
+	done
+}
+
+for file in "$@"; do
+	compare "$file: report" report -i "$file"
+	compare "$file: report -N" report -N -i "$file"
+	compare "$file: report -R" report -R -i "$file"
+	compare "$file: report -l" report -l -i "$file"
+	compare "$file: report -t --cpu 0" report -t --cpu 0 -i "$file"
+
+	for filter in \
+		'sched_switch: prev_pid > 100' \
+		'sched_switch: prev_comm ~ "k*" || next_prio < 120' \
+		'sched_wakeup: comm != "bash" && pid & 1' \
+		'.*: common_pid == 0' \
+		'sched.*: common_cpu == 1 || common_pid < 10'; do
+		compare "$file: report -F '$filter'" \
+			report -i "$file" -F "$filter"
+		compare "$file: report -v -F '$filter'" \
+			report -i "$file" -v -F "$filter"
+
+		# -T prints the address of the compiled regex
+		case "$filter" in
+		*~*)	continue ;;
+		esac
+
+		compare "$file: report -T -F '$filter'" \
+			report -i "$file" -T -F "$filter"
+	done
+
+	compare "$file: hist" hist -i "$file"
+	compare_split "$file"
+done
+
+[ $record -eq 0 ] && exit $failed
+
+WORKLOAD='for i in $(seq 200); do /bin/true; done'
+
+# count trace-cmd record-opts...: the exec events recorded by a build
+count() {
+	tc=$1
+	shift
+
+	rm -f "$TMP"/rec.dat*
+	"$tc" record $RECORD_OPTS -o "$TMP/rec.dat" "$@" \
+		-e sched_process_exec sh -c "$WORKLOAD" >/dev/null 2>&1
+	"$tc" report -i "$TMP/rec.dat" 2>/dev/null | grep -c sched_process_exec
+}
+
+plain=$(count "$OLD")
+check "record" "$plain" "$(count "$NEW")"
+
+check "record -B" \
+	"$(count "$OLD" -e sched_process_exec -B compare_output)" \
+	"$(count "$NEW" -e sched_process_exec -B compare_output)"
+
+check "record --compress" "$plain" "$(count "$NEW" --compress)"
+
+check "record -m --segments 4" "$plain" \
+	"$(count "$NEW" -m 10000 --segments 4)"
+
+exit $failed
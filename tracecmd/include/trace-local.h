@@ -35,6 +35,8 @@ struct pid_record_data {
 	struct tracecmd_input	*stream;
 	struct buffer_instance	*instance;
 	struct tep_record	*record;
+	/* Only used by the threaded recorder (record --threads) */
+	struct tracecmd_recorder *recorder;
 };
 
 void show_file(const char *name);
@@ -6,9 +6,12 @@
 #define UDP_MAX_PACKET	(65536 - 20)
 #define V2_MAGIC	"677768\0"
 #define V2_CPU		"-1V2"
+#define V3_CPU		"-1V3"
 
 #define V1_PROTOCOL	1
 #define V2_PROTOCOL	2
+/* v2, with the data of all CPUs sent over the connection of the messages */
+#define V3_PROTOCOL	3
 
 extern unsigned int page_size;
 
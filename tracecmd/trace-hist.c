@@ -973,20 +973,21 @@ static void do_trace_hist(struct tracecmd_input *handle)
 	update_kernel_stack(pevent);
 
 	for (cpu = 0; cpu < cpus; cpu++) {
-		for (;;) {
-			struct tep_record *record;
+		struct tracecmd_page_records recs = {};
+		int i, n;
 
-			record = tracecmd_read_data(handle, cpu);
-			if (!record)
-				break;
+		while ((n = tracecmd_read_page_records(handle, cpu, &recs)) > 0) {
+			for (i = 0; i < n; i++) {
+				record = &recs.records[i];
 
-			/* If we missed events, just flush out the current stack */
-			if (record->missed_events)
-				flush_stack();
+				/* If we missed events, just flush out the current stack */
+				if (record->missed_events)
+					flush_stack();
 
-			process_record(pevent, record);
-			free_record(record);
+				process_record(pevent, record);
+			}
 		}
+		tracecmd_free_page_records(&recs);
 	}
 
 	if (current_pid >= 0)
@@ -13,6 +13,12 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <time.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -24,6 +30,15 @@
 
 #define MAX_OPTION_SIZE 4096
 
+/* The number of UDP pages received with a single recvmmsg() */
+#define UDP_BATCH_PAGES		64
+
+/* The size of the pipe that TCP data is spliced through */
+#define TCP_PIPE_SIZE		(1024 * 1024)
+
+/* The reads of a stream per event, to not starve the other streams */
+#define STREAM_BATCH		16
+
 #define _VAR_DIR_Q(dir)		#dir
 #define VAR_DIR_Q(dir)		_VAR_DIR_Q(dir)
 
@@ -189,18 +204,241 @@ void pdie(const char *fmt, ...)
 	exit(-1);
 }
 
+static int write_data(int fd, char *buf, int size)
+{
+	int left = size;
+	int w;
+
+	do {
+		w = write(fd, buf + (size - left), left);
+		if (w > 0)
+			left -= w;
+	} while (w >= 0 && left);
+
+	return w < 0 ? -1 : 0;
+}
+
+/*
+ * Move @left bytes of the pipe @pfd into the file with read() and
+ * write(), when they could not be spliced. The pipe is empty when this
+ * returns, even if the data could not be written.
+ */
+static int empty_pipe(int pfd, int fd, long left)
+{
+	char buf[BUFSIZ];
+	int err = 0;
+	long r;
+
+	while (left > 0) {
+		r = read(pfd, buf, left < BUFSIZ ? left : BUFSIZ);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		if (!err && write_data(fd, buf, r) < 0)
+			err = errno;
+		left -= r;
+	}
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Splice the data that is available on the TCP socket into the file,
+ * through the pipe @brass. Returns the number of bytes moved, 0 at
+ * the end of the connection, or -1 on error. The pipe is always left
+ * empty.
+ */
+static long splice_tcp_pages(int sfd, int fd, int *brass, int pipe_size,
+			     unsigned int flags)
+{
+	long r, w;
+	long left;
+
+	r = splice(sfd, NULL, brass[1], NULL, pipe_size, flags);
+	if (r <= 0)
+		return r;
+
+	for (left = r; left; left -= w) {
+		w = splice(brass[0], NULL, fd, NULL, left, SPLICE_F_MOVE);
+		if (w < 0) {
+			if (errno == EINTR) {
+				w = 0;
+				continue;
+			}
+			if (empty_pipe(brass[0], fd, left) < 0)
+				return -1;
+			break;
+		}
+	}
+
+	return r;
+}
+
+/*
+ * Receive up to UDP_BATCH_PAGES pages with a single recvmmsg() into
+ * @buf, and write them into the file with a single writev(). Returns
+ * the number of bytes received, 0 at the end of the connection, or -1
+ * on error.
+ */
+static long recv_udp_pages(int sfd, int fd, int page_size, char *buf,
+			   int flags, int *once)
+{
+	struct mmsghdr msgs[UDP_BATCH_PAGES];
+	struct iovec iovs[UDP_BATCH_PAGES];
+	long total = 0;
+	ssize_t w;
+	int i, n;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < UDP_BATCH_PAGES; i++) {
+		iovs[i].iov_base = buf + (size_t)i * page_size;
+		iovs[i].iov_len = page_size;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	n = recvmmsg(sfd, msgs, UDP_BATCH_PAGES, flags, NULL);
+	if (n <= 0)
+		return n;
+
+	for (i = 0; i < n; i++) {
+		/* An empty datagram is a socket that was shut down */
+		if (!msgs[i].msg_len) {
+			n = i;
+			break;
+		}
+		/* UDP requires that we get the full size in one go */
+		if (msgs[i].msg_len < page_size && !*once) {
+			*once = 1;
+			warning("read %d bytes, expected %d",
+				msgs[i].msg_len, page_size);
+		}
+		iovs[i].iov_len = msgs[i].msg_len;
+		total += msgs[i].msg_len;
+	}
+
+	if (!n)
+		return 0;
+
+	w = writev(fd, iovs, n);
+	if (w < 0)
+		return -1;
+
+	/* Finish a short write one page at a time */
+	for (i = 0; i < n; i++) {
+		if (w >= iovs[i].iov_len) {
+			w -= iovs[i].iov_len;
+			continue;
+		}
+		if (write_data(fd, iovs[i].iov_base + w, iovs[i].iov_len - w) < 0)
+			return -1;
+		w = 0;
+	}
+
+	return total;
+}
+
+static void copy_data(int sfd, int fd, int page_size)
+{
+	char buf[page_size];
+	int r;
+
+	for (;;) {
+		r = read(sfd, buf, page_size);
+		if (r < 0) {
+			if (errno == EINTR)
+				break;
+			pdie("reading pages from client");
+		}
+		if (!r)
+			break;
+		write_data(fd, buf, r);
+	}
+}
+
+/*
+ * Move the data of the TCP connection into the file through a pipe,
+ * without copying it into user space. Falls back to read() and write()
+ * if the socket or the file system can not splice.
+ */
+static void receive_tcp_data(int sfd, int fd, int page_size)
+{
+	bool spliced = false;
+	int pipe_size;
+	int brass[2];
+	long r;
+
+	if (pipe(brass) < 0) {
+		copy_data(sfd, fd, page_size);
+		return;
+	}
+
+	/* A larger pipe needs less splice calls, but it may not be allowed */
+	fcntl(brass[1], F_SETPIPE_SZ, TCP_PIPE_SIZE);
+	pipe_size = fcntl(brass[1], F_GETPIPE_SZ);
+	if (pipe_size <= 0)
+		pipe_size = page_size;
+
+	for (;;) {
+		r = splice_tcp_pages(sfd, fd, brass, pipe_size,
+				     SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (r < 0) {
+			if (errno == EINTR)
+				break;
+			if (!spliced && errno == EINVAL) {
+				copy_data(sfd, fd, page_size);
+				break;
+			}
+			pdie("reading pages from client");
+		}
+		if (!r)
+			break;
+		spliced = true;
+	}
+
+	close(brass[0]);
+	close(brass[1]);
+}
+
+static void receive_udp_data(int sfd, int fd, int page_size)
+{
+	int once = 0;
+	char *buf;
+	long r;
+
+	buf = malloc((size_t)page_size * UDP_BATCH_PAGES);
+	if (!buf)
+		pdie("allocating pages for client");
+
+	for (;;) {
+		/* Wait for the first page, and take the ones already queued */
+		r = recv_udp_pages(sfd, fd, page_size, buf, MSG_WAITFORONE, &once);
+		if (r < 0) {
+			if (errno == EINTR)
+				break;
+			pdie("reading pages from client");
+		}
+		if (!r)
+			break;
+	}
+
+	free(buf);
+}
+
 static int process_udp_child(int sfd, const char *host, const char *port,
 			     int cpu, int page_size, int use_tcp)
 {
 	struct sockaddr_storage peer_addr;
 	socklen_t peer_addr_len;
-	char buf[page_size];
 	char *tempfile;
-	int left;
 	int cfd;
 	int fd;
-	int r, w;
-	int once = 0;
 
 	signal_setup(SIGUSR1, finish);
 
@@ -225,29 +463,10 @@ static int process_udp_child(int sfd, const char *host, const char *port,
 		sfd = cfd;
 	}
 
-	for (;;) {
-		/* TODO, make this copyless! */
-		r = read(sfd, buf, page_size);
-		if (r < 0) {
-			if (errno == EINTR)
-				break;
-			pdie("reading pages from client");
-		}
-		if (!r)
-			break;
-		/* UDP requires that we get the full size in one go */
-		if (!use_tcp && r < page_size && !once) {
-			once = 1;
-			warning("read %d bytes, expected %d", r, page_size);
-		}
-
-		left = r;
-		do {
-			w = write(fd, buf + (r - left), left);
-			if (w > 0)
-				left -= w;
-		} while (w >= 0 && left);
-	}
+	if (use_tcp)
+		receive_tcp_data(sfd, fd, page_size);
+	else
+		receive_udp_data(sfd, fd, page_size);
 
  done:
 	put_temp_file(tempfile);
@@ -274,8 +493,11 @@ static int udp_bind_a_port(int start_port, int *sfd, int use_tcp)
 	hints.ai_flags = AI_PASSIVE;
 
 	s = getaddrinfo(NULL, buf, &hints, &result);
-	if (s != 0)
-		pdie("getaddrinfo: error opening udp socket");
+	if (s != 0) {
+		plog("getaddrinfo: error opening udp socket: %s\n",
+		     gai_strerror(s));
+		return -1;
+	}
 
 	for (rp = result; rp != NULL; rp = rp->ai_next) {
 		*sfd = socket(rp->ai_family, rp->ai_socktype,
@@ -291,8 +513,10 @@ static int udp_bind_a_port(int start_port, int *sfd, int use_tcp)
 
 	if (rp == NULL) {
 		freeaddrinfo(result);
-		if (++num_port > MAX_PORT_SEARCH)
-			pdie("No available ports to bind");
+		if (++num_port > MAX_PORT_SEARCH) {
+			plog("No available ports to bind\n");
+			return -1;
+		}
 		goto again;
 	}
 
@@ -326,10 +550,6 @@ static int open_udp(const char *node, const char *port, int *pid,
 	int sfd;
 	int num_port;
 
-	/*
-	 * udp_bind_a_port() currently does not return an error, but if that
-	 * changes in the future, we have a check for it now.
-	 */
 	num_port = udp_bind_a_port(start_port, &sfd, use_tcp);
 	if (num_port < 0)
 		return num_port;
@@ -366,7 +586,11 @@ static int communicate_with_client(struct tracecmd_msg_handle *msg_handle)
 
 	/* Is the client using the new protocol? */
 	if (cpus == -1) {
-		if (memcmp(buf, V2_CPU, n) != 0) {
+		if (memcmp(buf, V3_CPU, n) == 0) {
+			/* Let the client know we use v3 protocol */
+			write(fd, "V3", 3);
+			msg_handle->version = V3_PROTOCOL;
+		} else if (memcmp(buf, V2_CPU, n) != 0) {
 			/* If it did not send a version, then bail */
 			if (memcmp(buf, "-1V", 3)) {
 				plog("Unknown string %s\n", buf);
@@ -387,13 +611,14 @@ static int communicate_with_client(struct tracecmd_msg_handle *msg_handle)
 				last_proto[n] = 0;
 			}
 			/* Return the highest protocol we can use */
-			write(fd, "V2", 3);
+			write(fd, "V3", 3);
 			goto try_again;
+		} else {
+			/* Let the client know we use v2 protocol */
+			write(fd, "V2", 3);
+			msg_handle->version = V2_PROTOCOL;
 		}
 
-		/* Let the client know we use v2 protocol */
-		write(fd, "V2", 3);
-
 		/* read the rest of dummy data */
 		n = read(fd, buf, sizeof(V2_MAGIC));
 		if (memcmp(buf, V2_MAGIC, n) != 0)
@@ -402,8 +627,6 @@ static int communicate_with_client(struct tracecmd_msg_handle *msg_handle)
 		/* We're off! */
 		write(fd, "OK", 2);
 
-		msg_handle->version = V2_PROTOCOL;
-
 		/* read the CPU count, the page size, and options */
 		if ((pagesize = tracecmd_msg_initial_setting(msg_handle)) < 0)
 			goto out;
@@ -491,7 +714,7 @@ static int create_client_file(const char *node, const char *port)
 
 	ofd = open(buf, O_RDWR | O_CREAT | O_TRUNC, 0644);
 	if (ofd < 0)
-		pdie("Can not create file %s", buf);
+		plog("Can not create file %s: %s\n", buf, strerror(errno));
 	return ofd;
 }
 
@@ -512,11 +735,36 @@ static void destroy_all_readers(int cpus, int *pid_array, const char *node,
 	free(pid_array);
 }
 
+static int send_port_array(struct tracecmd_msg_handle *msg_handle,
+			   int *port_array)
+{
+	char buf[BUFSIZ];
+	int cpu;
+
+	if (msg_handle->version >= V2_PROTOCOL) {
+		/* send set of port numbers to the client */
+		if (tracecmd_msg_send_port_array(msg_handle, port_array) < 0) {
+			plog("Failed sending port array\n");
+			return -1;
+		}
+	} else {
+		/* send the client a comma deliminated set of port numbers */
+		for (cpu = 0; cpu < msg_handle->cpu_count; cpu++) {
+			snprintf(buf, BUFSIZ, "%s%d",
+				 cpu ? "," : "", port_array[cpu]);
+			write(msg_handle->fd, buf, strlen(buf));
+		}
+		/* end with null terminator */
+		write(msg_handle->fd, "\0", 1);
+	}
+
+	return 0;
+}
+
 static int *create_all_readers(const char *node, const char *port,
 			       int pagesize, struct tracecmd_msg_handle *msg_handle)
 {
 	int use_tcp = msg_handle->flags & TRACECMD_MSG_FL_USE_TCP;
-	char buf[BUFSIZ];
 	int *port_array;
 	int *pid_array;
 	int start_port;
@@ -557,22 +805,8 @@ static int *create_all_readers(const char *node, const char *port,
 		start_port = udp_port + 1;
 	}
 
-	if (msg_handle->version == V2_PROTOCOL) {
-		/* send set of port numbers to the client */
-		if (tracecmd_msg_send_port_array(msg_handle, port_array) < 0) {
-			plog("Failed sending port array\n");
-			goto out_free;
-		}
-	} else {
-		/* send the client a comma deliminated set of port numbers */
-		for (cpu = 0; cpu < cpus; cpu++) {
-			snprintf(buf, BUFSIZ, "%s%d",
-				 cpu ? "," : "", port_array[cpu]);
-			write(msg_handle->fd, buf, strlen(buf));
-		}
-		/* end with null terminator */
-		write(msg_handle->fd, "\0", 1);
-	}
+	if (send_port_array(msg_handle, port_array) < 0)
+		goto out_free;
 
 	free(port_array);
 	return pid_array;
@@ -583,7 +817,7 @@ static int *create_all_readers(const char *node, const char *port,
 	return NULL;
 }
 
-static void
+static int
 collect_metadata_from_client(struct tracecmd_msg_handle *msg_handle,
 			     int ofd)
 {
@@ -596,7 +830,8 @@ collect_metadata_from_client(struct tracecmd_msg_handle *msg_handle,
 		if (n < 0) {
 			if (errno == EINTR)
 				continue;
-			pdie("reading client");
+			plog("reading client: %s\n", strerror(errno));
+			return -1;
 		}
 		t = n;
 		s = 0;
@@ -605,12 +840,15 @@ collect_metadata_from_client(struct tracecmd_msg_handle *msg_handle,
 			if (s < 0) {
 				if (errno == EINTR)
 					break;
-				pdie("writing to file");
+				plog("writing to file: %s\n", strerror(errno));
+				return -1;
 			}
 			t -= s;
 			s = n - t;
 		} while (t);
 	} while (n > 0 && !tracecmd_msg_done(msg_handle));
+
+	return 0;
 }
 
 static void stop_all_readers(int cpus, int *pid_array)
@@ -631,7 +869,7 @@ static int put_together_file(int cpus, int ofd, const char *node,
 	int ret = -ENOMEM;
 
 	/* Now put together the file */
-	temp_files = malloc(sizeof(*temp_files) * cpus);
+	temp_files = calloc(cpus, sizeof(*temp_files));
 	if (!temp_files)
 		return -ENOMEM;
 
@@ -641,8 +879,7 @@ static int put_together_file(int cpus, int ofd, const char *node,
 			goto out;
 	}
 
-	tracecmd_attach_cpu_data_fd(ofd, cpus, temp_files);
-	ret = 0;
+	ret = tracecmd_attach_cpu_data_fd(ofd, cpus, temp_files);
  out:
 	for (cpu--; cpu >= 0; cpu--) {
 		put_temp_file(temp_files[cpu]);
@@ -651,12 +888,68 @@ static int put_together_file(int cpus, int ofd, const char *node,
 	return ret;
 }
 
+/*
+ * With the v3 protocol, the data of all the CPUs comes after the
+ * metadata, over the same connection. There are no ports to connect
+ * to, the client gets an array of zeros.
+ *
+ * Returns the number of bytes of CPU data received, or a negative error.
+ */
+static long long receive_mux_data(struct tracecmd_msg_handle *msg_handle,
+				  const char *node, const char *port, int ofd)
+{
+	int cpus = msg_handle->cpu_count;
+	long long ret = -ENOMEM;
+	int *port_array;
+	char *tempfile;
+	int *ofds;
+	int cpu;
+
+	port_array = calloc(cpus, sizeof(*port_array));
+	ofds = malloc(sizeof(*ofds) * cpus);
+	if (!port_array || !ofds)
+		goto out_free;
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		tempfile = get_temp_file(node, port, cpu);
+		if (!tempfile)
+			goto out_close;
+		ofds[cpu] = open(tempfile, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+		if (ofds[cpu] < 0) {
+			ret = -errno;
+			plog("creating %s: %s\n", tempfile, strerror(errno));
+			put_temp_file(tempfile);
+			goto out_close;
+		}
+		put_temp_file(tempfile);
+	}
+
+	ret = send_port_array(msg_handle, port_array);
+	if (ret < 0)
+		goto out_close;
+
+	ret = tracecmd_msg_collect_metadata(msg_handle, ofd);
+	if (ret < 0)
+		goto out_close;
+
+	ret = tracecmd_msg_collect_data(msg_handle, ofds);
+
+ out_close:
+	for (cpu--; cpu >= 0; cpu--)
+		close(ofds[cpu]);
+ out_free:
+	free(port_array);
+	free(ofds);
+	return ret;
+}
+
 static int process_client(struct tracecmd_msg_handle *msg_handle,
 			  const char *node, const char *port)
 {
 	int *pid_array;
 	int pagesize;
 	int cpus;
+	int cpu;
 	int ofd;
 	int ret;
 
@@ -665,6 +958,22 @@ static int process_client(struct tracecmd_msg_handle *msg_handle,
 		return pagesize;
 
 	ofd = create_client_file(node, port);
+	if (ofd < 0)
+		return ofd;
+
+	if (msg_handle->version == V3_PROTOCOL) {
+		/* on signal stop this msg */
+		stop_msg_handle = msg_handle;
+		ret = receive_mux_data(msg_handle, node, port, ofd) < 0 ? -1 : 0;
+		stop_msg_handle = NULL;
+
+		cpus = msg_handle->cpu_count;
+		if (!ret)
+			ret = put_together_file(cpus, ofd, node, port);
+		for (cpu = 0; cpu < cpus; cpu++)
+			delete_temp_file(node, port, cpu);
+		return ret;
+	}
 
 	pid_array = create_all_readers(node, port, pagesize, msg_handle);
 	if (!pid_array)
@@ -676,8 +985,8 @@ static int process_client(struct tracecmd_msg_handle *msg_handle,
 	/* Now we are ready to start reading data from the client */
 	if (msg_handle->version == V2_PROTOCOL)
 		tracecmd_msg_collect_metadata(msg_handle, ofd);
-	else
-		collect_metadata_from_client(msg_handle, ofd);
+	else if (collect_metadata_from_client(msg_handle, ofd) < 0)
+		pdie("receiving the metadata of %s:%s", node, port);
 
 	stop_msg_handle = NULL;
 
@@ -699,6 +1008,621 @@ static int process_client(struct tracecmd_msg_handle *msg_handle,
 	return ret;
 }
 
+/*
+ * With --epoll, the listener runs as a single process. Each client is
+ * handled by a thread that talks to it over its connection (which is
+ * mostly idle), and the per CPU data of all the clients is received
+ * by a small pool of workers, that wait on a single epoll instance.
+ *
+ * The streams are added with EPOLLONESHOT, thus a stream is only
+ * handled by one worker at a time, and that worker owns it until it
+ * is armed again. A client stops its streams by shutting down their
+ * sockets, the worker then sees the end of the stream and finishes it.
+ *
+ * All the clients share the process, an error of a client (or of the
+ * file of its data) must not exit it. Instead, the client is marked as
+ * failed and its connection is shut down, which stops the client. The
+ * output file of a failed client is not put together.
+ */
+struct listen_client;
+
+struct listen_stream {
+	struct listen_client	*client;
+	unsigned long long	bytes;
+	int			fd;
+	int			ofd;
+	int			cpu;
+	int			once;
+	bool			tcp;
+	bool			listening;
+	bool			nosplice;
+};
+
+struct listen_client {
+	struct listen_client		*next;
+	struct tracecmd_msg_handle	*msg_handle;
+	struct listen_stream		*streams;
+	struct sockaddr_storage		peer_addr;
+	socklen_t			peer_addr_len;
+	char				host[NI_MAXHOST];
+	char				service[NI_MAXSERV];
+	pthread_mutex_t			lock;
+	pthread_cond_t			cond;
+	unsigned long long		bytes;
+	struct timespec			start;
+	int				cpus;
+	int				page_size;
+	int				active;
+	bool				stopping;
+	bool				failed;
+};
+
+struct listen_worker {
+	pthread_t	thread;
+	char		*buf;
+	size_t		buf_size;
+	int		brass[2];
+	int		pipe_size;
+};
+
+static int nr_workers;
+static struct listen_worker *workers;
+static int epoll_fd = -1;
+static int stop_fd = -1;
+
+static struct listen_client *clients;
+static int nr_clients;
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t clients_cond = PTHREAD_COND_INITIALIZER;
+
+/* Serializes the creation of the output files */
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int arm_stream(struct listen_stream *stream, int op)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	ev.data.ptr = stream;
+	if (epoll_ctl(epoll_fd, op, stream->fd, &ev) < 0) {
+		plog("%s:%s cpu%d: adding the stream: %s\n",
+		     stream->client->host, stream->client->service,
+		     stream->cpu, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Stop a client, after an error on one of its streams */
+static void fail_client(struct listen_client *client)
+{
+	pthread_mutex_lock(&client->lock);
+	if (!client->failed) {
+		client->failed = true;
+		tracecmd_msg_set_done(client->msg_handle);
+		shutdown(client->msg_handle->fd, SHUT_RD);
+	}
+	pthread_mutex_unlock(&client->lock);
+}
+
+static void finish_stream(struct listen_stream *stream)
+{
+	struct listen_client *client = stream->client;
+
+	pthread_mutex_lock(&client->lock);
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, stream->fd, NULL);
+	close(stream->fd);
+	close(stream->ofd);
+	stream->fd = -1;
+	client->bytes += stream->bytes;
+	client->active--;
+	pthread_cond_signal(&client->cond);
+	/* The stream may be freed as soon as the lock is released */
+	pthread_mutex_unlock(&client->lock);
+}
+
+static void accept_stream(struct listen_stream *stream)
+{
+	struct listen_client *client = stream->client;
+	int cfd;
+
+	cfd = accept4(stream->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (cfd < 0) {
+		/* Fails once the listening socket is shut down */
+		if (errno != EAGAIN && errno != EINTR) {
+			finish_stream(stream);
+			return;
+		}
+		if (!arm_stream(stream, EPOLL_CTL_MOD))
+			return;
+		fail_client(client);
+		finish_stream(stream);
+		return;
+	}
+
+	pthread_mutex_lock(&client->lock);
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, stream->fd, NULL);
+	close(stream->fd);
+	stream->fd = cfd;
+	stream->listening = false;
+	if (client->stopping)
+		shutdown(cfd, SHUT_RD);
+	pthread_mutex_unlock(&client->lock);
+
+	if (arm_stream(stream, EPOLL_CTL_ADD) < 0) {
+		fail_client(client);
+		finish_stream(stream);
+	}
+}
+
+static char *worker_buf(struct listen_worker *worker, size_t size)
+{
+	if (worker->buf_size < size) {
+		free(worker->buf);
+		worker->buf_size = 0;
+		worker->buf = malloc(size);
+		if (!worker->buf)
+			return NULL;
+		worker->buf_size = size;
+	}
+
+	return worker->buf;
+}
+
+static void handle_stream(struct listen_worker *worker,
+			  struct listen_stream *stream, unsigned int events)
+{
+	int page_size = stream->client->page_size;
+	char *buf;
+	long r = 0;
+	int i;
+
+	if (stream->listening) {
+		accept_stream(stream);
+		return;
+	}
+
+	for (i = 0; i < STREAM_BATCH; i++) {
+		if (!stream->tcp) {
+			buf = worker_buf(worker, (size_t)page_size * UDP_BATCH_PAGES);
+			if (!buf) {
+				r = -1;
+				break;
+			}
+			r = recv_udp_pages(stream->fd, stream->ofd, page_size,
+					   buf, MSG_DONTWAIT, &stream->once);
+		} else if (stream->nosplice || worker->brass[0] < 0) {
+			buf = worker_buf(worker, worker->pipe_size);
+			if (!buf) {
+				r = -1;
+				break;
+			}
+			r = read(stream->fd, buf, worker->pipe_size);
+			if (r > 0 && write_data(stream->ofd, buf, r) < 0)
+				r = -1;
+		} else {
+			r = splice_tcp_pages(stream->fd, stream->ofd,
+					     worker->brass, worker->pipe_size,
+					     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (r < 0 && errno == EINVAL && !stream->bytes) {
+				stream->nosplice = true;
+				continue;
+			}
+		}
+		if (r <= 0)
+			break;
+		stream->bytes += r;
+	}
+
+	if (r < 0 && errno != EAGAIN && errno != EINTR) {
+		plog("%s:%s cpu%d: %s\n", stream->client->host,
+		     stream->client->service, stream->cpu, strerror(errno));
+		fail_client(stream->client);
+		r = 0;
+	}
+
+	/* A UDP socket that is shut down does not return 0 without waiting */
+	if (r < 0 && (events & (EPOLLRDHUP | EPOLLHUP)))
+		r = 0;
+
+	if (r) {
+		if (!arm_stream(stream, EPOLL_CTL_MOD))
+			return;
+		fail_client(stream->client);
+	}
+
+	finish_stream(stream);
+}
+
+static void *listen_worker(void *data)
+{
+	struct listen_worker *worker = data;
+	struct epoll_event ev;
+	int n;
+
+	for (;;) {
+		n = epoll_wait(epoll_fd, &ev, 1, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			pdie("waiting for client data");
+		}
+		/* The stop_fd has no stream */
+		if (!ev.data.ptr)
+			break;
+		handle_stream(worker, ev.data.ptr, ev.events);
+	}
+
+	return NULL;
+}
+
+static void start_workers(void)
+{
+	struct epoll_event ev;
+	struct rlimit rlim;
+	sigset_t mask, old;
+	int i;
+
+	/* All the sockets and files of all the clients are in this process */
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max) {
+		rlim.rlim_cur = rlim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		pdie("creating epoll");
+
+	/* Wakes up all the workers when it is written to (level triggered) */
+	stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (stop_fd < 0)
+		pdie("creating eventfd");
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &ev) < 0)
+		pdie("adding eventfd");
+
+	workers = calloc(nr_workers, sizeof(*workers));
+	if (!workers)
+		pdie("allocating workers");
+
+	/* Signals are handled by the main thread */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old);
+
+	for (i = 0; i < nr_workers; i++) {
+		struct listen_worker *worker = &workers[i];
+
+		/* The pipe is always empty when a stream is done with it */
+		if (pipe(worker->brass) < 0) {
+			worker->brass[0] = -1;
+			worker->pipe_size = TCP_PIPE_SIZE;
+		} else {
+			fcntl(worker->brass[1], F_SETPIPE_SZ, TCP_PIPE_SIZE);
+			worker->pipe_size = fcntl(worker->brass[1], F_GETPIPE_SZ);
+			if (worker->pipe_size <= 0)
+				worker->pipe_size = page_size;
+		}
+
+		if (pthread_create(&worker->thread, NULL, listen_worker, worker))
+			pdie("creating worker thread");
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void stop_workers(void)
+{
+	unsigned long long val = 1;
+	int i;
+
+	write(stop_fd, &val, sizeof(val));
+
+	for (i = 0; i < nr_workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].brass[0] >= 0) {
+			close(workers[i].brass[0]);
+			close(workers[i].brass[1]);
+		}
+		free(workers[i].buf);
+	}
+	free(workers);
+
+	close(stop_fd);
+	close(epoll_fd);
+}
+
+static int create_all_streams(struct listen_client *client)
+{
+	struct tracecmd_msg_handle *msg_handle = client->msg_handle;
+	int use_tcp = msg_handle->flags & TRACECMD_MSG_FL_USE_TCP;
+	struct listen_stream *stream;
+	char *tempfile;
+	int *port_array;
+	int start_port;
+	int cpu;
+	int ret = -ENOMEM;
+
+	client->cpus = msg_handle->cpu_count;
+
+	port_array = calloc(client->cpus, sizeof(*port_array));
+	client->streams = calloc(client->cpus, sizeof(*client->streams));
+	if (!port_array || !client->streams)
+		goto out;
+
+	for (cpu = 0; cpu < client->cpus; cpu++) {
+		client->streams[cpu].fd = -1;
+		client->streams[cpu].ofd = -1;
+	}
+
+	start_port = START_PORT_SEARCH;
+
+	for (cpu = 0; cpu < client->cpus; cpu++) {
+		stream = &client->streams[cpu];
+		stream->client = client;
+		stream->cpu = cpu;
+		stream->tcp = use_tcp;
+
+		tempfile = get_temp_file(client->host, client->service, cpu);
+		if (!tempfile)
+			goto out_stream;
+		stream->ofd = open(tempfile, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+		if (stream->ofd < 0) {
+			ret = -errno;
+			plog("creating %s: %s\n", tempfile, strerror(errno));
+			put_temp_file(tempfile);
+			goto out_stream;
+		}
+		put_temp_file(tempfile);
+
+		port_array[cpu] = udp_bind_a_port(start_port, &stream->fd, use_tcp);
+		if (port_array[cpu] < 0) {
+			ret = -EADDRNOTAVAIL;
+			goto out_stream;
+		}
+		start_port = port_array[cpu] + 1;
+
+		fcntl(stream->fd, F_SETFL, fcntl(stream->fd, F_GETFL) | O_NONBLOCK);
+		if (use_tcp) {
+			if (listen(stream->fd, backlog) < 0) {
+				ret = -errno;
+				plog("listen: %s\n", strerror(errno));
+				goto out_stream;
+			}
+			stream->listening = true;
+		}
+
+		pthread_mutex_lock(&client->lock);
+		client->active++;
+		pthread_mutex_unlock(&client->lock);
+
+		if (arm_stream(stream, EPOLL_CTL_ADD) < 0) {
+			pthread_mutex_lock(&client->lock);
+			client->active--;
+			pthread_mutex_unlock(&client->lock);
+			ret = -EINVAL;
+			goto out_stream;
+		}
+	}
+
+	ret = send_port_array(msg_handle, port_array);
+ out:
+	free(port_array);
+	return ret;
+
+ out_stream:
+	/* The streams before this one are armed, and stopped by the client */
+	if (stream->fd >= 0)
+		close(stream->fd);
+	if (stream->ofd >= 0)
+		close(stream->ofd);
+	stream->fd = -1;
+	goto out;
+}
+
+static void stop_all_streams(struct listen_client *client)
+{
+	struct timespec ts;
+	int cpu;
+
+	pthread_mutex_lock(&client->lock);
+	client->stopping = true;
+	while (client->active) {
+		/* Shut down the sockets again, in case a connection was accepted */
+		for (cpu = 0; cpu < client->cpus; cpu++) {
+			if (client->streams[cpu].fd >= 0)
+				shutdown(client->streams[cpu].fd, SHUT_RD);
+		}
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&client->cond, &client->lock, &ts);
+	}
+	pthread_mutex_unlock(&client->lock);
+}
+
+static void print_client_stats(struct listen_client *client)
+{
+	struct timespec end;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - client->start.tv_sec) +
+		(end.tv_nsec - client->start.tv_nsec) / 1000000000.0;
+
+	plog("%s:%s: received %llu bytes of %d cpus in %.3f secs (%.3f MB/s)\n",
+	     client->host, client->service, client->bytes, client->cpus,
+	     secs, secs > 0 ? client->bytes / secs / (1024 * 1024) : 0.0);
+}
+
+static void process_client_streams(struct listen_client *client)
+{
+	struct tracecmd_msg_handle *msg_handle = client->msg_handle;
+	long long bytes;
+	int ret;
+	int ofd;
+	int cpu;
+
+	client->page_size = communicate_with_client(msg_handle);
+	if (client->page_size <= 0)
+		return;
+
+	ofd = create_client_file(client->host, client->service);
+	if (ofd < 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &client->start);
+
+	/* The data comes over the connection of the client */
+	if (msg_handle->version == V3_PROTOCOL) {
+		client->cpus = msg_handle->cpu_count;
+		bytes = receive_mux_data(msg_handle, client->host,
+					 client->service, ofd);
+		ret = bytes < 0 ? -1 : 0;
+		if (bytes > 0)
+			client->bytes = bytes;
+		goto out;
+	}
+
+	ret = create_all_streams(client);
+	if (ret < 0)
+		goto out;
+
+	/* Now we are ready to start reading data from the client */
+	if (msg_handle->version == V2_PROTOCOL)
+		tracecmd_msg_collect_metadata(msg_handle, ofd);
+	else
+		ret = collect_metadata_from_client(msg_handle, ofd);
+
+	/* wait a little to let the workers finish reading */
+	if (!done)
+		sleep(1);
+
+ out:
+	stop_all_streams(client);
+
+	if (client->failed) {
+		plog("%s:%s: failed, dropping its data\n",
+		     client->host, client->service);
+		ret = -1;
+	}
+
+	if (ret >= 0) {
+		print_client_stats(client);
+
+		pthread_mutex_lock(&output_lock);
+		put_together_file(client->cpus, ofd, client->host,
+				  client->service);
+		pthread_mutex_unlock(&output_lock);
+	}
+
+	for (cpu = 0; cpu < client->cpus; cpu++)
+		delete_temp_file(client->host, client->service, cpu);
+
+	close(ofd);
+}
+
+static void *listen_client_thread(void *data)
+{
+	struct listen_client *client = data;
+	struct listen_client **last;
+	int s;
+
+	s = getnameinfo((struct sockaddr *)&client->peer_addr,
+			client->peer_addr_len,
+			client->host, NI_MAXHOST,
+			client->service, NI_MAXSERV, NI_NUMERICSERV);
+
+	if (s == 0) {
+		plog("Connected with %s:%s\n", client->host, client->service);
+		process_client_streams(client);
+	} else
+		plog("Error with getnameinfo: %s\n", gai_strerror(s));
+
+	tracecmd_msg_handle_close(client->msg_handle);
+
+	pthread_mutex_lock(&clients_lock);
+	for (last = &clients; *last; last = &(*last)->next) {
+		if (*last == client) {
+			*last = client->next;
+			break;
+		}
+	}
+	nr_clients--;
+	pthread_cond_signal(&clients_cond);
+	pthread_mutex_unlock(&clients_lock);
+
+	pthread_mutex_destroy(&client->lock);
+	pthread_cond_destroy(&client->cond);
+	free(client->streams);
+	free(client);
+
+	return NULL;
+}
+
+static int start_client_thread(int cfd, struct sockaddr_storage *peer_addr,
+			       socklen_t peer_addr_len)
+{
+	struct listen_client *client;
+	sigset_t mask, old;
+	pthread_t thread;
+	int ret;
+
+	client = calloc(1, sizeof(*client));
+	if (!client) {
+		close(cfd);
+		return -1;
+	}
+
+	client->msg_handle = tracecmd_msg_handle_alloc(cfd, TRACECMD_MSG_FL_SERVER);
+	if (!client->msg_handle) {
+		close(cfd);
+		free(client);
+		return -1;
+	}
+	memcpy(&client->peer_addr, peer_addr, peer_addr_len);
+	client->peer_addr_len = peer_addr_len;
+	pthread_mutex_init(&client->lock, NULL);
+	pthread_cond_init(&client->cond, NULL);
+
+	pthread_mutex_lock(&clients_lock);
+	client->next = clients;
+	clients = client;
+	nr_clients++;
+	pthread_mutex_unlock(&clients_lock);
+
+	/* Signals are handled by the main thread */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old);
+	ret = pthread_create(&thread, NULL, listen_client_thread, client);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret) {
+		warning("failed to create client thread");
+		/* Let the client clean up after itself */
+		listen_client_thread(client);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
+
+/* Stop all the clients, and wait for their files to be written */
+static void stop_client_threads(void)
+{
+	struct listen_client *client;
+
+	pthread_mutex_lock(&clients_lock);
+	for (client = clients; client; client = client->next) {
+		tracecmd_msg_set_done(client->msg_handle);
+		shutdown(client->msg_handle->fd, SHUT_RD);
+	}
+	while (nr_clients)
+		pthread_cond_wait(&clients_cond, &clients_lock);
+	pthread_mutex_unlock(&clients_lock);
+}
+
 static int do_fork(int cfd)
 {
 	pid_t pid;
@@ -731,6 +1655,9 @@ static int do_connection(int cfd, struct sockaddr_storage *peer_addr,
 	int s;
 	int ret;
 
+	if (nr_workers)
+		return start_client_thread(cfd, peer_addr, peer_addr_len);
+
 	ret = do_fork(cfd);
 	if (ret)
 		return ret;
@@ -930,9 +1857,16 @@ static void do_listen(char *port)
 	if (listen(sfd, backlog) < 0)
 		pdie("listen");
 
+	if (nr_workers)
+		start_workers();
+
 	do_accept_loop(sfd);
 
-	kill_clients();
+	if (nr_workers) {
+		stop_client_threads();
+		stop_workers();
+	} else
+		kill_clients();
 
 	remove_pid_file();
 }
@@ -946,6 +1880,7 @@ static void start_daemon(void)
 }
 
 enum {
+	OPT_epoll	= 254,
 	OPT_debug	= 255,
 };
 
@@ -968,6 +1903,7 @@ void trace_listen(int argc, char **argv)
 			{"port", required_argument, NULL, 'p'},
 			{"help", no_argument, NULL, '?'},
 			{"debug", no_argument, NULL, OPT_debug},
+			{"epoll", optional_argument, NULL, OPT_epoll},
 			{NULL, 0, NULL, 0}
 		};
 
@@ -997,6 +1933,11 @@ void trace_listen(int argc, char **argv)
 		case OPT_debug:
 			debug = 1;
 			break;
+		case OPT_epoll:
+			nr_workers = optarg ? atoi(optarg) : 1;
+			if (nr_workers < 1)
+				die("--epoll needs at least one worker");
+			break;
 		default:
 			usage(argv);
 		}
@@ -19,6 +19,7 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <linux/types.h>
 
 #include "trace-cmd-local.h"
@@ -61,6 +62,16 @@ static inline void dprint(const char *fmt, ...)
 #define MIN_META_SIZE	(sizeof(struct tracecmd_msg_header) + \
 			 sizeof(struct tracecmd_msg_meta))
 
+#define MIN_DATA_SIZE	(sizeof(struct tracecmd_msg_header) + \
+			 sizeof(struct tracecmd_msg_data))
+
+/*
+ * With the v3 protocol, the pages of all the CPUs are sent over the
+ * connection of the messages, batched into SENDDATA messages that are
+ * much larger than the other messages.
+ */
+#define MSG_DATA_MAX_LEN		(1024 * 1024)
+
 unsigned int page_size;
 
 struct tracecmd_msg_server {
@@ -98,6 +109,11 @@ struct tracecmd_msg_meta {
 	be32 size;
 } __attribute__((packed));
 
+struct tracecmd_msg_data {
+	be32 cpu;
+	be32 size;
+} __attribute__((packed));
+
 struct tracecmd_msg_header {
 	be32	size;
 	be32	cmd;
@@ -111,7 +127,8 @@ struct tracecmd_msg_header {
 	C(TINIT,	4,	MIN_TINIT_SIZE),	\
 	C(RINIT,	5,	MIN_RINIT_SIZE),	\
 	C(SENDMETA,	6,	MIN_META_SIZE),		\
-	C(FINMETA,	7,	0),
+	C(FINMETA,	7,	0),			\
+	C(SENDDATA,	8,	MIN_DATA_SIZE),
 
 #undef C
 #define C(a,b,c)	MSG_##a = b
@@ -132,7 +149,7 @@ static const char *msg_names[] = { MSG_MAP };
 
 static const char *cmd_to_name(int cmd)
 {
-	if (cmd <= MSG_FINMETA)
+	if (cmd <= MSG_SENDDATA)
 		return msg_names[cmd];
 	return "Unkown";
 }
@@ -159,7 +176,7 @@ static int msg_write(int fd, struct tracecmd_msg *msg)
 	int size;
 	int ret;
 
-	if (cmd > MSG_FINMETA)
+	if (cmd > MSG_SENDDATA)
 		return -EINVAL;
 
 	dprint("msg send: %d (%s)\n", cmd, cmd_to_name(cmd));
@@ -298,7 +315,8 @@ static int msg_read_extra(int fd, struct tracecmd_msg *msg,
 	int ret;
 
 	cmd = ntohl(msg->hdr.cmd);
-	if (cmd > MSG_FINMETA)
+	/* SENDDATA is only read by tracecmd_msg_collect_data() */
+	if (cmd >= MSG_SENDDATA)
 		return -EINVAL;
 
 	rsize = msg_min_sizes[cmd] - *n;
@@ -690,6 +708,10 @@ int tracecmd_msg_collect_metadata(struct tracecmd_msg_handle *msg_handle, int of
 		} while (t);
 	} while (cmd == MSG_SENDMETA);
 
+	/* The data and the close message follow, see tracecmd_msg_collect_data() */
+	if (msg_handle->version == V3_PROTOCOL)
+		return 0;
+
 	/* check the finish message of the client */
 	while (!tracecmd_msg_done(msg_handle)) {
 		ret = tracecmd_msg_recv(msg_handle->fd, &msg);
@@ -715,3 +737,165 @@ error:
 	error_operation_for_server(&msg);
 	return ret;
 }
+
+static int msg_writev(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t w;
+
+	while (cnt) {
+		w = writev(fd, iov, cnt);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		while (cnt && w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base += w;
+			iov->iov_len -= w;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * tracecmd_msg_data_send - send the data of a CPU to the server (v3)
+ * @msg_handle: the handle of the connection
+ * @cpu: the CPU the data belongs to
+ * @buf: the data
+ * @size: the size of @buf
+ *
+ * The data is sent in SENDDATA messages of up to MSG_DATA_MAX_LEN,
+ * over the connection of the messages. Callers should batch as much
+ * data as they have into a single call.
+ *
+ * Returns 0 on success, or a negative error.
+ */
+int tracecmd_msg_data_send(struct tracecmd_msg_handle *msg_handle,
+			   int cpu, const char *buf, int size)
+{
+	struct tracecmd_msg_header hdr;
+	struct tracecmd_msg_data data;
+	struct iovec iov[3];
+	int n;
+	int ret;
+
+	while (size) {
+		n = size;
+		if (n > MSG_DATA_MAX_LEN - MIN_DATA_SIZE)
+			n = MSG_DATA_MAX_LEN - MIN_DATA_SIZE;
+
+		hdr.cmd = htonl(MSG_SENDDATA);
+		hdr.size = htonl(MIN_DATA_SIZE + n);
+		data.cpu = htonl(cpu);
+		data.size = htonl(n);
+
+		iov[0].iov_base = &hdr;
+		iov[0].iov_len = sizeof(hdr);
+		iov[1].iov_base = &data;
+		iov[1].iov_len = sizeof(data);
+		iov[2].iov_base = (void *)buf;
+		iov[2].iov_len = n;
+
+		ret = msg_writev(msg_handle->fd, iov, 3);
+		if (ret < 0)
+			return ret;
+
+		buf += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+#define DATA_BUF_SIZE	(64 * 1024)
+
+/**
+ * tracecmd_msg_collect_data - receive the data of all the CPUs (v3)
+ * @msg_handle: the handle of the connection
+ * @ofds: the files to write the data of each CPU into
+ *
+ * Called after tracecmd_msg_collect_metadata(), it writes the data
+ * of the SENDDATA messages into the file of their CPU, until the
+ * client closes the connection.
+ *
+ * Returns the number of bytes received, or a negative error.
+ */
+long long tracecmd_msg_collect_data(struct tracecmd_msg_handle *msg_handle,
+				    int *ofds)
+{
+	struct tracecmd_msg_header hdr;
+	struct tracecmd_msg_data data;
+	int fd = msg_handle->fd;
+	long long total = 0;
+	char *buf;
+	u32 size, cpu, cmd;
+	int ret = 0;
+	int n;
+
+	buf = malloc(DATA_BUF_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	while (!tracecmd_msg_done(msg_handle)) {
+		n = 0;
+		ret = msg_read(fd, &hdr, MSG_HDR_LEN, &n);
+		if (ret < 0) {
+			warning("reading client");
+			break;
+		}
+
+		cmd = ntohl(hdr.cmd);
+		if (cmd == MSG_CLOSE)
+			/* Finish this connection */
+			break;
+
+		size = ntohl(hdr.size);
+		if (cmd != MSG_SENDDATA || size < MIN_DATA_SIZE ||
+		    size > MSG_DATA_MAX_LEN) {
+			warning("Message: cmd=%d size=%d\n", cmd, size);
+			ret = -EINVAL;
+			break;
+		}
+
+		n = 0;
+		ret = msg_read(fd, &data, sizeof(data), &n);
+		if (ret < 0)
+			break;
+
+		cpu = ntohl(data.cpu);
+		size = ntohl(data.size);
+		if (cpu >= msg_handle->cpu_count ||
+		    size != ntohl(hdr.size) - MIN_DATA_SIZE) {
+			warning("Bad data of cpu %d size %d", cpu, size);
+			ret = -EINVAL;
+			break;
+		}
+
+		while (size) {
+			n = 0;
+			ret = msg_read(fd, buf, size < DATA_BUF_SIZE ?
+				       size : DATA_BUF_SIZE, &n);
+			if (ret < 0)
+				break;
+			ret = __do_write_check(ofds[cpu], buf, n);
+			if (ret < 0) {
+				warning("writing to file");
+				break;
+			}
+			size -= n;
+			total += n;
+		}
+		if (ret < 0)
+			break;
+	}
+
+	free(buf);
+
+	return ret < 0 ? ret : total;
+}
@@ -19,6 +19,8 @@
 #include <ctype.h>
 #include <errno.h>
 #include <glob.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "trace-cmd-local.h"
 #include "list.h"
@@ -56,6 +58,8 @@ struct tracecmd_output {
 	int			nr_options;
 	struct list_head 	options;
 	struct tracecmd_msg_handle *msg_handle;
+	struct tracecmd_compression *compress;
+	struct cpu_data_writers	*writers;
 };
 
 struct list_event {
@@ -111,12 +115,16 @@ void tracecmd_output_free(struct tracecmd_output *handle)
 	if (!handle)
 		return;
 
+	tracecmd_wait_cpu_data(handle);
+
 	if (handle->tracing_dir)
 		free(handle->tracing_dir);
 
 	if (handle->pevent)
 		tep_unref(handle->pevent);
 
+	tracecmd_compress_free(handle->compress);
+
 	while (!list_empty(&handle->options)) {
 		option = container_of(handle->options.next,
 				      struct tracecmd_option, list);
@@ -133,6 +141,9 @@ void tracecmd_output_close(struct tracecmd_output *handle)
 	if (!handle)
 		return;
 
+	/* The writers of the CPU data still use the file */
+	tracecmd_wait_cpu_data(handle);
+
 	if (handle->fd >= 0) {
 		close(handle->fd);
 		handle->fd = -1;
@@ -208,6 +219,295 @@ static tsize_t copy_file(struct tracecmd_output *handle,
 	return size;
 }
 
+/* The buffer used to copy CPU data that the kernel can not copy itself */
+#define COPY_BUF_SIZE	(1024 * 1024)
+
+/* The most that is asked of copy_file_range() at once */
+#define COPY_RANGE_SIZE	(1024 * 1024 * 1024)
+
+/* The most threads that copy CPU data into the output file */
+#define MAX_CPU_DATA_WRITERS	8
+
+/* The data of a CPU to copy into the output file */
+struct cpu_data_copy {
+	struct cpu_data_copy	*next;
+	char			*file;
+	off64_t			offset;
+	tsize_t			size;
+};
+
+/*
+ * The offsets of the data of all the CPUs are known before it is
+ * copied, so the copies are done by threads, at the same time.
+ */
+struct cpu_data_writers {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct cpu_data_copy	*copies;
+	struct cpu_data_copy	**tail;
+	pthread_t		*threads;
+	int			nr_threads;
+	int			closing;
+	int			failed;
+	int			fd;
+};
+
+static tsize_t copy_data_fd(int fd, int out_fd, off64_t offset)
+{
+	tsize_t size = 0;
+	stsize_t r, w, n;
+	char *buf;
+
+	buf = malloc(COPY_BUF_SIZE);
+	if (!buf)
+		return 0;
+
+	do {
+		r = read(fd, buf, COPY_BUF_SIZE);
+		for (w = 0; w < r; w += n) {
+			n = pwrite(out_fd, buf + w, r - w, offset + size + w);
+			if (n <= 0) {
+				size = 0;
+				goto out;
+			}
+		}
+		if (r > 0)
+			size += r;
+	} while (r > 0);
+ out:
+	free(buf);
+
+	return size;
+}
+
+/*
+ * Copy the data of a CPU at @offset of the output file. With
+ * copy_file_range(), the data does not go through user space, and
+ * file systems that support reflinks (XFS, btrfs) share the blocks of
+ * the temp file instead of copying them, as the offset is page aligned.
+ */
+static tsize_t copy_cpu_data(int out_fd, const char *file, off64_t offset)
+{
+	tsize_t size = 0;
+	tsize_t ret;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		warning("Can't read '%s'", file);
+		return 0;
+	}
+
+#ifdef HAVE_COPY_FILE_RANGE
+	for (;;) {
+		off64_t off_out = offset + size;
+		stsize_t r;
+
+		r = copy_file_range(fd, NULL, out_fd, &off_out,
+				    COPY_RANGE_SIZE, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		/*
+		 * Not supported between these files (or by this kernel),
+		 * copy the rest by hand.
+		 */
+		if (r < 0)
+			break;
+		if (!r) {
+			close(fd);
+			return size;
+		}
+		size += r;
+	}
+#endif
+
+	ret = copy_data_fd(fd, out_fd, offset + size);
+	close(fd);
+
+	return ret ? size + ret : size;
+}
+
+static int do_cpu_data_copy(int out_fd, struct cpu_data_copy *copy)
+{
+	tsize_t size;
+
+	size = copy_cpu_data(out_fd, copy->file, copy->offset);
+	if (size != copy->size) {
+		errno = EINVAL;
+		warning("did not match size of %lld to %lld",
+			size, copy->size);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void *cpu_data_writer(void *data)
+{
+	struct cpu_data_writers *writers = data;
+	struct cpu_data_copy *copy;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&writers->lock);
+		while (!writers->copies && !writers->closing)
+			pthread_cond_wait(&writers->cond, &writers->lock);
+		copy = writers->copies;
+		if (copy) {
+			writers->copies = copy->next;
+			if (!writers->copies)
+				writers->tail = &writers->copies;
+		}
+		pthread_mutex_unlock(&writers->lock);
+
+		if (!copy)
+			break;
+
+		ret = do_cpu_data_copy(writers->fd, copy);
+		free(copy->file);
+		free(copy);
+
+		if (ret < 0) {
+			pthread_mutex_lock(&writers->lock);
+			writers->failed = 1;
+			pthread_mutex_unlock(&writers->lock);
+		}
+	}
+
+	return NULL;
+}
+
+static struct cpu_data_writers *start_cpu_data_writers(int fd)
+{
+	struct cpu_data_writers *writers;
+	sigset_t mask, old;
+	long nr;
+
+	nr = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr > MAX_CPU_DATA_WRITERS)
+		nr = MAX_CPU_DATA_WRITERS;
+	if (nr < 1)
+		nr = 1;
+
+	writers = calloc(1, sizeof(*writers));
+	if (!writers)
+		return NULL;
+	writers->threads = calloc(nr, sizeof(*writers->threads));
+	if (!writers->threads) {
+		free(writers);
+		return NULL;
+	}
+
+	pthread_mutex_init(&writers->lock, NULL);
+	pthread_cond_init(&writers->cond, NULL);
+	writers->tail = &writers->copies;
+	writers->fd = fd;
+
+	/* Signals are for the thread that writes the rest of the file */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old);
+	for (; writers->nr_threads < nr; writers->nr_threads++) {
+		if (pthread_create(&writers->threads[writers->nr_threads],
+				   NULL, cpu_data_writer, writers))
+			break;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (!writers->nr_threads) {
+		pthread_mutex_destroy(&writers->lock);
+		pthread_cond_destroy(&writers->cond);
+		free(writers->threads);
+		free(writers);
+		return NULL;
+	}
+
+	return writers;
+}
+
+/*
+ * Copy the data of @file to @offset of the output file. This is done
+ * by a writer thread, if they could be started, which may be after
+ * this returns. Use tracecmd_wait_cpu_data() to wait for the copies,
+ * before the file is removed.
+ */
+static int queue_cpu_data(struct tracecmd_output *handle, const char *file,
+			  off64_t offset, tsize_t size)
+{
+	struct cpu_data_writers *writers;
+	struct cpu_data_copy *copy;
+	int ret;
+
+	copy = calloc(1, sizeof(*copy));
+	if (!copy)
+		return -1;
+	copy->file = strdup(file);
+	if (!copy->file) {
+		free(copy);
+		return -1;
+	}
+	copy->offset = offset;
+	copy->size = size;
+
+	if (!handle->writers)
+		handle->writers = start_cpu_data_writers(handle->fd);
+
+	writers = handle->writers;
+	if (!writers) {
+		ret = do_cpu_data_copy(handle->fd, copy);
+		free(copy->file);
+		free(copy);
+		return ret;
+	}
+
+	pthread_mutex_lock(&writers->lock);
+	*writers->tail = copy;
+	writers->tail = &copy->next;
+	pthread_cond_signal(&writers->cond);
+	pthread_mutex_unlock(&writers->lock);
+
+	return 0;
+}
+
+/**
+ * tracecmd_wait_cpu_data - wait for the CPU data to be written
+ * @handle: the output handle
+ *
+ * The CPU data files given to tracecmd_append_cpu_data() and
+ * tracecmd_append_buffer_cpu_data() are copied by threads, that keep
+ * running across the appends, so that the files of all the buffers are
+ * copied at the same time. The files must not be removed before this
+ * returns (tracecmd_output_close() also waits for the copies).
+ *
+ * Returns 0 on success, or -1 if any of the copies failed.
+ */
+int tracecmd_wait_cpu_data(struct tracecmd_output *handle)
+{
+	struct cpu_data_writers *writers = handle->writers;
+	int ret;
+	int i;
+
+	if (!writers)
+		return 0;
+
+	pthread_mutex_lock(&writers->lock);
+	writers->closing = 1;
+	pthread_cond_broadcast(&writers->cond);
+	pthread_mutex_unlock(&writers->lock);
+
+	for (i = 0; i < writers->nr_threads; i++)
+		pthread_join(writers->threads[i], NULL);
+
+	ret = writers->failed ? -1 : 0;
+
+	pthread_mutex_destroy(&writers->lock);
+	pthread_cond_destroy(&writers->cond);
+	free(writers->threads);
+	free(writers);
+	handle->writers = NULL;
+
+	return ret;
+}
+
 /*
  * Finds the path to the debugfs/tracing
  * Allocates the string and stores it.
@@ -1077,6 +1377,239 @@ out_free:
 	return NULL;
 }
 
+/**
+ * tracecmd_output_set_compression - compress the trace data of the file
+ * @handle: the output handle, before its options are written
+ * @spec: the codec to use, "name" or "name:level" (NULL for the default)
+ *
+ * The CPU data added by tracecmd_append_cpu_data() and
+ * tracecmd_append_buffer_cpu_data() is then saved compressed, in a
+ * "flycompr" section instead of "flyrecord".
+ *
+ * Returns 0 on success, and -1 if the codec is not supported, or the
+ * options were already written.
+ */
+int tracecmd_output_set_compression(struct tracecmd_output *handle,
+				    const char *spec)
+{
+	struct tracecmd_compression *compress;
+	const char *name;
+
+	/* The data is compressed when it is added to a file */
+	if (handle->options_written || handle->compress || handle->msg_handle)
+		return -1;
+
+	compress = tracecmd_compress_alloc(spec);
+	if (!compress)
+		return -1;
+
+	name = tracecmd_compress_name(compress);
+	if (!tracecmd_add_option(handle, TRACECMD_OPTION_COMPRESSION,
+				 strlen(name) + 1, name)) {
+		tracecmd_compress_free(compress);
+		return -1;
+	}
+
+	handle->compress = compress;
+
+	return 0;
+}
+
+static stsize_t read_full(int fd, char *buf, size_t size)
+{
+	size_t tot = 0;
+	stsize_t r;
+
+	while (tot < size) {
+		r = read(fd, buf + tot, size - tot);
+		if (r < 0)
+			return r;
+		if (!r)
+			break;
+		tot += r;
+	}
+
+	return tot;
+}
+
+/*
+ * The data of a CPU in the "flycompr" section is saved as:
+ *
+ *  8 bytes: the size of the uncompressed data
+ *  4 bytes: the size of the chunks the data is split into
+ *  4 bytes: the number of chunks (N)
+ *  (N + 1) * 8 bytes: the offsets of the chunks from the start of the
+ *                     data of the CPU, the last one is the end of it
+ *  the compressed chunks
+ *
+ * Returns the size written, or -1 on error.
+ */
+static stsize_t compress_file(struct tracecmd_output *handle,
+			      const char *file, unsigned long long size)
+{
+	unsigned int chunk_size = TRACECMD_COMPRESS_CHUNK_PAGES * handle->page_size;
+	unsigned long long *index = NULL;
+	unsigned long long check_size = 0;
+	unsigned long long endian8;
+	unsigned int nr_chunks;
+	unsigned int endian4;
+	stsize_t ret = -1;
+	tsize_t offset;
+	off64_t start;
+	char *in = NULL;
+	char *out = NULL;
+	size_t out_size;
+	stsize_t r;
+	long csize;
+	unsigned int i;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		warning("Can't read '%s'", file);
+		return -1;
+	}
+
+	nr_chunks = (size + chunk_size - 1) / chunk_size;
+	out_size = tracecmd_compress_bound(handle->compress, chunk_size);
+
+	in = malloc(chunk_size);
+	out = malloc(out_size);
+	index = calloc(nr_chunks + 1, 8);
+	if (!in || !out || !index)
+		goto out_free;
+
+	start = lseek64(handle->fd, 0, SEEK_CUR);
+
+	endian8 = convert_endian_8(handle, size);
+	if (do_write_check(handle, &endian8, 8))
+		goto out_free;
+	endian4 = convert_endian_4(handle, chunk_size);
+	if (do_write_check(handle, &endian4, 4))
+		goto out_free;
+	endian4 = convert_endian_4(handle, nr_chunks);
+	if (do_write_check(handle, &endian4, 4))
+		goto out_free;
+
+	/* Make room for the index, it is written after the chunks */
+	if (do_write_check(handle, index, (nr_chunks + 1) * 8))
+		goto out_free;
+
+	offset = 16 + (nr_chunks + 1) * 8;
+
+	for (i = 0; i < nr_chunks; i++) {
+		r = read_full(fd, in, chunk_size);
+		if (r <= 0)
+			break;
+		check_size += r;
+
+		csize = tracecmd_compress(handle->compress, out, out_size, in, r);
+		if (csize < 0) {
+			warning("failed to compress '%s'", file);
+			goto out_free;
+		}
+		if (do_write_check(handle, out, csize))
+			goto out_free;
+
+		index[i] = convert_endian_8(handle, offset);
+		offset += csize;
+	}
+	index[nr_chunks] = convert_endian_8(handle, offset);
+
+	if (check_size != size) {
+		errno = EINVAL;
+		warning("did not match size of %lld to %lld", check_size, size);
+		goto out_free;
+	}
+
+	if (lseek64(handle->fd, start + 16, SEEK_SET) == (off64_t)-1 ||
+	    do_write_check(handle, index, (nr_chunks + 1) * 8) ||
+	    lseek64(handle->fd, start + offset, SEEK_SET) == (off64_t)-1)
+		goto out_free;
+
+	ret = offset;
+
+ out_free:
+	close(fd);
+	free(in);
+	free(out);
+	free(index);
+
+	return ret;
+}
+
+static int append_compressed_cpu_data(struct tracecmd_output *handle,
+				      int cpus, char * const *cpu_data_files)
+{
+	unsigned long long *offsets = NULL;
+	unsigned long long *sizes = NULL;
+	unsigned long long endian8;
+	off64_t table;
+	struct stat st;
+	stsize_t size;
+	int ret = -1;
+	int i;
+
+	if (do_write_check(handle, "flycompr ", 10))
+		return -1;
+
+	offsets = calloc(cpus, sizeof(*offsets));
+	sizes = calloc(cpus, sizeof(*sizes));
+	if (!offsets || !sizes)
+		goto out_free;
+
+	/* The table of the CPU data is written when the data is */
+	table = lseek64(handle->fd, 0, SEEK_CUR);
+	for (i = 0; i < cpus * 2; i++) {
+		if (do_write_check(handle, sizes, 8))
+			goto out_free;
+	}
+
+	if (save_tracing_file_data(handle, "trace_clock") < 0)
+		goto out_free;
+
+	for (i = 0; i < cpus; i++) {
+		if (stat(cpu_data_files[i], &st) < 0) {
+			warning("can not stat '%s'", cpu_data_files[i]);
+			goto out_free;
+		}
+		offsets[i] = lseek64(handle->fd, 0, SEEK_CUR);
+		size = compress_file(handle, cpu_data_files[i], st.st_size);
+		if (size < 0)
+			goto out_free;
+		sizes[i] = size;
+
+		if (!quiet)
+			fprintf(stderr, "CPU%d data recorded at offset=0x%llx\n"
+				"    %llu bytes in size (%llu compressed)\n",
+				i, offsets[i], (unsigned long long)st.st_size,
+				sizes[i]);
+	}
+
+	if (lseek64(handle->fd, table, SEEK_SET) == (off64_t)-1)
+		goto out_free;
+
+	for (i = 0; i < cpus; i++) {
+		endian8 = convert_endian_8(handle, offsets[i]);
+		if (do_write_check(handle, &endian8, 8))
+			goto out_free;
+		endian8 = convert_endian_8(handle, sizes[i]);
+		if (do_write_check(handle, &endian8, 8))
+			goto out_free;
+	}
+
+	if (lseek64(handle->fd, 0, SEEK_END) == (off64_t)-1)
+		goto out_free;
+
+	ret = 0;
+
+ out_free:
+	free(offsets);
+	free(sizes);
+
+	return ret;
+}
+
 static int __tracecmd_append_cpu_data(struct tracecmd_output *handle,
 				      int cpus, char * const *cpu_data_files)
 {
@@ -1084,12 +1617,14 @@ static int __tracecmd_append_cpu_data(struct tracecmd_output *handle,
 	unsigned long long *sizes = NULL;
 	off64_t offset;
 	unsigned long long endian8;
-	off64_t check_size;
 	char *file;
 	struct stat st;
 	int ret;
 	int i;
 
+	if (handle->compress)
+		return append_compressed_cpu_data(handle, cpus, cpu_data_files);
+
 	if (do_write_check(handle, "flyrecord", 10))
 		goto out_free;
 
@@ -1152,24 +1687,28 @@ static int __tracecmd_append_cpu_data(struct tracecmd_output *handle,
 		goto out_free;
 
 	for (i = 0; i < cpus; i++) {
-		if (!quiet)
+		if (!quiet) {
 			fprintf(stderr, "CPU%d data recorded at offset=0x%llx\n",
 				i, (unsigned long long) offsets[i]);
-		offset = lseek64(handle->fd, offsets[i], SEEK_SET);
-		if (offset == (off64_t)-1) {
-			warning("could not seek to %lld\n", offsets[i]);
-			goto out_free;
+			fprintf(stderr, "    %llu bytes in size\n", sizes[i]);
 		}
-		check_size = copy_file(handle, cpu_data_files[i]);
-		if (check_size != sizes[i]) {
-			errno = EINVAL;
-			warning("did not match size of %lld to %lld",
-			    check_size, sizes[i]);
+		if (queue_cpu_data(handle, cpu_data_files[i],
+				   offsets[i], sizes[i]) < 0)
+			goto out_free;
+	}
+
+	/*
+	 * The data is copied at its offsets, go to where the last copy
+	 * ends, for what is written after it (like another buffer).
+	 */
+	if (cpus) {
+		offset = lseek64(handle->fd, offsets[cpus - 1] + sizes[cpus - 1],
+				 SEEK_SET);
+		if (offset == (off64_t)-1) {
+			warning("could not seek to %lld\n",
+				offsets[cpus - 1] + sizes[cpus - 1]);
 			goto out_free;
 		}
-		if (!quiet)
-			fprintf(stderr, "    %llu bytes in size\n",
-				(unsigned long long)check_size);
 	}
 
 	free(offsets);
@@ -1178,11 +1717,24 @@ static int __tracecmd_append_cpu_data(struct tracecmd_output *handle,
 	return 0;
 
  out_free:
+	tracecmd_wait_cpu_data(handle);
 	free(offsets);
 	free(sizes);
 	return -1;
 }
 
+/**
+ * tracecmd_append_cpu_data - write the CPU data files into the output
+ * @handle: the output handle
+ * @cpus: the number of CPU data files
+ * @cpu_data_files: the CPU data files
+ *
+ * The files are copied by several threads when possible, which may
+ * still be copying them when this returns. Use tracecmd_wait_cpu_data()
+ * before removing the files.
+ *
+ * Returns 0 on success, or -1 on failure.
+ */
 int tracecmd_append_cpu_data(struct tracecmd_output *handle,
 			     int cpus, char * const *cpu_data_files)
 {
@@ -1198,6 +1750,18 @@ int tracecmd_append_cpu_data(struct tracecmd_output *handle,
 	return __tracecmd_append_cpu_data(handle, cpus, cpu_data_files);
 }
 
+/**
+ * tracecmd_append_buffer_cpu_data - write the CPU data files of a buffer
+ * @handle: the output handle
+ * @option: the option of the buffer, from tracecmd_add_buffer_option()
+ * @cpus: the number of CPU data files
+ * @cpu_data_files: the CPU data files
+ *
+ * Like tracecmd_append_cpu_data(), the files may still be copied when
+ * this returns, along with the files of the other buffers.
+ *
+ * Returns 0 on success, or -1 on failure.
+ */
 int tracecmd_append_buffer_cpu_data(struct tracecmd_output *handle,
 				    struct tracecmd_option *option,
 				    int cpus, char * const *cpu_data_files)
@@ -1264,7 +1828,8 @@ int tracecmd_attach_cpu_data_fd(int fd, int cpus, char * const *cpu_data_files)
 	handle->page_size = tracecmd_page_size(ihandle);
 	list_head_init(&handle->options);
 
-	if (tracecmd_append_cpu_data(handle, cpus, cpu_data_files) >= 0)
+	if (tracecmd_append_cpu_data(handle, cpus, cpu_data_files) >= 0 &&
+	    tracecmd_wait_cpu_data(handle) >= 0)
 		ret = 0;
 
 	tracecmd_output_close(handle);
@@ -1295,7 +1860,8 @@ tracecmd_create_file_glob(const char *output_file,
 	if (!handle)
 		return NULL;
 
-	if (tracecmd_append_cpu_data(handle, cpus, cpu_data_files) < 0) {
+	if (tracecmd_append_cpu_data(handle, cpus, cpu_data_files) < 0 ||
+	    tracecmd_wait_cpu_data(handle) < 0) {
 		tracecmd_output_close(handle);
 		return NULL;
 	}
@@ -1010,28 +1010,8 @@ static struct tep_record *get_next_record(struct handle_list *handles)
 	pevent = tracecmd_get_pevent(handles->handle);
 
 	do {
-		if (filter_cpus) {
-			long long last_stamp = -1;
-			struct tep_record *precord;
-			int first_record = 1;
-			int next_cpu = -1;
-			int i;
-
-			for (i = 0; (cpu = filter_cpus[i]) >= 0; i++) {
-				precord = tracecmd_peek_data(handles->handle, cpu);
-				if (precord &&
-				    (first_record || precord->ts < last_stamp)) {
-					next_cpu = cpu;
-					last_stamp = precord->ts;
-					first_record = 0;
-				}
-			}
-			if (!first_record)
-				record = tracecmd_read_data(handles->handle, next_cpu);
-			else
-				record = NULL;
-		} else
-			record = tracecmd_read_next_data(handles->handle, &cpu);
+		/* The CPUs not in filter_cpus are skipped by the handle */
+		record = tracecmd_read_next_data(handles->handle, &cpu);
 
 		if (record) {
 			ret = test_filters(pevent, handles->event_filters, record, 0);
@@ -1198,6 +1178,11 @@ static void read_data_info(struct list_head *handle_list, enum output_type otype
 	if (otype != OUTPUT_NORMAL)
 		return;
 
+	if (filter_cpus) {
+		list_for_each_entry(handles, handle_list, list)
+			tracecmd_filter_next_cpus(handles->handle, filter_cpus);
+	}
+
 	do {
 		last_handle = NULL;
 		last_record = NULL;
@@ -16,6 +16,7 @@
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/utsname.h>
+#include <sys/syscall.h>
 #ifndef NO_PTRACE
 #include <sys/ptrace.h>
 #else
@@ -25,9 +26,11 @@
 #endif
 #include <netdb.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <sched.h>
+#include <pthread.h>
 #include <glob.h>
 #include <errno.h>
 #include <limits.h>
@@ -66,6 +69,9 @@ static const char *output_file = "trace.dat";
 static int latency;
 static int sleep_time = 1000;
 static int recorder_threads;
+static int threaded_recorders;
+static int buffer_percent = -1;
+static const char *compression;
 static struct pid_record_data *pids;
 static int buffers;
 
@@ -78,6 +84,8 @@ static int sfd;
 
 /* Max size to let a per cpu file get */
 static int max_kb;
+/* The number of files -m max_kb is split between */
+static int max_segments = 2;
 
 static bool use_tcp;
 
@@ -516,7 +524,8 @@ static int kill_thread_instance(int start, struct buffer_instance *instance)
 			pids[n].pid = 0;
 			if (pids[n].brass[0] >= 0)
 				close(pids[n].brass[0]);
-		}
+		} else if (pids[n].recorder)
+			delete_temp_file(instance, i);
 		n++;
 	}
 
@@ -592,6 +601,198 @@ static void delete_thread_data(void)
 	}
 }
 
+/* A thread of the threaded recorder (record --threads) */
+struct recorder_thread {
+	pthread_t			thread;
+	int				tid;
+	int				cpu;
+	int				node;
+	int				nr_recorders;
+	struct tracecmd_recorder	**recorders;
+};
+
+static struct recorder_thread *rec_threads;
+static int nr_rec_threads;
+static int stop_recorders;
+
+/* How often to ask a recorder thread to stop, in nanoseconds */
+#define RECORDER_STOP_INTERVAL	10000000
+
+/*
+ * The recorder clears its stop flag when it (re)starts recording, thus
+ * keep on asking each thread to stop until it exits. The signal breaks
+ * the thread out of a blocking read or poll of the ring buffer.
+ */
+static void stop_recorder_threads(void)
+{
+	struct recorder_thread *rt;
+	struct timespec ts;
+	int i, r;
+
+	__atomic_store_n(&stop_recorders, 1, __ATOMIC_RELEASE);
+
+	for (i = 0; i < nr_rec_threads; i++) {
+		rt = &rec_threads[i];
+		do {
+			for (r = 0; r < rt->nr_recorders; r++)
+				tracecmd_stop_recording(rt->recorders[r]);
+			pthread_kill(rt->thread, SIGUSR1);
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += RECORDER_STOP_INTERVAL;
+			ts.tv_sec += ts.tv_nsec / 1000000000;
+			ts.tv_nsec %= 1000000000;
+		} while (pthread_timedjoin_np(rt->thread, NULL, &ts) == ETIMEDOUT);
+		free(rt->recorders);
+	}
+	free(rec_threads);
+	rec_threads = NULL;
+	nr_rec_threads = 0;
+
+	for (i = 0; i < recorder_threads; i++) {
+		if (!pids[i].recorder)
+			continue;
+		tracecmd_free_recorder(pids[i].recorder);
+		pids[i].recorder = NULL;
+		pids[i].pid = -1;
+	}
+}
+
+/*
+ * With the v3 protocol, the recorders write their data into pipes,
+ * and a thread sends the data of all the CPUs of an instance over the
+ * connection to the server.
+ */
+struct mux_sender {
+	struct mux_sender		*next;
+	struct tracecmd_msg_handle	*msg_handle;
+	pthread_t			thread;
+	struct pollfd			*pfds;
+	int				*cpus;
+	int				nr_fds;
+};
+
+static struct mux_sender *mux_senders;
+
+/* The most data of a CPU sent in one message */
+#define MUX_BATCH_SIZE		(256 * 1024)
+
+/* Read what the pipe of a recorder has, up to MUX_BATCH_SIZE */
+static ssize_t read_mux_batch(int fd, char *buf)
+{
+	ssize_t size = 0;
+	ssize_t r;
+
+	while (size < MUX_BATCH_SIZE) {
+		r = read(fd, buf + size, MUX_BATCH_SIZE - size);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && errno == EAGAIN)
+			break;
+		if (r <= 0)
+			return size ? size : r;
+		size += r;
+	}
+
+	return size;
+}
+
+static void *mux_send_thread(void *data)
+{
+	struct mux_sender *mux = data;
+	int active = mux->nr_fds;
+	char *buf;
+	ssize_t r;
+	int i;
+
+	buf = malloc(MUX_BATCH_SIZE);
+	if (!buf)
+		die("Failed to allocate the buffer for sending data");
+
+	while (active) {
+		if (poll(mux->pfds, mux->nr_fds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("waiting for recorder data");
+		}
+
+		for (i = 0; i < mux->nr_fds; i++) {
+			if (!mux->pfds[i].revents)
+				continue;
+			r = read_mux_batch(mux->pfds[i].fd, buf);
+			if (r > 0 && tracecmd_msg_data_send(mux->msg_handle,
+							    mux->cpus[i],
+							    buf, r) < 0) {
+				warning("sending data of cpu %d to server",
+					mux->cpus[i]);
+				r = -1;
+			}
+			if (r > 0 || (r < 0 && errno == EAGAIN))
+				continue;
+			/* The recorder exited (or the connection failed) */
+			close(mux->pfds[i].fd);
+			mux->pfds[i].fd = -1;
+			active--;
+		}
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+static void start_mux_sender(struct tracecmd_msg_handle *msg_handle,
+			     struct pid_record_data *pids, int nr_pids)
+{
+	struct mux_sender *mux;
+	sigset_t mask, old;
+	int i;
+
+	mux = calloc(1, sizeof(*mux));
+	if (!mux)
+		die("Failed to allocate data sender");
+	mux->pfds = calloc(nr_pids, sizeof(*mux->pfds));
+	mux->cpus = calloc(nr_pids, sizeof(*mux->cpus));
+	if (!mux->pfds || !mux->cpus)
+		die("Failed to allocate data sender");
+
+	mux->msg_handle = msg_handle;
+	mux->nr_fds = nr_pids;
+	for (i = 0; i < nr_pids; i++) {
+		mux->pfds[i].fd = pids[i].brass[0];
+		mux->pfds[i].events = POLLIN;
+		mux->cpus[i] = pids[i].cpu;
+		fcntl(pids[i].brass[0], F_SETFL,
+		      fcntl(pids[i].brass[0], F_GETFL) | O_NONBLOCK);
+		/* The sender does not close the pipes before it is done */
+		pids[i].brass[0] = -1;
+	}
+
+	/* Signals are handled by the main thread */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old);
+	if (pthread_create(&mux->thread, NULL, mux_send_thread, mux))
+		die("Failed to create data sender thread");
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	mux->next = mux_senders;
+	mux_senders = mux;
+}
+
+/* Called after the recorders exited, when the pipes are drained */
+static void stop_mux_senders(void)
+{
+	struct mux_sender *mux;
+
+	while (mux_senders) {
+		mux = mux_senders;
+		mux_senders = mux->next;
+		pthread_join(mux->thread, NULL);
+		free(mux->pfds);
+		free(mux->cpus);
+		free(mux);
+	}
+}
+
 static void stop_threads(enum trace_type type)
 {
 	struct timeval tv = { 0, 0 };
@@ -601,6 +802,11 @@ static void stop_threads(enum trace_type type)
 	if (!recorder_threads)
 		return;
 
+	if (threaded_recorders) {
+		stop_recorder_threads();
+		return;
+	}
+
 	/* Tell all threads to finish up */
 	for (i = 0; i < recorder_threads; i++) {
 		if (pids[i].pid > 0) {
@@ -621,6 +827,8 @@ static void stop_threads(enum trace_type type)
 			pids[i].pid = -1;
 		}
 	}
+
+	stop_mux_senders();
 }
 
 static int create_recorder(struct buffer_instance *instance, int cpu,
@@ -2592,12 +2800,14 @@ create_recorder_instance(struct buffer_instance *instance, const char *file, int
 		return create_recorder_instance_pipe(instance, cpu, brass);
 
 	if (!instance->name)
-		return tracecmd_create_recorder_maxkb(file, cpu, recorder_flags, max_kb);
+		return tracecmd_create_recorder_segments(file, cpu, recorder_flags,
+							 max_kb, max_segments);
 
 	path = get_instance_dir(instance);
 
-	record = tracecmd_create_buffer_recorder_maxkb(file, cpu, recorder_flags,
-						       path, max_kb);
+	record = tracecmd_create_buffer_recorder_segments(file, cpu, recorder_flags,
+							  path, max_kb,
+							  max_segments);
 	tracecmd_put_tracing_file(path);
 
 	return record;
@@ -2670,6 +2880,226 @@ static int create_recorder(struct buffer_instance *instance, int cpu,
 	exit(0);
 }
 
+static int cpu_node(int cpu)
+{
+	char path[PATH_MAX];
+	struct dirent *dent;
+	int node = -1;
+	DIR *dir;
+
+	snprintf(path, PATH_MAX, "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+
+	while ((dent = readdir(dir))) {
+		if (sscanf(dent->d_name, "node%d", &node) == 1)
+			break;
+		node = -1;
+	}
+	closedir(dir);
+
+	return node;
+}
+
+static int read_node_cpus(int node, cpu_set_t *set)
+{
+	char path[PATH_MAX];
+	int start, end;
+	int found = 0;
+	FILE *fp;
+	int ch;
+	int i;
+
+	snprintf(path, PATH_MAX, "/sys/devices/system/node/node%d/cpulist", node);
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+
+	/* The format is "0-3,8,10-11" */
+	while (fscanf(fp, "%d", &start) == 1) {
+		end = start;
+		ch = fgetc(fp);
+		if (ch == '-') {
+			if (fscanf(fp, "%d", &end) != 1)
+				break;
+			ch = fgetc(fp);
+		}
+		for (i = start; i <= end && i < CPU_SETSIZE; i++) {
+			CPU_SET(i, set);
+			found = 1;
+		}
+		if (ch != ',')
+			break;
+	}
+	fclose(fp);
+
+	return found;
+}
+
+/*
+ * Keep the recorder of @cpu on the NUMA node of @cpu, so that the
+ * buffer pages it moves stay local. If the node is not known, the
+ * recorder is pinned to @cpu itself.
+ */
+static void set_recorder_affinity(int cpu)
+{
+	cpu_set_t set;
+	int node;
+
+	CPU_ZERO(&set);
+
+	node = cpu_node(cpu);
+	if (node < 0 || !read_node_cpus(node, &set)) {
+		if (cpu >= CPU_SETSIZE)
+			return;
+		CPU_SET(cpu, &set);
+	}
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+		warning("failed to set affinity of recorder for cpu %d", cpu);
+}
+
+static pthread_mutex_t recorder_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t recorder_cond = PTHREAD_COND_INITIALIZER;
+
+static void wake_recorder(int sig)
+{
+	/* Only here to interrupt the recorder */
+}
+
+static void *recorder_thread(void *data)
+{
+	struct recorder_thread *rt = data;
+	sigset_t set;
+	int ret;
+
+	/* All signals but the wake up one are handled by the main thread */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+	set_recorder_affinity(rt->cpu);
+
+	if (rt_prio)
+		set_prio(rt_prio);
+
+	pthread_mutex_lock(&recorder_lock);
+	rt->tid = syscall(SYS_gettid);
+	pthread_cond_signal(&recorder_cond);
+	pthread_mutex_unlock(&recorder_lock);
+
+	while (!__atomic_load_n(&stop_recorders, __ATOMIC_ACQUIRE)) {
+		if (recorder_flags & TRACECMD_RECORD_URING)
+			ret = tracecmd_start_recording_uring(rt->recorders,
+							     rt->nr_recorders,
+							     sleep_time);
+		else if (rt->nr_recorders > 1)
+			ret = tracecmd_start_recording_poll(rt->recorders,
+							    rt->nr_recorders,
+							    sleep_time);
+		else
+			ret = tracecmd_start_recording(rt->recorders[0],
+						       sleep_time);
+		if (ret < 0)
+			break;
+	}
+
+	return NULL;
+}
+
+/*
+ * Used instead of create_recorder() with --threads. Only recording into
+ * the local temp files is supported. The recorders are run by threads,
+ * started by start_recorder_threads().
+ */
+static void create_thread_recorder(struct pid_record_data *pid)
+{
+	char *file;
+
+	file = get_temp_file(pid->instance, pid->cpu);
+	pid->recorder = create_recorder_instance(pid->instance, file,
+						 pid->cpu, NULL);
+	put_temp_file(file);
+
+	if (!pid->recorder)
+		die("can't create recorder");
+}
+
+static struct recorder_thread *add_recorder_thread(int cpu, int node)
+{
+	struct recorder_thread *rt = &rec_threads[nr_rec_threads++];
+
+	rt->cpu = cpu;
+	rt->node = node;
+	rt->recorders = malloc(sizeof(*rt->recorders) * recorder_threads);
+	if (!rt->recorders)
+		die("Failed to allocate recorders of thread");
+
+	return rt;
+}
+
+/*
+ * Each recorder gets its own thread, unless the recorders wait for
+ * data in poll() or use io_uring. Then all the recorders of the CPUs
+ * of a NUMA node are drained by a single thread.
+ */
+static void start_recorder_threads(void)
+{
+	struct recorder_thread *rt;
+	struct sigaction act;
+	sigset_t set, old;
+	int node;
+	int ret;
+	int i, t;
+
+	rec_threads = calloc(recorder_threads, sizeof(*rec_threads));
+	if (!rec_threads)
+		die("Failed to allocate recorder threads");
+
+	for (i = 0; i < recorder_threads; i++) {
+		rt = NULL;
+		node = -1;
+		if (recorder_flags & (TRACECMD_RECORD_POLL | TRACECMD_RECORD_URING))
+			node = cpu_node(pids[i].cpu);
+		for (t = 0; node >= 0 && t < nr_rec_threads; t++) {
+			if (rec_threads[t].node == node) {
+				rt = &rec_threads[t];
+				break;
+			}
+		}
+		if (!rt)
+			rt = add_recorder_thread(pids[i].cpu, node);
+		rt->recorders[rt->nr_recorders++] = pids[i].recorder;
+	}
+
+	/* No SA_RESTART, the blocked splice or poll must return */
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = wake_recorder;
+	sigaction(SIGUSR1, &act, NULL);
+
+	for (t = 0; t < nr_rec_threads; t++) {
+		rt = &rec_threads[t];
+
+		sigfillset(&set);
+		pthread_sigmask(SIG_SETMASK, &set, &old);
+		ret = pthread_create(&rt->thread, NULL, recorder_thread, rt);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		if (ret) {
+			errno = ret;
+			die("Failed to create recorder thread for cpu %d", rt->cpu);
+		}
+
+		/* Wait for the thread id, it must be filtered out of the trace */
+		pthread_mutex_lock(&recorder_lock);
+		while (!rt->tid)
+			pthread_cond_wait(&recorder_cond, &recorder_lock);
+		pthread_mutex_unlock(&recorder_lock);
+
+		add_filter_pid(rt->tid, 1);
+	}
+}
+
 static void check_first_msg_from_server(struct tracecmd_msg_handle *msg_handle)
 {
 	char buf[BUFSIZ];
@@ -2751,16 +3181,25 @@ static void communicate_with_listener_v2(struct tracecmd_msg_handle *msg_handle)
 {
 	if (tracecmd_msg_send_init_data(msg_handle, &client_ports) < 0)
 		die("Cannot communicate with server");
+
+	/* With v3, the data is sent over this connection, not to the ports */
+	if (msg_handle->version == V3_PROTOCOL) {
+		free(client_ports);
+		client_ports = NULL;
+	}
 }
 
 static void check_protocol_version(struct tracecmd_msg_handle *msg_handle)
 {
+	const char *proto = V3_CPU;
 	char buf[BUFSIZ];
 	int fd = msg_handle->fd;
 	int n;
 
 	check_first_msg_from_server(msg_handle);
 
+	msg_handle->version = V3_PROTOCOL;
+ again:
 	/*
 	 * Write the protocol version, the magic number, and the dummy
 	 * option(0) (in ASCII). The client understands whether the client
@@ -2773,7 +3212,7 @@ static void check_protocol_version(struct tracecmd_msg_handle *msg_handle)
 	 * So, we add the dummy number (the magic number and 0 option) to the
 	 * first client message.
 	 */
-	write(fd, V2_CPU, sizeof(V2_CPU));
+	write(fd, proto, strlen(proto) + 1);
 
 	/* read a reply message */
 	n = read(fd, buf, BUFSIZ);
@@ -2783,9 +3222,19 @@ static void check_protocol_version(struct tracecmd_msg_handle *msg_handle)
 		msg_handle->version = V1_PROTOCOL;
 		plog("Use the v1 protocol\n");
 	} else {
-		if (memcmp(buf, "V2", n) != 0)
+		/*
+		 * A server that does not know v3 answers with "V2", and
+		 * waits for the client to ask for it.
+		 */
+		if (msg_handle->version == V3_PROTOCOL &&
+		    memcmp(buf, "V2", n) == 0) {
+			msg_handle->version = V2_PROTOCOL;
+			proto = V2_CPU;
+			goto again;
+		}
+		if (memcmp(buf, proto + 2, n) != 0)
 			die("Cannot handle the protocol %s", buf);
-		/* OK, let's use v2 protocol */
+		/* OK, let's use v2 (or v3) protocol */
 		write(fd, V2_MAGIC, sizeof(V2_MAGIC));
 
 		n = read(fd, buf, BUFSIZ - 1);
@@ -2861,7 +3310,7 @@ again:
 	if (use_tcp)
 		msg_handle->flags |= TRACECMD_MSG_FL_USE_TCP;
 
-	if (msg_handle->version == V2_PROTOCOL) {
+	if (msg_handle->version >= V2_PROTOCOL) {
 		check_protocol_version(msg_handle);
 		if (msg_handle->version == V1_PROTOCOL) {
 			/* reconnect to the server for using the v1 protocol */
@@ -2886,7 +3335,7 @@ setup_connection(struct buffer_instance *instance)
 	msg_handle = setup_network();
 
 	/* Now create the handle through this socket */
-	if (msg_handle->version == V2_PROTOCOL) {
+	if (msg_handle->version >= V2_PROTOCOL) {
 		network_handle = tracecmd_create_init_fd_msg(msg_handle, listed_events);
 		tracecmd_msg_finish_sending_metadata(msg_handle);
 	} else
@@ -2901,7 +3350,7 @@ setup_connection(struct buffer_instance *instance)
 
 static void finish_network(struct tracecmd_msg_handle *msg_handle)
 {
-	if (msg_handle->version == V2_PROTOCOL)
+	if (msg_handle->version >= V2_PROTOCOL)
 		tracecmd_msg_send_close_msg(msg_handle);
 	tracecmd_msg_handle_close(msg_handle);
 	free(host);
@@ -2925,17 +3374,31 @@ void start_threads(enum trace_type type, int global)
 
 	memset(pids, 0, sizeof(*pids) * total_cpu_count * (buffers + 1));
 
+	if (threaded_recorders && ((type & TRACE_TYPE_STREAM) || host)) {
+		warning("--threads is only supported when recording to a file");
+		threaded_recorders = 0;
+	}
+
 	for_all_instances(instance) {
+		bool mux = false;
+		int first = i;
 		int x, pid;
 
 		if (host) {
 			instance->msg_handle = setup_connection(instance);
 			if (!instance->msg_handle)
 				die("Failed to make connection");
+			mux = instance->msg_handle->version == V3_PROTOCOL;
 		}
 
 		for (x = 0; x < instance->cpu_count; x++) {
-			if (type & TRACE_TYPE_STREAM) {
+			if (mux) {
+				/* The recorder writes into a pipe for the sender */
+				brass = pids[i].brass;
+				if (pipe(brass) < 0)
+					die("pipe");
+				fcntl(brass[0], F_SETPIPE_SZ, MUX_BATCH_SIZE);
+			} else if (type & TRACE_TYPE_STREAM) {
 				brass = pids[i].brass;
 				ret = pipe(brass);
 				if (ret < 0)
@@ -2951,6 +3414,10 @@ void start_threads(enum trace_type type, int global)
 				pids[i].brass[0] = -1;
 			pids[i].cpu = x;
 			pids[i].instance = instance;
+			if (threaded_recorders) {
+				create_thread_recorder(&pids[i++]);
+				continue;
+			}
 			/* Make sure all output is flushed before forking */
 			fflush(stdout);
 			pid = pids[i++].pid = create_recorder(instance, x, type, brass);
@@ -2959,8 +3426,17 @@ void start_threads(enum trace_type type, int global)
 			if (pid > 0)
 				add_filter_pid(pid, 1);
 		}
+
+		if (mux) {
+			start_mux_sender(instance->msg_handle, &pids[first],
+					 i - first);
+			brass = NULL;
+		}
 	}
 	recorder_threads = i;
+
+	if (threaded_recorders)
+		start_recorder_threads();
 }
 
 static void touch_file(const char *file)
@@ -3002,8 +3478,9 @@ static void append_buffer(struct tracecmd_output *handle,
 			touch_file(temp_files[i]);
 	}
 
-	tracecmd_append_buffer_cpu_data(handle, buffer_option,
-					cpu_count, temp_files);
+	if (tracecmd_append_buffer_cpu_data(handle, buffer_option,
+					    cpu_count, temp_files) < 0)
+		die("Failed to write the data of buffer %s", instance->name);
 
 	for (i = 0; i < instance->cpu_count; i++) {
 		if (i >= instance->cpu_count)
@@ -3138,6 +3615,10 @@ static void record_data(char *date2ts, int flags)
 		if (!handle)
 			die("Error creating output file");
 
+		if (compression &&
+		    tracecmd_output_set_compression(handle, compression) < 0)
+			die("Unsupported compression '%s'", compression);
+
 		if (date2ts) {
 			int type = 0;
 
@@ -3189,7 +3670,9 @@ static void record_data(char *date2ts, int flags)
 		if (!no_top_instance() && !top_instance.msg_handle)
 			print_stat(&top_instance);
 
-		tracecmd_append_cpu_data(handle, local_cpu_count, temp_files);
+		if (tracecmd_append_cpu_data(handle, local_cpu_count,
+					     temp_files) < 0)
+			die("Failed to write the CPU data");
 
 		for (i = 0; i < max_cpu_count; i++)
 			put_temp_file(temp_files[i]);
@@ -3204,6 +3687,10 @@ static void record_data(char *date2ts, int flags)
 			}
 		}
 
+		/* The temp files of all the buffers are copied together */
+		if (tracecmd_wait_cpu_data(handle) < 0)
+			die("Failed to write the CPU data");
+
 		free(temp_files);
 	}
 	if (!handle)
@@ -3621,6 +4108,49 @@ void set_buffer_size(void)
 		set_buffer_size_instance(instance);
 }
 
+/*
+ * buffer_percent is how full the ring buffer must be before the
+ * readers waiting for data (record --poll) are woken up.
+ */
+static void set_buffer_percent(void)
+{
+	struct buffer_instance *instance;
+	struct stat st;
+	char buf[BUFSIZ];
+	char *path;
+	int ret;
+	int fd;
+
+	if (buffer_percent < 0)
+		return;
+
+	snprintf(buf, BUFSIZ, "%d", buffer_percent);
+
+	for_all_instances(instance) {
+		path = get_instance_file(instance, "buffer_percent");
+		if (stat(path, &st) < 0) {
+			warning("Kernel does not support buffer_percent");
+			tracecmd_put_tracing_file(path);
+			return;
+		}
+
+		reset_save_file(path, RESET_DEFAULT_PRIO);
+
+		fd = open(path, O_WRONLY);
+		if (fd < 0) {
+			warning("can't open %s", path);
+			goto next;
+		}
+
+		ret = write(fd, buf, strlen(buf));
+		if (ret < 0)
+			warning("Can't write to %s", path);
+		close(fd);
+ next:
+		tracecmd_put_tracing_file(path);
+	}
+}
+
 static void
 process_event_trigger(char *path, struct event_iter *iter, enum event_process *processed)
 {
@@ -4296,6 +4826,11 @@ enum {
 	OPT_funcstack		= 254,
 	OPT_date		= 255,
 	OPT_module		= 256,
+	OPT_threads		= 257,
+	OPT_poll		= 258,
+	OPT_uring		= 259,
+	OPT_compress		= 260,
+	OPT_segments		= 261,
 };
 
 void trace_stop(int argc, char **argv)
@@ -4484,6 +5019,7 @@ struct common_record_context {
 	int topt;
 	int do_child;
 	int run_command;
+	int sleep_set;
 };
 
 static void init_common_record_context(struct common_record_context *ctx,
@@ -4537,6 +5073,11 @@ static void parse_record_options(int argc,
 			{"quiet", no_argument, NULL, OPT_quiet},
 			{"help", no_argument, NULL, '?'},
 			{"module", required_argument, NULL, OPT_module},
+			{"threads", no_argument, NULL, OPT_threads},
+			{"poll", optional_argument, NULL, OPT_poll},
+			{"uring", no_argument, NULL, OPT_uring},
+			{"compress", optional_argument, NULL, OPT_compress},
+			{"segments", required_argument, NULL, OPT_segments},
 			{NULL, 0, NULL, 0}
 		};
 
@@ -4717,6 +5258,7 @@ static void parse_record_options(int argc,
 			if (!optarg)
 				usage(argv);
 			sleep_time = atoi(optarg);
+			ctx->sleep_set = 1;
 			break;
 		case 'S':
 			ctx->manual = 1;
@@ -4779,6 +5321,38 @@ static void parse_record_options(int argc,
 		case OPT_nosplice:
 			recorder_flags |= TRACECMD_RECORD_NOSPLICE;
 			break;
+		case OPT_threads:
+			threaded_recorders = 1;
+			break;
+		case OPT_uring:
+			recorder_flags |= TRACECMD_RECORD_URING;
+			break;
+		case OPT_compress: {
+			struct tracecmd_compression *compress;
+
+			compression = optarg ? optarg : "";
+			/* Fail now, rather than after the recording */
+			compress = tracecmd_compress_alloc(compression);
+			if (!compress)
+				die("Unsupported compression '%s'", compression);
+			tracecmd_compress_free(compress);
+			break;
+		}
+		case OPT_segments:
+			if (!IS_RECORD(ctx))
+				die("only record takes --segments option");
+			max_segments = atoi(optarg);
+			if (max_segments < 2)
+				die("--segments must be at least 2");
+			break;
+		case OPT_poll:
+			recorder_flags |= TRACECMD_RECORD_POLL;
+			if (optarg) {
+				buffer_percent = atoi(optarg);
+				if (buffer_percent < 0 || buffer_percent > 100)
+					die("--poll percent must be between 0 and 100");
+			}
+			break;
 		case OPT_profile:
 			handle_init = trace_init_profile;
 			ctx->instance->flags |= BUFFER_FL_PROFILE;
@@ -4830,6 +5404,17 @@ static void parse_record_options(int argc,
 		add_func(&ctx->instance->filter_funcs,
 			 ctx->instance->filter_mod, "*");
 
+	/* The listener writes the file, without compression */
+	if (compression && host)
+		die("--compress can not be used with -N");
+
+	/*
+	 * When waiting in poll, the sleep time only limits how long a
+	 * recorder may take to notice that it was stopped.
+	 */
+	if ((recorder_flags & TRACECMD_RECORD_POLL) && !ctx->sleep_set)
+		sleep_time = 1000000;
+
 	if (do_ptrace && !filter_task && (filter_pid < 0))
 		die(" -c can only be used with -F (or -P with event-fork support)");
 	if (ctx->do_child && !filter_task &&! filter_pid)
@@ -4960,6 +5545,7 @@ static void record_trace(int argc, char **argv,
 	}
 
 	set_buffer_size();
+	set_buffer_percent();
 	update_plugins(type);
 	set_options();
 
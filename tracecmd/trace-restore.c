@@ -131,7 +131,8 @@ void trace_restore (int argc, char **argv)
 	if (!handle)
 		die("error writing to %s", output);
 
-	if (tracecmd_append_cpu_data(handle, args, &argv[first_arg]) < 0)
+	if (tracecmd_append_cpu_data(handle, args, &argv[first_arg]) < 0 ||
+	    tracecmd_wait_cpu_data(handle) < 0)
 		die("failed to append data");
 
 	return;
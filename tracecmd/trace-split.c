@@ -150,13 +150,30 @@ static void write_page(struct tep_handle *pevent,
 	write(cpu_data->fd, cpu_data->page, page_size);
 }
 
+/* When splitting per CPU, the records are read a page at a time */
+static struct tracecmd_page_records page_records;
+static int page_record_idx;
+
 static struct tep_record *read_record(struct tracecmd_input *handle,
 				      int percpu, int *cpu)
 {
-	if (percpu)
-		return tracecmd_read_data(handle, *cpu);
+	if (!percpu)
+		return tracecmd_read_next_data(handle, cpu);
+
+	if (page_record_idx >= page_records.nr_records) {
+		if (tracecmd_read_page_records(handle, *cpu, &page_records) <= 0)
+			return NULL;
+		page_record_idx = 0;
+	}
 
-	return tracecmd_read_next_data(handle, cpu);
+	return &page_records.records[page_record_idx++];
+}
+
+static void put_record(struct tep_record *record, int percpu)
+{
+	/* The records of a page are released with the page */
+	if (!percpu)
+		free_record(record);
 }
 
 static void set_cpu_time(struct tracecmd_input *handle,
@@ -164,6 +181,8 @@ static void set_cpu_time(struct tracecmd_input *handle,
 {
 	if (percpu) {
 		tracecmd_set_cpu_to_timestamp(handle, cpu, start);
+		/* Read from the new location of the CPU iterator */
+		page_record_idx = page_records.nr_records;
 		return;
 	}
 
@@ -215,7 +234,7 @@ static int parse_cpu(struct tracecmd_input *handle,
 	if (start) {
 		set_cpu_time(handle, percpu, start, cpu, cpus);
 		while (record && record->ts < start) {
-			free_record(record);
+			put_record(record, percpu);
 			record = read_record(handle, percpu, &cpu);
 		}
 	} else if (record)
@@ -250,7 +269,7 @@ static int parse_cpu(struct tracecmd_input *handle,
 		cpu_data[cpu].offset = record->offset;
 
 		if (write_record(handle, record, &cpu_data[cpu], type)) {
-			free_record(record);
+			put_record(record, percpu);
 			record = read_record(handle, percpu, &cpu);
 
 			/* if we hit the end of the cpu, clear the offset */
@@ -269,7 +288,7 @@ static int parse_cpu(struct tracecmd_input *handle,
 				if (record &&
 				    record->ts >
 				    (start + (unsigned long long)count_limit * 1000000000ULL)) {
-					free_record(record);
+					put_record(record, percpu);
 					record = NULL;
 				}
 				break;
@@ -277,7 +296,7 @@ static int parse_cpu(struct tracecmd_input *handle,
 				if (record &&
 				    record->ts >
 				    (start + (unsigned long long)count_limit * 1000000ULL)) {
-					free_record(record);
+					put_record(record, percpu);
 					record = NULL;
 				}
 				break;
@@ -285,13 +304,13 @@ static int parse_cpu(struct tracecmd_input *handle,
 				if (record &&
 				    record->ts >
 				    (start + (unsigned long long)count_limit * 1000ULL)) {
-					free_record(record);
+					put_record(record, percpu);
 					record = NULL;
 				}
 				break;
 			case SPLIT_EVENTS:
 				if (++count >= count_limit) {
-					free_record(record);
+					put_record(record, percpu);
 					record = NULL;
 				}
 				break;
@@ -302,7 +321,10 @@ static int parse_cpu(struct tracecmd_input *handle,
 	}
 
 	if (record)
-		free_record(record);
+		put_record(record, percpu);
+
+	tracecmd_free_page_records(&page_records);
+	page_record_idx = 0;
 
 	if (percpu) {
 		if (cpu_data[cpu].page) {
@@ -385,7 +407,9 @@ static double parse_file(struct tracecmd_input *handle,
 	for (cpu = 0; cpu < cpus; cpu ++)
 		cpu_list[cpu] = cpu_data[cpu].file;
 
-	tracecmd_append_cpu_data(ohandle, cpus, cpu_list);
+	if (tracecmd_append_cpu_data(ohandle, cpus, cpu_list) < 0 ||
+	    tracecmd_wait_cpu_data(ohandle) < 0)
+		die("Failed to write the CPU data to %s", output_file);
 
 	current = end;
 	for (cpu = 0; cpu < cpus; cpu++) {
@@ -56,6 +56,12 @@ static struct usage_help usage_help[] = {
 		"          --func-stack perform a stack trace for function tracer\n"
 		"             (use with caution)\n"
 		"          --max-graph-depth limit function_graph depth\n"
+		"          --threads run the per CPU recorders as threads of one process\n"
+		"          --poll[=percent] wait for data in poll instead of sleeping\n"
+		"             (percent sets the buffer_percent watermark)\n"
+		"          --uring use io_uring to read the ring buffers (if supported)\n"
+		"          --compress[=codec[:level]] compress the trace data (zstd, zlib)\n"
+		"          --segments n split the -m max size between n files per CPU\n"
 	},
 	{
 		"start",
@@ -229,12 +235,14 @@ static struct usage_help usage_help[] = {
 	{
 		"listen",
 		"listen on a network socket for trace clients",
-		" %s listen -p port[-D][-o file][-d dir][-l logfile]\n"
+		" %s listen -p port[-D][-o file][-d dir][-l logfile][--epoll[=workers]]\n"
 		"          Creates a socket to listen for clients.\n"
 		"          -D create it in daemon mode.\n"
 		"          -o file name to use for clients.\n"
 		"          -d diretory to store client files.\n"
 		"          -l logfile to write messages to.\n"
+		"          --epoll handle all clients in one process, with worker threads\n"
+		"             waiting in epoll for the data of all CPUs (default 1 worker)\n"
 	},
 	{
 		"list",